@@ -0,0 +1,392 @@
+#version 430
+
+// NOTE(ajeej): builds the bottom level bvh of one mesh from the triangles
+// that are already on the gpu. Every program is built from this file with
+// one of the LBVH_ stages defined after the version line, see
+// build_gpu_mesh_bvh for the order they run in. The tree is a karras lbvh
+// with one triangle per leaf, written straight into the node and prim
+// buffers of ray_tracer.glsl.
+layout(local_size_x = 256) in;
+
+#define LBVH_GROUP_SIZE 256
+#define LBVH_RADIX_SIZE 256
+
+// NOTE(ajeej): Triangle and BvhNode of ray_tracer.glsl
+struct Triangle {
+    vec3 v0;
+    vec3 e1;
+    vec3 e2;
+};
+
+struct BvhNode {
+    vec3 min;
+    uint first;
+    vec3 max;
+    uint count;
+};
+
+layout(std430, binding = 3) buffer TriangleBuffer {
+    Triangle triangles[];
+};
+
+// NOTE(ajeej): coherent since the refit reads boxes other invocations wrote
+layout(std430, binding = 5) coherent buffer BvhNodeBuffer {
+    BvhNode bvh_nodes[];
+};
+
+layout(std430, binding = 6) buffer BvhPrimBuffer {
+    uint bvh_prims[];
+};
+
+layout(std430, binding = 12) buffer VertexBuffer {
+    float verts[];
+};
+
+layout(std430, binding = 13) buffer IndexBuffer {
+    uint tri_indices[];
+};
+
+// NOTE(ajeej): the sort goes back and forth between the two key and id
+// buffers, keys_in and ids_in are always the ones holding the last pass
+layout(std430, binding = 17) buffer LbvhKeyInBuffer {
+    uint keys_in[];
+};
+
+layout(std430, binding = 18) buffer LbvhIdInBuffer {
+    uint ids_in[];
+};
+
+layout(std430, binding = 19) buffer LbvhKeyOutBuffer {
+    uint keys_out[];
+};
+
+layout(std430, binding = 20) buffer LbvhIdOutBuffer {
+    uint ids_out[];
+};
+
+// NOTE(ajeej): digit counts of every work group, all the work groups of a
+// digit are next to each other so the exclusive sum over the whole buffer
+// is where every work group writes its keys of every digit
+layout(std430, binding = 21) buffer LbvhHistBuffer {
+    uint radix_hist[];
+};
+
+// NOTE(ajeej): centroid bounds as ordered uints so they can be grown with
+// atomicMin and atomicMax
+layout(std430, binding = 22) buffer LbvhBoundsBuffer {
+    uint centroid_min[3];
+    uint centroid_max[3];
+};
+
+// NOTE(ajeej): interior node i of the karras tree sits in slot
+// node_slots[i] of the output and keeps its children in slots 2i+1 and
+// 2i+2, so the two children are next to each other like bvh_node_t wants.
+// The parents are interior node indices, parents[n-1+k] is the parent of
+// leaf k. refit_flags count the children of a node that are done.
+layout(std430, binding = 23) buffer LbvhNodeBuffer {
+    uint node_slots[];
+};
+
+layout(std430, binding = 24) buffer LbvhParentBuffer {
+    uint parents[];
+};
+
+layout(std430, binding = 25) buffer LbvhFlagBuffer {
+    uint refit_flags[];
+};
+
+uniform uint tri_cache;
+uniform uint tri_first;
+uniform uint tri_count;
+uniform uint node_offset;
+uniform uint prim_offset;
+uniform uint radix_shift;
+uniform uint group_count;
+
+vec3 get_vertex(uint idx)
+{
+    return vec3(verts[idx*3], verts[idx*3+1], verts[idx*3+2]);
+}
+
+void get_triangle_bounds(uint tri_id, out vec3 lo, out vec3 hi)
+{
+    vec3 v0, v1, v2;
+    if(tri_cache != 0) {
+        Triangle tri = triangles[tri_id];
+        v0 = tri.v0;
+        v1 = tri.v0 + tri.e1;
+        v2 = tri.v0 + tri.e2;
+    }
+    else {
+        v0 = get_vertex(tri_indices[tri_id*3]);
+        v1 = get_vertex(tri_indices[tri_id*3+1]);
+        v2 = get_vertex(tri_indices[tri_id*3+2]);
+    }
+    
+    lo = min(v0, min(v1, v2));
+    hi = max(v0, max(v1, v2));
+}
+
+// NOTE(ajeej): flips the sign bit of positive floats and every bit of
+// negative ones, which orders the uints like the floats
+uint float_to_ordered(float f)
+{
+    uint bits = floatBitsToUint(f);
+    return ((bits & 0x80000000u) != 0) ? ~bits : (bits | 0x80000000u);
+}
+
+float ordered_to_float(uint bits)
+{
+    return uintBitsToFloat(((bits & 0x80000000u) != 0) ? (bits & 0x7FFFFFFFu) : ~bits);
+}
+
+vec3 get_centroid(uint idx)
+{
+    vec3 lo, hi;
+    get_triangle_bounds(tri_first + idx, lo, hi);
+    return (lo + hi) * 0.5;
+}
+
+// NOTE(ajeej): spreads 10 bits so there are two zero bits between each
+uint expand_morton_bits(uint v)
+{
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+// NOTE(ajeej): length of the common prefix of the sorted keys i and j, -1 if
+// j is out of range. Equal keys fall back to the prefix of their indices so
+// every key is unique.
+int get_prefix_length(int i, int j)
+{
+    if(j < 0 || j >= int(tri_count))
+        return -1;
+    
+    uint a = keys_in[i], b = keys_in[j];
+    if(a == b)
+        return 32 + 31 - findMSB(uint(i ^ j));
+    return 31 - findMSB(a ^ b);
+}
+
+shared uint group_digits[LBVH_GROUP_SIZE];
+shared uint digit_sums[LBVH_RADIX_SIZE];
+
+#if defined(LBVH_BOUNDS)
+
+// NOTE(ajeej): one invocation per triangle, the bounds have to be reset to
+// an empty box before the dispatch
+void main() {
+    uint idx = gl_GlobalInvocationID.x;
+    if(idx >= tri_count)
+        return;
+    
+    vec3 c = get_centroid(idx);
+    for(int axis = 0; axis < 3; axis++) {
+        atomicMin(centroid_min[axis], float_to_ordered(c[axis]));
+        atomicMax(centroid_max[axis], float_to_ordered(c[axis]));
+    }
+}
+
+#elif defined(LBVH_MORTON)
+
+void main() {
+    uint idx = gl_GlobalInvocationID.x;
+    if(idx >= tri_count)
+        return;
+    
+    vec3 lo = vec3(ordered_to_float(centroid_min[0]), ordered_to_float(centroid_min[1]),
+                   ordered_to_float(centroid_min[2]));
+    vec3 hi = vec3(ordered_to_float(centroid_max[0]), ordered_to_float(centroid_max[1]),
+                   ordered_to_float(centroid_max[2]));
+    vec3 extent = hi - lo;
+    vec3 scale = mix(vec3(0.0), 1023.0 / extent, greaterThan(extent, vec3(0.0)));
+    
+    uvec3 q = uvec3(clamp((get_centroid(idx) - lo) * scale, vec3(0.0), vec3(1023.0)));
+    keys_in[idx] = (expand_morton_bits(q.x) << 2) | (expand_morton_bits(q.y) << 1) |
+        expand_morton_bits(q.z);
+    ids_in[idx] = idx;
+}
+
+#elif defined(LBVH_SORT_COUNT)
+
+// NOTE(ajeej): counts the digits at radix_shift of one block of keys
+void main() {
+    uint local_idx = gl_LocalInvocationID.x;
+    uint idx = gl_GlobalInvocationID.x;
+    
+    digit_sums[local_idx] = 0;
+    barrier();
+    
+    if(idx < tri_count)
+        atomicAdd(digit_sums[(keys_in[idx] >> radix_shift) & 0xFFu], 1);
+    barrier();
+    
+    radix_hist[local_idx*group_count + gl_WorkGroupID.x] = digit_sums[local_idx];
+}
+
+#elif defined(LBVH_SORT_SCAN)
+
+// NOTE(ajeej): one work group turns the counts into offsets, every
+// invocation sums the work groups of its own digit and the digit totals are
+// summed after
+void main() {
+    uint digit = gl_LocalInvocationID.x;
+    
+    uint sum = 0;
+    for(uint g = 0; g < group_count; g++) {
+        uint count = radix_hist[digit*group_count + g];
+        radix_hist[digit*group_count + g] = sum;
+        sum += count;
+    }
+    digit_sums[digit] = sum;
+    barrier();
+    
+    if(digit == 0) {
+        uint total = 0;
+        for(uint d = 0; d < LBVH_RADIX_SIZE; d++) {
+            uint count = digit_sums[d];
+            digit_sums[d] = total;
+            total += count;
+        }
+    }
+    barrier();
+    
+    for(uint g = 0; g < group_count; g++)
+        radix_hist[digit*group_count + g] += digit_sums[digit];
+}
+
+#elif defined(LBVH_SORT_SCATTER)
+
+// NOTE(ajeej): the keys of a work group with the same digit keep their
+// order, so every pass is stable
+void main() {
+    uint local_idx = gl_LocalInvocationID.x;
+    uint idx = gl_GlobalInvocationID.x;
+    
+    uint digit = (idx < tri_count) ? (keys_in[idx] >> radix_shift) & 0xFFu : LBVH_RADIX_SIZE;
+    group_digits[local_idx] = digit;
+    barrier();
+    
+    if(idx >= tri_count)
+        return;
+    
+    uint rank = 0;
+    for(uint i = 0; i < local_idx; i++)
+        rank += (group_digits[i] == digit) ? 1 : 0;
+    
+    uint dst = radix_hist[digit*group_count + gl_WorkGroupID.x] + rank;
+    keys_out[dst] = keys_in[idx];
+    ids_out[dst] = ids_in[idx];
+}
+
+#elif defined(LBVH_HIERARCHY)
+
+// NOTE(ajeej): one invocation per interior node, finds the range of sorted
+// keys the node covers and where it splits, then writes both children.
+// Leaves get their box here, interior children only get their links and
+// are fitted by LBVH_REFIT.
+void main() {
+    int i = int(gl_GlobalInvocationID.x);
+    int n = int(tri_count);
+    if(i >= n-1)
+        return;
+    
+    int d = (get_prefix_length(i, i+1) - get_prefix_length(i, i-1) >= 0) ? 1 : -1;
+    int min_prefix = get_prefix_length(i, i-d);
+    
+    int max_len = 2;
+    while(get_prefix_length(i, i + max_len*d) > min_prefix)
+        max_len *= 2;
+    
+    int len = 0;
+    for(int step = max_len/2; step >= 1; step /= 2)
+        if(get_prefix_length(i, i + (len+step)*d) > min_prefix)
+            len += step;
+    int j = i + len*d;
+    
+    int node_prefix = get_prefix_length(i, j);
+    int split = 0;
+    int step = len;
+    do {
+        step = (step+1) >> 1;
+        if(get_prefix_length(i, i + (split+step)*d) > node_prefix)
+            split += step;
+    } while(step > 1);
+    split = i + split*d + min(d, 0);
+    
+    if(i == 0) {
+        node_slots[0] = 0;
+        bvh_nodes[node_offset].first = node_offset + 1;
+        bvh_nodes[node_offset].count = 0;
+    }
+    
+    int children[2] = int[2](split, split+1);
+    bool leaves[2] = bool[2](min(i, j) == split, max(i, j) == split+1);
+    for(int c = 0; c < 2; c++)
+    {
+        uint slot = uint(2*i + 1 + c);
+        BvhNode node;
+        if(leaves[c]) {
+            uint leaf = uint(children[c]);
+            get_triangle_bounds(tri_first + ids_in[leaf], node.min, node.max);
+            node.first = prim_offset + leaf;
+            node.count = 1;
+            parents[n-1 + leaf] = uint(i);
+        }
+        else {
+            uint child = uint(children[c]);
+            node.min = vec3(0.0);
+            node.max = vec3(0.0);
+            node.first = node_offset + 2*child + 1;
+            node.count = 0;
+            node_slots[child] = slot;
+            parents[child] = uint(i);
+        }
+        bvh_nodes[node_offset + slot] = node;
+    }
+}
+
+#elif defined(LBVH_REFIT)
+
+// NOTE(ajeej): one invocation per leaf walks up the tree, the second child
+// to arrive at a node fits its box and goes on to the parent. A mesh with a
+// single triangle is a single leaf in slot 0.
+void main() {
+    uint leaf = gl_GlobalInvocationID.x;
+    if(leaf >= tri_count)
+        return;
+    
+    bvh_prims[prim_offset + leaf] = tri_first + ids_in[leaf];
+    
+    if(tri_count == 1) {
+        BvhNode node;
+        get_triangle_bounds(tri_first + ids_in[0], node.min, node.max);
+        node.first = prim_offset;
+        node.count = 1;
+        bvh_nodes[node_offset] = node;
+        return;
+    }
+    
+    uint parent = parents[tri_count-1 + leaf];
+    while(true)
+    {
+        memoryBarrierBuffer();
+        if(atomicAdd(refit_flags[parent], 1) == 0)
+            return;
+        
+        BvhNode left = bvh_nodes[node_offset + 2*parent + 1];
+        BvhNode right = bvh_nodes[node_offset + 2*parent + 2];
+        uint slot = node_offset + node_slots[parent];
+        bvh_nodes[slot].min = min(left.min, right.min);
+        bvh_nodes[slot].max = max(left.max, right.max);
+        
+        if(parent == 0)
+            return;
+        parent = parents[parent];
+    }
+}
+
+#endif
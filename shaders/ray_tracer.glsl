@@ -1,6 +1,14 @@
 #version 430
 
+// NOTE(ajeej): every program of the wavefront pipeline is built from this
+// file with one of WAVE_GENERATE, WAVE_EXTEND, WAVE_SHADE or WAVE_ACCUMULATE
+// defined after the version line. Generate and accumulate run once per
+// pixel, extend and shade once per ray in the queue.
+#if defined(WAVE_EXTEND) || defined(WAVE_SHADE)
+layout(local_size_x = 64) in;
+#else
 layout(local_size_x = 8, local_size_y = 8) in;
+#endif
 layout(rgba32f, binding = 0) uniform image2D texture;
 
 struct Sphere {
@@ -16,11 +24,41 @@ struct Mesh {
     uint tri_idx;
     uint tri_count;
     uint mat_id;
+    uint bvh_root;
+    uint blas_id;
 };
 
+// NOTE(ajeej): shape_t, see the SHAPE_ types for what pos, u and v hold
+struct Shape {
+    vec3 pos;
+    uint type;
+    vec3 u;
+    uint mat_id;
+    vec3 v;
+    float p0;
+};
+
+// NOTE(ajeej): triangle_t, only what the triangle test needs. The normal
+// is in TriangleAttr and only read for the closest hit. Both are only
+// filled when tri_cache is set, otherwise the triangles are read from the
+// shared vertices.
 struct Triangle {
-    vec3 v[3];
-    vec3 n[3];
+    vec3 v0;
+    vec3 e1;
+    vec3 e2;
+};
+
+struct TriangleAttr {
+    vec3 norm;
+};
+
+// NOTE(ajeej): bvh_node_t, interior nodes keep the index of their left
+// child in first (the right child follows it), leaves index bvh_prims
+struct BvhNode {
+    vec3 min;
+    uint first;
+    vec3 max;
+    uint count;
 };
 
 struct Material {
@@ -43,6 +81,37 @@ struct HitInfo {
     bool hit;
 };
 
+// NOTE(ajeej): gpu_wave_ray_t, a path between bounces. color is what the
+// light reaching the next hit gets multiplied by and bsdf_pdf is the pdf dir
+// was picked with, 0 if light sampling could not have found it.
+struct WaveRay {
+    vec3 origin;
+    uint pixel;
+    vec3 dir;
+    uint sample_id;
+    vec3 color;
+    uint rng_counter;
+    float bsdf_pdf;
+};
+
+// NOTE(ajeej): gpu_hit_record_t, the hit of the ray in the same slot of the
+// queue. A negative dist means the ray missed.
+struct HitRecord {
+    vec3 point;
+    float dist;
+    vec3 norm;
+    uint mat_id;
+};
+
+// NOTE(ajeej): gpu_wave_queue_t, the first three values are the work group
+// counts glDispatchComputeIndirect reads to run one invocation per ray
+struct WaveQueue {
+    uint groups_x, groups_y, groups_z;
+    uint count;
+};
+
+// NOTE(ajeej): the light_count spheres with an emissive material are copied
+// again after the sphere_count spheres of the scene
 layout(std430, binding = 1) buffer SphereBuffer {
     Sphere spheres[];
 };
@@ -55,12 +124,91 @@ layout(std430, binding = 3) buffer TriangleBuffer {
     Triangle triangles[];
 };
 
+layout(std430, binding = 11) buffer TriangleAttrBuffer {
+    TriangleAttr tri_attrs[];
+};
+
+// NOTE(ajeej): three floats per vertex and three vertex indices per triangle
+layout(std430, binding = 12) buffer VertexBuffer {
+    float verts[];
+};
+
+layout(std430, binding = 13) buffer IndexBuffer {
+    uint tri_indices[];
+};
+
+// NOTE(ajeej): the first plane_count shapes are the planes, which are not
+// in the bvh and get tested with every ray
+layout(std430, binding = 14) buffer ShapeBuffer {
+    Shape shapes[];
+};
+
+// NOTE(ajeej): sphere_grid_t, the spheres of cell c are grid_prims from
+// grid_cells[c] up to grid_cells[c+1]. grid_cell_count is 0 when the spheres
+// are in the bvh instead.
+layout(std430, binding = 15) buffer GridCellBuffer {
+    uint grid_cells[];
+};
+
+layout(std430, binding = 16) buffer GridPrimBuffer {
+    uint grid_prims[];
+};
+
 layout(std430, binding = 4) buffer MeshBuffer {
     Mesh meshes[];
 };
 
+layout(std430, binding = 5) buffer BvhNodeBuffer {
+    BvhNode bvh_nodes[];
+};
+
+// NOTE(ajeej): the bottom level bvhs of the meshes index triangles, the
+// top level one indexes spheres, meshes marked with BVH_MESH_PRIM or shapes
+// marked with BVH_SHAPE_PRIM
+layout(std430, binding = 6) buffer BvhPrimBuffer {
+    uint bvh_prims[];
+};
+
+// NOTE(ajeej): the two ray queues take turns, queue_in is read by extend
+// and shade while shade appends the rays that go on to the other one
+layout(std430, binding = 7) buffer WaveRayBuffer {
+    WaveRay wave_rays[];
+};
+
+layout(std430, binding = 8) buffer HitRecordBuffer {
+    HitRecord hit_records[];
+};
+
+layout(std430, binding = 9) buffer WaveQueueBuffer {
+    WaveQueue wave_queues[2];
+};
+
+// NOTE(ajeej): radiance summed over the samples of this frame, every path
+// only ever adds to its own pixel so no atomics are needed
+layout(std430, binding = 10) buffer RadianceBuffer {
+    vec4 radiance[];
+};
+
+#define BVH_MESH_PRIM 0x80000000u
+#define BVH_SHAPE_PRIM 0x40000000u
+#define SHAPE_PLANE 0u
+#define SHAPE_QUAD 1u
+#define SHAPE_DISK 2u
+#define SHAPE_BOX 3u
+#define BVH_STACK_SIZE 64
+#define WAVE_GROUP_SIZE 64
+#define SAMPLER_RANDOM 0u
+#define SAMPLER_SOBOL 1u
+#define SAMPLER_BLUE_NOISE 2u
+#define SAMPLER_DIMS 4u
+#define PI 3.1415926
+
 uniform uint sphere_count;
+uniform uint plane_count;
 uniform uint mesh_count;
+uniform uint light_count;
+uniform uint bvh_root;
+uniform uint bvh_node_count;
 uniform vec3 camera_pos;
 uniform vec3 forward;
 uniform vec3 right;
@@ -72,44 +220,197 @@ uniform vec3 horizon_color;
 uniform vec3 zenith_color;
 uniform vec3 ground_color;
 uniform vec3 sun_dir;
-uniform float sun_focus;
+uniform vec3 sun_radiance;
+uniform float sun_one_minus_cos;
+uniform float sun_cone_pdf;
 uniform float sun_intensity;
 uniform uint perspective;
+uniform uint tri_cache;
+uniform uint sampler_type;
+uniform uint grid_cell_count;
+uniform uvec3 grid_res;
+uniform vec3 grid_min;
+uniform vec3 grid_max;
+uniform vec3 grid_cell_size;
+
+uniform ivec2 screen_size;
+uniform uint queue_in;
+uniform uint ray_capacity;
+uniform uint sample_index;
+uniform uint sample_count;
 
 
-vec3 get_color_from_environment(Ray ray)
+// NOTE(ajeej): counter based random numbers, the same as rng_t in
+// ray_tracer.cpp. Value n of a stream is a hash of key+n, the key comes
+// from the pixel and the sample.
+uint
+pcg_hash(uint v)
 {
-    float sky_gradient_t = pow(smoothstep(0.0, 0.4, ray.dir.y), 0.35);
-    vec3 sky_gradient = mix(horizon_color, zenith_color, sky_gradient_t);
+    uint state = v * 747796405u + 2891336453u;
+    uint word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
+}
+
+uint
+get_rng_key(uint pixel, uint sample_id)
+{
+    return pcg_hash(pixel + pcg_hash(sample_id));
+}
+
+float
+gen_random_number(uint key, inout uint counter)
+{
+    return float(pcg_hash(key + counter++) >> 8) * (1.0 / 16777216.0);
+}
+
+// NOTE(ajeej): sobol_directions, r2_alphas and r4_alphas of ray_tracer.cpp
+const uint sobol_directions[SAMPLER_DIMS*32] = uint[](
+    0x80000000u, 0x40000000u, 0x20000000u, 0x10000000u, 0x08000000u, 0x04000000u, 0x02000000u, 0x01000000u,
+    0x00800000u, 0x00400000u, 0x00200000u, 0x00100000u, 0x00080000u, 0x00040000u, 0x00020000u, 0x00010000u,
+    0x00008000u, 0x00004000u, 0x00002000u, 0x00001000u, 0x00000800u, 0x00000400u, 0x00000200u, 0x00000100u,
+    0x00000080u, 0x00000040u, 0x00000020u, 0x00000010u, 0x00000008u, 0x00000004u, 0x00000002u, 0x00000001u,
+    0x80000000u, 0xc0000000u, 0xa0000000u, 0xf0000000u, 0x88000000u, 0xcc000000u, 0xaa000000u, 0xff000000u,
+    0x80800000u, 0xc0c00000u, 0xa0a00000u, 0xf0f00000u, 0x88880000u, 0xcccc0000u, 0xaaaa0000u, 0xffff0000u,
+    0x80008000u, 0xc000c000u, 0xa000a000u, 0xf000f000u, 0x88008800u, 0xcc00cc00u, 0xaa00aa00u, 0xff00ff00u,
+    0x80808080u, 0xc0c0c0c0u, 0xa0a0a0a0u, 0xf0f0f0f0u, 0x88888888u, 0xccccccccu, 0xaaaaaaaau, 0xffffffffu,
+    0x80000000u, 0xc0000000u, 0x60000000u, 0x90000000u, 0xe8000000u, 0x5c000000u, 0x8e000000u, 0xc5000000u,
+    0x68800000u, 0x9cc00000u, 0xee600000u, 0x55900000u, 0x80680000u, 0xc09c0000u, 0x60ee0000u, 0x90550000u,
+    0xe8808000u, 0x5cc0c000u, 0x8e606000u, 0xc5909000u, 0x6868e800u, 0x9c9c5c00u, 0xeeee8e00u, 0x5555c500u,
+    0x8000e880u, 0xc0005cc0u, 0x60008e60u, 0x9000c590u, 0xe8006868u, 0x5c009c9cu, 0x8e00eeeeu, 0xc5005555u,
+    0x80000000u, 0xc0000000u, 0x20000000u, 0x50000000u, 0xf8000000u, 0x74000000u, 0xa2000000u, 0x93000000u,
+    0xd8800000u, 0x25400000u, 0x59e00000u, 0xe6d00000u, 0x78080000u, 0xb40c0000u, 0x82020000u, 0xc3050000u,
+    0x208f8000u, 0x51474000u, 0xfbea2000u, 0x75d93000u, 0xa0858800u, 0x914e5400u, 0xdbe79e00u, 0x25db6d00u,
+    0x58800080u, 0xe54000c0u, 0x79e00020u, 0xb6d00050u, 0x800800f8u, 0xc00c0074u, 0x200200a2u, 0x50050093u
+);
+
+const uvec2 r2_alphas = uvec2(0xC13FA9A9u, 0x91E10DA6u);
+const uvec4 r4_alphas = uvec4(0xDB4F0B91u, 0xBBE05633u, 0xA0F2EC76u, 0x89E18285u);
+
+uint
+laine_karras_permutation(uint x, uint seed)
+{
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return x;
+}
+
+uint
+nested_uniform_scramble(uint x, uint seed)
+{
+    return bitfieldReverse(laine_karras_permutation(bitfieldReverse(x), seed));
+}
+
+uint
+get_sobol(uint index, uint dim)
+{
+    uint x = 0;
+    for(uint bit = 0; index != 0; bit++, index >>= 1)
+        if((index & 1u) != 0)
+            x ^= sobol_directions[dim*32 + bit];
+    return x;
+}
+
+// NOTE(ajeej): the next SAMPLER_DIMS dimensions of sample sample_id of the
+// pixel, counter is the next dimension. See get_sample_dims in
+// ray_tracer.cpp.
+vec4
+get_sample_dims(uint pixel, uint sample_id, inout uint counter)
+{
+    vec4 u;
+    if(sampler_type == SAMPLER_RANDOM) {
+        uint key = get_rng_key(pixel, sample_id);
+        for(int d = 0; d < 4; d++)
+            u[d] = gen_random_number(key, counter);
+        return u;
+    }
     
-    float ground_to_sky_t = smoothstep(-0.01, 0.0, ray.dir.y);
-    return mix(ground_color, sky_gradient, ground_to_sky_t);
+    uint x = pixel % uint(screen_size.x), y = pixel / uint(screen_size.x);
+    uint group = counter / SAMPLER_DIMS;
+    uint seed = pcg_hash(pcg_hash(y * 0x10000u + x) + group);
+    uint index = nested_uniform_scramble(sample_id, seed);
+    for(uint d = 0; d < SAMPLER_DIMS; d++)
+    {
+        uint v;
+        if(sampler_type == SAMPLER_SOBOL)
+            v = nested_uniform_scramble(get_sobol(index, d), pcg_hash(seed + d));
+        else {
+            uint mask = ((d & 1u) != 0) ? x * r2_alphas.y + y * r2_alphas.x :
+                x * r2_alphas.x + y * r2_alphas.y;
+            v = mask + pcg_hash(group * SAMPLER_DIMS + d) + sample_id * r4_alphas[d];
+        }
+        u[d] = float(v >> 8) * (1.0 / 16777216.0);
+    }
+    counter += SAMPLER_DIMS;
+    return u;
+}
+
+// NOTE(ajeej): the sampling kernels of sampling.cpp, each maps two uniforms
+// in [0, 1) to a unit vector. get_onb is the orthonormal basis of duff et
+// al. 2017.
+void
+get_onb(vec3 n, out vec3 t, out vec3 b)
+{
+    float sign = n.z >= 0.0 ? 1.0 : -1.0;
+    float a = -1.0 / (sign + n.z);
+    float c = n.x * n.y * a;
+    t = vec3(1.0 + sign * n.x * n.x * a, sign * c, -sign * n.x);
+    b = vec3(c, sign + n.y * n.y * a, -n.y);
+}
+
+// NOTE(ajeej): malley's method, the pdf is cos/pi
+vec3
+sample_cosine_hemisphere(vec3 norm, vec2 u)
+{
+    vec3 t, b;
+    get_onb(norm, t, b);
+    
+    float r = sqrt(u.x);
+    float phi = 2 * PI * u.y;
+    return norm * sqrt(max(0.0, 1.0 - u.x)) + t * (r * cos(phi)) + b * (r * sin(phi));
 }
 
 float
-gen_random_number(inout uint state)
+get_cosine_hemisphere_pdf(float cos_theta)
 {
-    state = state * 74779605 + 2891336453;
-    uint result = ((state >> ((state >> 28) + 4)) ^ state) * 277803737;
-    result = (result >> 22) ^ result;
-    return result / 4294967295.0;
+    return max(cos_theta, 0.0) / PI;
+}
+
+vec3
+sample_uniform_sphere(vec2 u)
+{
+    float z = 1.0 - 2.0 * u.x;
+    float r = sqrt(max(0.0, 1.0 - z*z));
+    float phi = 2 * PI * u.y;
+    return vec3(r * cos(phi), r * sin(phi), z);
 }
 
 float
-gen_random_normal_number(inout uint state)
+get_uniform_sphere_pdf()
 {
-    float theta = 2 * 3.1415926 * gen_random_number(state);
-    float rho = sqrt(-2 * log(gen_random_number(state)));
-    return rho * cos(theta);
+    return 1.0 / (4 * PI);
 }
 
+// NOTE(ajeej): uniform over the directions within acos(1 - one_minus_cos)
+// of axis, like sample_cone in sampling.cpp
 vec3
-gen_random_hemisphere_dir(vec3 norm, inout uint state)
+sample_cone(vec3 axis, float one_minus_cos, vec2 u)
 {
-    vec3 dir = vec3(gen_random_normal_number(state),
-                    gen_random_normal_number(state),
-                    gen_random_normal_number(state));
-    return dir * sign(dot(norm, dir));
+    vec3 t, b;
+    get_onb(axis, t, b);
+    
+    float z = 1.0 - u.x * one_minus_cos;
+    float r = sqrt(max(0.0, 1.0 - z*z));
+    float phi = 2 * PI * u.y;
+    return axis * z + t * (r * cos(phi)) + b * (r * sin(phi));
+}
+
+float
+get_cone_pdf(float one_minus_cos)
+{
+    return 1.0 / (2 * PI * one_minus_cos);
 }
 
 HitInfo
@@ -141,6 +442,93 @@ intersect_sphere(Ray ray, Sphere sphere)
     return info;
 }
 
+// NOTE(ajeej): planes, quads and disks are only hit from the front and
+// boxes only from outside
+HitInfo
+intersect_shape(Ray ray, Shape shape)
+{
+    HitInfo info;
+    info.hit = false;
+    
+    if(shape.type == SHAPE_BOX)
+    {
+        vec3 t0 = (shape.pos - ray.origin) / ray.dir;
+        vec3 t1 = (shape.u - ray.origin) / ray.dir;
+        vec3 t_min = min(t0, t1);
+        vec3 t_max = max(t0, t1);
+        float t_near = max(max(t_min.x, t_min.y), t_min.z);
+        float t_far = min(min(t_max.x, t_max.y), t_max.z);
+        
+        if(t_near > t_far || t_near < 0)
+            return info;
+        
+        info.dist = t_near;
+        info.point = ray.origin + ray.dir * t_near;
+        
+        vec3 half_size = 0.5 * (shape.u - shape.pos);
+        vec3 d = (info.point - (shape.pos + half_size)) / max(half_size, vec3(1E-6));
+        vec3 ad = abs(d);
+        info.norm = (ad.x >= ad.y && ad.x >= ad.z) ? vec3(sign(d.x), 0, 0) :
+            (ad.y >= ad.z) ? vec3(0, sign(d.y), 0) : vec3(0, 0, sign(d.z));
+    }
+    else
+    {
+        vec3 norm = (shape.type == SHAPE_PLANE) ? shape.u : cross(shape.u, shape.v);
+        float denom = dot(ray.dir, norm);
+        if(denom > -1E-6)
+            return info;
+        
+        vec3 delta = shape.pos - ray.origin;
+        float dist = dot(delta, norm) / denom;
+        if(dist < 0)
+            return info;
+        
+        // NOTE(ajeej): coordinates of the hit along the two edges, -1 to 1
+        // inside the quad
+        vec3 local = ray.dir * dist - delta;
+        float a = dot(local, shape.u) / dot(shape.u, shape.u);
+        float b = dot(local, shape.v) / dot(shape.v, shape.v);
+        if(shape.type == SHAPE_QUAD && (abs(a) > 1 || abs(b) > 1))
+            return info;
+        if(shape.type == SHAPE_DISK && a*a + b*b > 1)
+            return info;
+        
+        info.dist = dist;
+        info.point = ray.origin + ray.dir * dist;
+        info.norm = normalize(norm);
+    }
+    
+    info.hit = true;
+    info.mat_id = shape.mat_id;
+    return info;
+}
+
+vec3 get_vertex(uint idx)
+{
+    return vec3(verts[idx*3], verts[idx*3+1], verts[idx*3+2]);
+}
+
+Triangle get_triangle(uint tri_id)
+{
+    if(tri_cache != 0)
+        return triangles[tri_id];
+    
+    Triangle tri;
+    tri.v0 = get_vertex(tri_indices[tri_id*3]);
+    tri.e1 = get_vertex(tri_indices[tri_id*3+1]) - tri.v0;
+    tri.e2 = get_vertex(tri_indices[tri_id*3+2]) - tri.v0;
+    return tri;
+}
+
+vec3 get_triangle_norm(uint tri_id)
+{
+    if(tri_cache != 0)
+        return tri_attrs[tri_id].norm;
+    
+    Triangle tri = get_triangle(tri_id);
+    return cross(tri.e1, tri.e2);
+}
+
 vec3 rotate_vertex(vec3 vert, vec4 quat)
 {
     float q0 = quat.w;
@@ -150,169 +538,648 @@ vec3 rotate_vertex(vec3 vert, vec4 quat)
     return vert + q0 * t + cross(qv, t);
 }
 
+// NOTE(ajeej): the ray is already in the object space of the mesh, so the
+// vertices are tested as they are stored
 HitInfo
-intersect_triangle(Ray ray, Triangle tri,
-                   vec3 pos, vec4 quat, vec3 scale)
+intersect_triangle(Ray ray, Triangle tri)
 {
     HitInfo info;
     info.hit = false;
     
-    float u, v, w, t;
-    
-    vec3 v0 = rotate_vertex(tri.v[0]*scale, quat) + pos;
-    vec3 v1 = rotate_vertex(tri.v[1]*scale, quat) + pos;
-    vec3 v2 = rotate_vertex(tri.v[2]*scale, quat) + pos;
-    
-    vec3 n0 = rotate_vertex(tri.n[0], quat);
-    vec3 n1 = rotate_vertex(tri.n[1], quat);
-    vec3 n2 = rotate_vertex(tri.n[2], quat);
-    
-    vec3 v0v1 = v1 - v0;
-    vec3 v0v2 = v2 - v0;
-    vec3 norm = cross(v0v1, v0v2);
-    
-    vec3 v0o = ray.origin - v0;
-    vec3 dv0o = cross(v0o, ray.dir);
+    float u, v, w;
     
-    float det = -dot(ray.dir, norm);
+    // NOTE(ajeej): det is the negated dot of the ray with the normal, so only
+    // front faces (counter clockwise when seen from the ray) are hit
+    vec3 p = cross(ray.dir, tri.e2);
+    float det = dot(tri.e1, p);
     float inv_det = 1.0 / det;
     
-    float dist = dot(v0o, norm) * inv_det;
-    u = dot(v0v2, dv0o) * inv_det;
-    v = -dot(v0v1, dv0o) * inv_det;
+    vec3 v0o = ray.origin - tri.v0;
+    vec3 q = cross(v0o, tri.e1);
+    
+    float dist = dot(tri.e2, q) * inv_det;
+    u = dot(v0o, p) * inv_det;
+    v = dot(ray.dir, q) * inv_det;
     w = 1 - u - v;
     
     info.hit = (det >= 1E-6 && dist >= 0 && u >= 0 && v >= 0 && w >= 0);
     info.dist = dist;
-    info.point = ray.origin + ray.dir * dist;
-    info.norm = normalize(norm);
     
     return info;
 }
 
-HitInfo
-shoot_out_ray(Ray ray)
+float
+intersect_aabb(vec3 bmin, vec3 bmax, Ray ray, vec3 inv_dir, float t_max)
 {
-    HitInfo closest_info, info;
-    closest_info.hit = false;
-    closest_info.dist = 100000000.0;
+    vec3 t0 = (bmin - ray.origin) * inv_dir;
+    vec3 t1 = (bmax - ray.origin) * inv_dir;
+    vec3 t_min = min(t0, t1);
+    vec3 t_max3 = max(t0, t1);
     
+    float t_near = max(max(t_min.x, t_min.y), t_min.z);
+    float t_far = min(min(t_max3.x, t_max3.y), t_max3.z);
     
-    for(int i = 0; i < sphere_count; i++)
+    return (t_far >= t_near && t_far >= 0 && t_near < t_max) ? t_near : 1E30;
+}
+
+// NOTE(ajeej): tests the triangles of a bottom level leaf, returns true and
+// shortens dist if one of them is hit nearer than it
+bool
+intersect_mesh_leaf(Ray obj_ray, BvhNode node, inout float dist, inout uint tri_id)
+{
+    bool hit = false;
+    for(uint i = 0; i < node.count; i++)
     {
-        Sphere sphere = spheres[i];
-        info = intersect_sphere(ray, sphere);
-        
-        if(info.hit && info.dist < closest_info.dist)
-        {
-            closest_info = info;
-            closest_info.mat_id = sphere.mat_id;
+        uint prim = bvh_prims[node.first+i];
+        HitInfo info = intersect_triangle(obj_ray, get_triangle(prim));
+        if(info.hit && info.dist < dist) {
+            hit = true;
+            dist = info.dist;
+            tri_id = prim;
+        }
+    }
+    return hit;
+}
+
+#ifdef BVH_STACKLESS
+// NOTE(ajeej): the threaded layout keeps the node after the subtree of an
+// interior node in first, the subtree of a leaf ends right after it
+uint
+get_threaded_bvh_end(uint root)
+{
+    BvhNode node = bvh_nodes[root];
+    return (node.count > 0) ? root+1 : node.first;
+}
+#endif
+
+// NOTE(ajeej): moves the ray into the object space of the mesh and walks
+// its bottom level bvh. The direction is not normalized so distances are
+// the same as in world space and the closest hit can be shared.
+void
+intersect_mesh(Ray ray, uint mesh_id, inout HitInfo closest_info)
+{
+    Mesh mesh = meshes[mesh_id];
+    vec4 inv_quat = vec4(-mesh.quat.xyz, mesh.quat.w);
+    
+    // NOTE(ajeej): an axis scaled by 0 is left alone, which is exact as long
+    // as the mesh is flat along it
+    vec3 inv_scale = mix(1.0 / mesh.scale, vec3(1.0), equal(mesh.scale, vec3(0.0)));
+    
+    Ray obj_ray;
+    obj_ray.origin = rotate_vertex(ray.origin - mesh.pos, inv_quat) * inv_scale;
+    obj_ray.dir = rotate_vertex(ray.dir, inv_quat) * inv_scale;
+    
+    vec3 inv_dir = 1.0 / obj_ray.dir;
+    uint node_idx = mesh.bvh_root;
+    bool hit = false;
+    uint tri_id;
+    
+#ifdef BVH_STACKLESS
+    uint end = get_threaded_bvh_end(node_idx);
+    while(node_idx != end)
+    {
+        BvhNode node = bvh_nodes[node_idx];
+        if(intersect_aabb(node.min, node.max, obj_ray, inv_dir, closest_info.dist) >= 1E30) {
+            node_idx = (node.count > 0) ? node_idx+1 : node.first;
+            continue;
         }
+        
+        if(node.count > 0)
+            hit = intersect_mesh_leaf(obj_ray, node, closest_info.dist, tri_id) || hit;
+        node_idx++;
     }
+#else
+    uint stack[BVH_STACK_SIZE];
+    float stack_t[BVH_STACK_SIZE];
+    int stack_count = 0;
+    
+    if(intersect_aabb(bvh_nodes[node_idx].min, bvh_nodes[node_idx].max,
+                      obj_ray, inv_dir, closest_info.dist) >= 1E30)
+        return;
     
-    for(int i = 0; i < mesh_count; i++)
+    while(true)
     {
-        Mesh mesh = meshes[i];
+        BvhNode node = bvh_nodes[node_idx];
         
-        for(int j = 0; j < mesh.tri_count; j++)
+        if(node.count > 0)
         {
-            Triangle tri = triangles[mesh.tri_idx+j];
-            info = intersect_triangle(ray, tri,
-                                      mesh.pos, mesh.quat, mesh.scale);
+            hit = intersect_mesh_leaf(obj_ray, node, closest_info.dist, tri_id) || hit;
+        }
+        else
+        {
+            uint near_idx = node.first, far_idx = node.first+1;
+            float t_near = intersect_aabb(bvh_nodes[near_idx].min, bvh_nodes[near_idx].max,
+                                          obj_ray, inv_dir, closest_info.dist);
+            float t_far = intersect_aabb(bvh_nodes[far_idx].min, bvh_nodes[far_idx].max,
+                                         obj_ray, inv_dir, closest_info.dist);
             
-            if(info.hit && info.dist < closest_info.dist)
-            {
-                closest_info = info;
-                closest_info.mat_id = mesh.mat_id;
+            if(t_far < t_near) {
+                uint temp_idx = near_idx; near_idx = far_idx; far_idx = temp_idx;
+                float temp = t_near; t_near = t_far; t_far = temp;
             }
+            
+            if(t_near < 1E30) {
+                if(t_far < 1E30 && stack_count < BVH_STACK_SIZE) {
+                    stack[stack_count] = far_idx;
+                    stack_t[stack_count] = t_far;
+                    stack_count++;
+                }
+                node_idx = near_idx;
+                continue;
+            }
+        }
+        
+        bool found = false;
+        while(stack_count > 0 && !found) {
+            stack_count--;
+            found = stack_t[stack_count] < closest_info.dist;
         }
+        if(!found)
+            break;
+        node_idx = stack[stack_count];
     }
+#endif
     
-    /*Triangle tri;
-    tri.v[0] = vec3(20.0f, 10.0f, 0.0f);
-    tri.v[1] = vec3(20.0f, 0.0f, 0.0f);
-    tri.v[2] = vec3(10.0f, 10.0f, 0.0f);
-    tri.mat_id = 0;
-    closest_info = intersect_triangle(ray, tri);*/
+    // NOTE(ajeej): the normal goes back to world space with the inverse
+    // transpose of the transform, a rotation after dividing by the scale
+    if(hit) {
+        closest_info.hit = true;
+        closest_info.mat_id = mesh.mat_id;
+        closest_info.point = ray.origin + ray.dir * closest_info.dist;
+        closest_info.norm = normalize(rotate_vertex(get_triangle_norm(tri_id) * inv_scale, mesh.quat));
+    }
+}
+
+// NOTE(ajeej): 3d dda through the cells of the sphere grid, nearest first.
+// Spheres overlap more than one cell so the walk goes on until the closest
+// hit is before the next cell.
+void
+traverse_sphere_grid(Ray ray, inout HitInfo closest_info)
+{
+    // NOTE(ajeej): axes the ray is parallel to are left out of the slab
+    // test, 1/0 would give 0*inf for an origin on a bound
+    bvec3 flat_axes = equal(ray.dir, vec3(0));
+    bvec3 outside = notEqual(clamp(ray.origin, grid_min, grid_max), ray.origin);
+    if(any(bvec3(uvec3(flat_axes) & uvec3(outside))))
+        return;
     
-    return closest_info;
+    vec3 inv_dir = 1.0 / ray.dir;
+    vec3 t0 = (grid_min - ray.origin) * inv_dir;
+    vec3 t1 = (grid_max - ray.origin) * inv_dir;
+    vec3 t_min = mix(min(t0, t1), vec3(-1E30), flat_axes);
+    vec3 t_max = mix(max(t0, t1), vec3(1E30), flat_axes);
+    float t_enter = max(max(max(t_min.x, t_min.y), t_min.z), 0.0);
+    float t_exit = min(min(min(t_max.x, t_max.y), t_max.z), closest_info.dist);
+    if(t_enter > t_exit)
+        return;
+    
+    vec3 offset = ray.origin + ray.dir * t_enter - grid_min;
+    ivec3 cell = clamp(ivec3(offset / grid_cell_size), ivec3(0), ivec3(grid_res) - 1);
+    ivec3 step = ivec3(sign(ray.dir));
+    
+    // NOTE(ajeej): axes the ray does not move along never get stepped
+    vec3 bound = (vec3(cell) + vec3(greaterThan(ray.dir, vec3(0)))) * grid_cell_size;
+    vec3 t_next = mix(t_enter + (bound - offset) * inv_dir, vec3(1E30), equal(ray.dir, vec3(0)));
+    vec3 t_delta = mix(abs(grid_cell_size * inv_dir), vec3(1E30), equal(ray.dir, vec3(0)));
+    
+    while(true)
+    {
+        uint c = (uint(cell.z)*grid_res.y + uint(cell.y))*grid_res.x + uint(cell.x);
+        for(uint i = grid_cells[c]; i < grid_cells[c+1]; i++) {
+            HitInfo info = intersect_sphere(ray, spheres[grid_prims[i]]);
+            if(info.hit && info.dist < closest_info.dist)
+                closest_info = info;
+        }
+        
+        int axis = (t_next.x < t_next.y) ? ((t_next.x < t_next.z) ? 0 : 2) : ((t_next.y < t_next.z) ? 1 : 2);
+        if(closest_info.dist <= t_next[axis] || t_next[axis] > t_exit)
+            break;
+        
+        cell[axis] += step[axis];
+        if(cell[axis] < 0 || cell[axis] >= int(grid_res[axis]))
+            break;
+        t_next[axis] += t_delta[axis];
+    }
 }
 
-vec3
-ray_trace(Ray ray, inout uint state)
+// NOTE(ajeej): tests the prims of a top level leaf against the ray
+void
+intersect_scene_leaf(Ray ray, BvhNode node, inout HitInfo closest_info)
 {
-    Material mat;
-    HitInfo info;
+    for(uint i = 0; i < node.count; i++)
+    {
+        uint prim = bvh_prims[node.first+i];
+        if((prim & BVH_MESH_PRIM) != 0) {
+            intersect_mesh(ray, prim & ~BVH_MESH_PRIM, closest_info);
+            continue;
+        }
+        
+        HitInfo info;
+        if((prim & BVH_SHAPE_PRIM) != 0)
+            info = intersect_shape(ray, shapes[prim & ~BVH_SHAPE_PRIM]);
+        else
+            info = intersect_sphere(ray, spheres[prim]);
+        if(info.hit && info.dist < closest_info.dist)
+            closest_info = info;
+    }
+}
+
+// NOTE(ajeej): ordered traversal of the top level bvh built on the cpu, the
+// nearer child is visited first and the other one is pushed. With
+// BVH_STACKLESS the nodes are in the threaded layout instead and are walked
+// in a fixed order by following the miss links, without a stack.
+HitInfo
+shoot_out_ray(Ray ray)
+{
+    HitInfo closest_info, info;
+    closest_info.hit = false;
+    closest_info.dist = 100000000.0;
     
-    vec3 r_color = vec3(1.0, 1.0, 1.0);
-    vec3 final_color = vec3(0.0, 0.0, 0.0);
+    if(grid_cell_count > 0)
+        traverse_sphere_grid(ray, closest_info);
     
-    for(int i = 0; i < max_bounce; i++)
+    for(uint i = 0; i < plane_count; i++) {
+        info = intersect_shape(ray, shapes[i]);
+        if(info.hit && info.dist < closest_info.dist)
+            closest_info = info;
+    }
+    
+    if(bvh_node_count == 0)
+        return closest_info;
+    
+    vec3 inv_dir = 1.0 / ray.dir;
+    uint node_idx = bvh_root;
+    
+#ifdef BVH_STACKLESS
+    // NOTE(ajeej): hit interior nodes and leaves go on to the next node,
+    // missed interior nodes skip their subtree
+    uint end = get_threaded_bvh_end(node_idx);
+    while(node_idx != end)
+    {
+        BvhNode node = bvh_nodes[node_idx];
+        if(intersect_aabb(node.min, node.max, ray, inv_dir, closest_info.dist) >= 1E30) {
+            node_idx = (node.count > 0) ? node_idx+1 : node.first;
+            continue;
+        }
+        
+        if(node.count > 0)
+            intersect_scene_leaf(ray, node, closest_info);
+        node_idx++;
+    }
+#else
+    if(intersect_aabb(bvh_nodes[bvh_root].min, bvh_nodes[bvh_root].max,
+                      ray, inv_dir, closest_info.dist) >= 1E30)
+        return closest_info;
+    
+    uint stack[BVH_STACK_SIZE];
+    float stack_t[BVH_STACK_SIZE];
+    int stack_count = 0;
+    
+    while(true)
     {
-        info = shoot_out_ray(ray);
-        if(info.hit)
+        BvhNode node = bvh_nodes[node_idx];
+        
+        if(node.count > 0)
         {
-            ray.origin = info.point;
-            
-            vec3 diffuse_dir = gen_random_hemisphere_dir(info.norm, state);
-            vec3 specular_dir = reflect(ray.dir, info.norm);
-            
-            // NOTE(ajeej): The smoothness of the material determines
-            // to what extent the lighting is specular or diffuse
-            ray.dir = mix(diffuse_dir, specular_dir, mat.smoothness);
-            
-            mat = mats[info.mat_id];
-            vec3 emission = mat.emission_color * mat.emission_strength;
-            float light_strength = dot(info.norm, ray.dir);
-            
-            final_color += emission * r_color;
-            r_color *= mat.color * light_strength;
+            intersect_scene_leaf(ray, node, closest_info);
+        }
+        else
+        {
+            uint near_idx = node.first, far_idx = node.first+1;
+            float t_near = intersect_aabb(bvh_nodes[near_idx].min, bvh_nodes[near_idx].max,
+                                          ray, inv_dir, closest_info.dist);
+            float t_far = intersect_aabb(bvh_nodes[far_idx].min, bvh_nodes[far_idx].max,
+                                         ray, inv_dir, closest_info.dist);
             
-            // NOTE(ajeej): 
-            // This is what gives the ambient color, can only be done
-            // when max_bounce == 1
-            //final_color = mat.color;
+            if(t_far < t_near) {
+                uint temp_idx = near_idx; near_idx = far_idx; far_idx = temp_idx;
+                float temp = t_near; t_near = t_far; t_far = temp;
+            }
             
-            float p = max(r_color.x, max(r_color.y, r_color.z));
-            if (gen_random_number(state) >= p) {
-                break;
+            if(t_near < 1E30) {
+                if(t_far < 1E30 && stack_count < BVH_STACK_SIZE) {
+                    stack[stack_count] = far_idx;
+                    stack_t[stack_count] = t_far;
+                    stack_count++;
+                }
+                node_idx = near_idx;
+                continue;
             }
-            r_color *= 1.0f / p; 
         }
-        else
-        {
-            // NOTE(ajeej): This applys ambient color after all the shading is
-            // done. This is removed if only diffuse or specular ar desired.
-            final_color += get_color_from_environment(ray) * r_color;
-            break;
+        
+        // NOTE(ajeej): pop until a node is nearer than the closest hit
+        bool found = false;
+        while(stack_count > 0 && !found) {
+            stack_count--;
+            found = stack_t[stack_count] < closest_info.dist;
         }
+        if(!found)
+            break;
+        node_idx = stack[stack_count];
     }
+#endif
+    
+    return closest_info;
+}
+
+// NOTE(ajeej): sky gradient and sun disk like get_color_from_environment in
+// ray_tracer.cpp, the sun is scaled by sun_weight
+vec3 get_color_from_environment(Ray ray, float sun_weight)
+{
+    float sky_gradient_t = pow(smoothstep(0.0, 0.4, ray.dir.y), 0.35);
+    vec3 sky_gradient = mix(horizon_color, zenith_color, sky_gradient_t);
+    
+    float ground_to_sky_t = smoothstep(-0.01, 0.0, ray.dir.y);
+    vec3 color = mix(ground_color, sky_gradient, ground_to_sky_t);
     
-    return final_color;
+    vec3 to_sun = ray.dir - sun_dir;
+    if(sun_intensity > 0 && dot(to_sun, to_sun) <= 2*sun_one_minus_cos)
+        color += sun_radiance * sun_weight;
+    return color;
 }
 
+// NOTE(ajeej): power heuristic weight of a sample taken with pdf against
+// the other strategy that could have taken it with other_pdf
+float
+get_mis_weight(float pdf, float other_pdf)
+{
+    return pdf*pdf / (pdf*pdf + other_pdf*other_pdf);
+}
+
+// NOTE(ajeej): cone of the directions from p that hit the sphere, returns
+// false if p is inside of it
+bool
+get_light_cone(vec3 p, Sphere sphere, out vec3 axis, out float one_minus_cos)
+{
+    axis = sphere.pos - p;
+    float dist2 = dot(axis, axis);
+    one_minus_cos = 0.0;
+    if(dist2 <= sphere.r*sphere.r)
+        return false;
+    
+    axis *= inversesqrt(dist2);
+    float sin2 = sphere.r*sphere.r / dist2;
+    one_minus_cos = sin2 / (1.0 + sqrt(1.0 - sin2));
+    return true;
+}
+
+// NOTE(ajeej): the emissive spheres and the sun if it is on, which is the
+// last of them
+uint
+get_light_choice_count()
+{
+    return light_count + (sun_intensity > 0 ? 1u : 0u);
+}
+
+// NOTE(ajeej): pdf that sample_scene_light at origin picks the direction to
+// point, which is on the surface of a light or it would not have been found
+float
+get_light_pdf(vec3 origin, vec3 point)
+{
+    for(uint i = 0; i < light_count; i++)
+    {
+        Sphere sphere = spheres[sphere_count + i];
+        if(abs(distance(point, sphere.pos) - sphere.r) > sphere.r*1E-3)
+            continue;
+        
+        vec3 axis;
+        float one_minus_cos;
+        if(!get_light_cone(origin, sphere, axis, one_minus_cos))
+            return 0.0;
+        return get_cone_pdf(one_minus_cos) / float(get_light_choice_count());
+    }
+    
+    return 0.0;
+}
+
+// NOTE(ajeej): pdf that sample_scene_light picks a direction in the sun disk
+float
+get_sun_pdf()
+{
+    return sun_cone_pdf / float(get_light_choice_count());
+}
+
+// NOTE(ajeej): next event estimation like sample_scene_light and
+// trace_shadow_ray in ray_tracer.cpp, returns the light one of the lights
+// gives through the diffuse part of the material with its shadow ray traced
+// right away instead of in a connect stage
+vec3
+sample_scene_light(HitRecord record, Material mat, vec4 u)
+{
+    uint choice_count = get_light_choice_count();
+    float diffuse = 1.0 - mat.smoothness;
+    if(choice_count == 0 || diffuse <= 0)
+        return vec3(0.0);
+    
+    uint choice = min(uint(u.z * choice_count), choice_count-1);
+    bool sun = (choice == light_count);
+    Sphere sphere;
+    vec3 axis = sun_dir;
+    float one_minus_cos = sun_one_minus_cos;
+    vec3 emission = sun_radiance;
+    if(!sun) {
+        sphere = spheres[sphere_count + choice];
+        if(!get_light_cone(record.point, sphere, axis, one_minus_cos))
+            return vec3(0.0);
+        
+        Material light = mats[sphere.mat_id];
+        emission = light.emission_color * light.emission_strength;
+    }
+    
+    Ray ray;
+    ray.origin = record.point;
+    ray.dir = sample_cone(axis, one_minus_cos, u.xy);
+    float cos_theta = dot(record.norm, ray.dir);
+    if(cos_theta <= 0)
+        return vec3(0.0);
+    
+    // NOTE(ajeej): the sun is in the way of nothing, so its shadow ray has
+    // to miss everything
+    float light_dist = 1E20;
+    if(!sun) {
+        HitInfo light_info = intersect_sphere(ray, sphere);
+        if(!light_info.hit)
+            return vec3(0.0);
+        light_dist = light_info.dist;
+    }
+    HitInfo info = shoot_out_ray(ray);
+    if(info.hit && info.dist < light_dist*0.999)
+        return vec3(0.0);
+    
+    float light_pdf = get_cone_pdf(one_minus_cos) / float(choice_count);
+    float weight = get_mis_weight(light_pdf, diffuse * get_cosine_hemisphere_pdf(cos_theta));
+    
+    return mat.color * emission * (diffuse / PI * cos_theta * weight / light_pdf);
+}
+
+#if defined(WAVE_GENERATE)
+
+// NOTE(ajeej): starts one path per pixel in the first queue, the first
+// invocation sets the count and the work groups extend is dispatched with
 void main() {
     ivec2 pixel_pos = ivec2(gl_GlobalInvocationID.xy);
-    ivec2 screen_size = imageSize(texture);
     if (pixel_pos.x >= screen_size.x || pixel_pos.y >= screen_size.y) {
         return;
     }
     
-    float x_comp = (2.0 * pixel_pos.x - screen_size.x)/screen_size.x;
-    float y_comp = (2.0 * pixel_pos.y - screen_size.y)/screen_size.y;
+    uint pixel = pixel_pos.y * screen_size.x + pixel_pos.x;
+    uint pixel_count = screen_size.x * screen_size.y;
+    if(pixel == 0) {
+        wave_queues[0].groups_x = (pixel_count + WAVE_GROUP_SIZE-1)/WAVE_GROUP_SIZE;
+        wave_queues[0].groups_y = 1;
+        wave_queues[0].groups_z = 1;
+        wave_queues[0].count = pixel_count;
+    }
     
-    uint rand_state = pixel_pos.y * screen_size.x + pixel_pos.x + frame_count * 789235;
+    // NOTE(ajeej): the first dimensions of the sample jitter the ray inside
+    // the pixel
+    WaveRay ray;
+    ray.sample_id = frame_count * sample_count + sample_index;
+    ray.rng_counter = 0;
+    vec2 jitter = get_sample_dims(pixel, ray.sample_id, ray.rng_counter).xy;
     
-    Ray ray;
+    float x_comp = (2.0 * (pixel_pos.x + jitter.x) - screen_size.x)/screen_size.x;
+    float y_comp = (2.0 * (pixel_pos.y + jitter.y) - screen_size.y)/screen_size.y;
     
     ray.origin = camera_pos;
+    ray.pixel = pixel;
     ray.dir = normalize(-forward + x_comp*right + y_comp*up);
+    ray.color = vec3(1.0, 1.0, 1.0);
+    ray.bsdf_pdf = 0.0;
+    wave_rays[pixel] = ray;
+    
+    if(sample_index == 0)
+        radiance[pixel] = vec4(0.0);
+}
+
+#elif defined(WAVE_EXTEND)
+
+// NOTE(ajeej): finds the closest hit of every ray in queue_in. The other
+// queue is emptied here so shade can append to it. An empty queue still
+// has one work group, otherwise a dispatch of it would never get to empty
+// the queue after it.
+void main() {
+    uint idx = gl_GlobalInvocationID.x;
+    uint queue_out = 1 - queue_in;
+    
+    if(idx == 0) {
+        wave_queues[queue_out].groups_x = 1;
+        wave_queues[queue_out].groups_y = 1;
+        wave_queues[queue_out].groups_z = 1;
+        wave_queues[queue_out].count = 0;
+    }
+    
+    if(idx >= wave_queues[queue_in].count)
+        return;
+    
+    WaveRay wave_ray = wave_rays[queue_in*ray_capacity + idx];
+    Ray ray;
+    ray.origin = wave_ray.origin;
+    ray.dir = wave_ray.dir;
+    
+    HitInfo info = shoot_out_ray(ray);
+    
+    HitRecord record;
+    record.point = info.point;
+    record.dist = info.hit ? info.dist : -1.0;
+    record.norm = info.norm;
+    record.mat_id = info.mat_id;
+    hit_records[idx] = record;
+}
+
+#elif defined(WAVE_SHADE)
+
+// NOTE(ajeej): one bounce of the old ray_trace loop. Rays that go on are
+// appended to the other queue, every WAVE_GROUP_SIZE rays appended past the
+// first work group add another one to the next dispatch.
+void main() {
+    uint idx = gl_GlobalInvocationID.x;
+    if(idx >= wave_queues[queue_in].count)
+        return;
+    
+    WaveRay wave_ray = wave_rays[queue_in*ray_capacity + idx];
+    HitRecord record = hit_records[idx];
+    
+    Ray ray;
+    ray.origin = wave_ray.origin;
+    ray.dir = wave_ray.dir;
+    
+    if(record.dist < 0)
+    {
+        // NOTE(ajeej): the sun is weighted against sample_scene_light like
+        // the lights below
+        float sun_weight = 1.0;
+        if(wave_ray.bsdf_pdf > 0 && sun_intensity > 0)
+            sun_weight = get_mis_weight(wave_ray.bsdf_pdf, get_sun_pdf());
+        
+        // NOTE(ajeej): This applys ambient color after all the shading is
+        // done. This is removed if only diffuse or specular ar desired.
+        radiance[wave_ray.pixel].rgb += get_color_from_environment(ray, sun_weight) * wave_ray.color;
+        return;
+    }
     
-    vec3 total_color = vec3(0, 0, 0);
+    Material mat = mats[record.mat_id];
     
-    for(int i = 0; i < 100; i++)
-        total_color += ray_trace(ray, rand_state);
+    // NOTE(ajeej): lights that sample_scene_light could have found at the
+    // last hit are weighted against it
+    float weight = 1.0;
+    if(wave_ray.bsdf_pdf > 0 && mat.emission_strength > 0)
+        weight = get_mis_weight(wave_ray.bsdf_pdf, get_light_pdf(ray.origin, record.point));
     
-    vec3 color = total_color/100;
+    ray.origin = record.point;
+    
+    // NOTE(ajeej): the first two dimensions pick the diffuse direction, the
+    // third is for russian roulette and the fourth picks diffuse or specular.
+    // The second group is for the light sample.
+    vec4 u = get_sample_dims(wave_ray.pixel, wave_ray.sample_id, wave_ray.rng_counter);
+    vec4 light_u = get_sample_dims(wave_ray.pixel, wave_ray.sample_id, wave_ray.rng_counter);
+    
+    vec3 emission = mat.emission_color * mat.emission_strength * weight;
+    radiance[wave_ray.pixel].rgb += (emission + sample_scene_light(record, mat, light_u)) * wave_ray.color;
+    
+    // NOTE(ajeej): The smoothness of the material is the chance that the
+    // bounce is specular instead of diffuse. Specular bounces keep the old
+    // mix of the two directions and are never sampled as lights.
+    vec3 diffuse_dir = sample_cosine_hemisphere(record.norm, u.xy);
+    if(u.w < mat.smoothness) {
+        ray.dir = normalize(mix(diffuse_dir, reflect(ray.dir, record.norm), mat.smoothness));
+        wave_ray.bsdf_pdf = 0.0;
+    } else {
+        ray.dir = diffuse_dir;
+        wave_ray.bsdf_pdf = (1.0 - mat.smoothness) * get_cosine_hemisphere_pdf(dot(record.norm, ray.dir));
+    }
+    
+    // NOTE(ajeej): the cosine of a diffuse bounce cancels with the pdf of
+    // its direction, so what is left of the lambertian brdf is its albedo
+    vec3 r_color = wave_ray.color * mat.color;
+    
+    float p = max(r_color.x, max(r_color.y, r_color.z));
+    if (u.z >= p)
+        return;
+    
+    uint queue_out = 1 - queue_in;
+    uint slot = atomicAdd(wave_queues[queue_out].count, 1);
+    if(slot > 0 && slot % WAVE_GROUP_SIZE == 0)
+        atomicAdd(wave_queues[queue_out].groups_x, 1);
+    
+    wave_ray.origin = ray.origin;
+    wave_ray.dir = ray.dir;
+    wave_ray.color = r_color * (1.0f / p);
+    wave_rays[queue_out*ray_capacity + slot] = wave_ray;
+}
+
+#elif defined(WAVE_ACCUMULATE)
+
+// NOTE(ajeej): averages the samples of the frame into the texture
+void main() {
+    ivec2 pixel_pos = ivec2(gl_GlobalInvocationID.xy);
+    if (pixel_pos.x >= screen_size.x || pixel_pos.y >= screen_size.y) {
+        return;
+    }
+    
+    uint pixel = pixel_pos.y * screen_size.x + pixel_pos.x;
+    vec3 color = radiance[pixel].rgb / sample_count;
     imageStore(texture, pixel_pos, vec4(color, 1.0));
-}
\ No newline at end of file
+}
+
+#endif
@@ -0,0 +1,1491 @@
+
+static void
+aabb_empty(aabb_t *box)
+{
+    glm_vec3_fill(box->min, FLT_MAX);
+    glm_vec3_fill(box->max, -FLT_MAX);
+}
+
+static void
+aabb_grow(aabb_t *box, vec3 p)
+{
+    glm_vec3_minv(box->min, p, box->min);
+    glm_vec3_maxv(box->max, p, box->max);
+}
+
+static void
+aabb_merge(aabb_t *box, aabb_t *other)
+{
+    glm_vec3_minv(box->min, other->min, box->min);
+    glm_vec3_maxv(box->max, other->max, box->max);
+}
+
+static f32
+aabb_area(aabb_t *box)
+{
+    vec3 e;
+    glm_vec3_sub(box->max, box->min, e);
+    if(e[0] < 0 || e[1] < 0 || e[2] < 0)
+        return 0.0f;
+    return 2.0f*(e[0]*e[1] + e[1]*e[2] + e[2]*e[0]);
+}
+
+// NOTE(ajeej): slab test, returns the distance to where the ray enters
+// the box or FLT_MAX if it misses or enters further than t_max
+static f32
+intersect_aabb(vec3 min, vec3 max, vec3 o, vec3 inv_dir, f32 t_max)
+{
+    f32 t0 = (min[0] - o[0])*inv_dir[0], t1 = (max[0] - o[0])*inv_dir[0];
+    f32 t_near = fminf(t0, t1), t_far = fmaxf(t0, t1);
+    
+    t0 = (min[1] - o[1])*inv_dir[1]; t1 = (max[1] - o[1])*inv_dir[1];
+    t_near = fmaxf(t_near, fminf(t0, t1));
+    t_far = fminf(t_far, fmaxf(t0, t1));
+    
+    t0 = (min[2] - o[2])*inv_dir[2]; t1 = (max[2] - o[2])*inv_dir[2];
+    t_near = fmaxf(t_near, fminf(t0, t1));
+    t_far = fminf(t_far, fmaxf(t0, t1));
+    
+    if(t_far >= t_near && t_far >= 0 && t_near < t_max)
+        return t_near;
+    return FLT_MAX;
+}
+
+static void
+free_bvh(bvh_t *bvh)
+{
+    if(bvh->nodes)
+        _mm_free(bvh->nodes);
+    if(bvh->prim_ids)
+        free(bvh->prim_ids);
+    if(bvh->parents)
+        free(bvh->parents);
+    if(bvh->prim_nodes)
+        free(bvh->prim_nodes);
+    memset(bvh, 0, sizeof(*bvh));
+}
+
+static f32
+get_bvh_node_area(bvh_node_t *node)
+{
+    aabb_t box;
+    glm_vec3_copy(node->min, box.min);
+    glm_vec3_copy(node->max, box.max);
+    return aabb_area(&box);
+}
+
+static f32
+get_bvh_node_weight(bvh_node_t *node)
+{
+    return (node->count) ? (f32)node->count : BVH_TRAVERSAL_COST;
+}
+
+// NOTE(ajeej): expected cost of a ray that hits the root, every node is
+// weighted by the chance of hitting it given that the root was hit
+static f32
+get_bvh_sah_cost(bvh_t *bvh)
+{
+    if(bvh->node_count == 0)
+        return 0.0f;
+    
+    f32 root_area = get_bvh_node_area(bvh->nodes);
+    return (root_area > 0) ? bvh->sah_sum/root_area : 0.0f;
+}
+
+// NOTE(ajeej): fills in what a refit needs after the nodes were built
+static void
+link_bvh_nodes(bvh_t *bvh)
+{
+    bvh->parents = (u32 *)malloc(sizeof(u32)*bvh->node_count);
+    bvh->prim_nodes = (u32 *)malloc(sizeof(u32)*bvh->prim_count);
+    bvh->parents[0] = (u32)-1;
+    bvh->sah_sum = 0.0f;
+    
+    for(u32 i = 0; i < bvh->node_count; i++)
+    {
+        bvh_node_t *node = bvh->nodes+i;
+        bvh->sah_sum += get_bvh_node_area(node)*get_bvh_node_weight(node);
+        
+        if(node->count) {
+            for(u32 j = 0; j < node->count; j++)
+                bvh->prim_nodes[bvh->prim_ids[node->first+j]] = i;
+        }
+        else {
+            bvh->parents[node->first] = i;
+            bvh->parents[node->first+1] = i;
+        }
+    }
+    
+    bvh->build_cost = get_bvh_sah_cost(bvh);
+}
+
+// NOTE(ajeej): recomputes the box of one node from its children or prims,
+// returns false if the box did not change
+static bool
+fit_bvh_node(bvh_t *bvh, u32 node_idx, aabb_t *prim_bounds)
+{
+    bvh_node_t *node = bvh->nodes+node_idx;
+    aabb_t box;
+    aabb_empty(&box);
+    
+    if(node->count) {
+        for(u32 i = 0; i < node->count; i++)
+            aabb_merge(&box, prim_bounds+bvh->prim_ids[node->first+i]);
+    }
+    else {
+        for(u32 i = 0; i < 2; i++) {
+            bvh_node_t *child = bvh->nodes+node->first+i;
+            glm_vec3_minv(box.min, child->min, box.min);
+            glm_vec3_maxv(box.max, child->max, box.max);
+        }
+    }
+    
+    if(glm_vec3_eqv(box.min, node->min) && glm_vec3_eqv(box.max, node->max))
+        return false;
+    
+    f32 weight = get_bvh_node_weight(node);
+    bvh->sah_sum -= get_bvh_node_area(node)*weight;
+    glm_vec3_copy(box.min, node->min);
+    glm_vec3_copy(box.max, node->max);
+    bvh->sah_sum += get_bvh_node_area(node)*weight;
+    
+    return true;
+}
+
+// NOTE(ajeej): refits the leaves of the given prims and their ancestors,
+// a walk stops at the first node whose box stays the same
+static void
+refit_bvh(bvh_t *bvh, aabb_t *prim_bounds, u32 *ids, u32 id_count)
+{
+    for(u32 i = 0; i < id_count; i++)
+    {
+        u32 node_idx = bvh->prim_nodes[ids[i]];
+        while(node_idx != (u32)-1 && fit_bvh_node(bvh, node_idx, prim_bounds))
+            node_idx = bvh->parents[node_idx];
+    }
+}
+
+// NOTE(ajeej): children are always stored after their parent, so going
+// backwards refits the whole tree bottom up
+static void
+refit_bvh_all(bvh_t *bvh, aabb_t *prim_bounds)
+{
+    for(u32 i = bvh->node_count; i > 0; i--)
+        fit_bvh_node(bvh, i-1, prim_bounds);
+}
+
+// NOTE(ajeej): binned sah, returns where [begin, end) gets split or begin
+// if the node is cheaper as a leaf
+static u32
+split_bvh_node(u32 *ids, u32 begin, u32 end, u32 depth,
+               aabb_t *prim_bounds, vec3 *centroids,
+               aabb_t *node_bounds, aabb_t *centroid_bounds)
+{
+    u32 count = end - begin;
+    if(count <= 1 || depth >= BVH_STACK_SIZE-1)
+        return begin;
+    
+    bvh_bin_t bins[BVH_BIN_COUNT];
+    f32 right_cost[BVH_BIN_COUNT];
+    f32 best_cost = FLT_MAX;
+    i32 best_axis = -1;
+    u32 best_bin = 0;
+    
+    for(u32 axis = 0; axis < 3; axis++)
+    {
+        f32 c_min = centroid_bounds->min[axis];
+        f32 extent = centroid_bounds->max[axis] - c_min;
+        if(extent <= 0)
+            continue;
+        
+        f32 scale = BVH_BIN_COUNT/extent;
+        for(u32 b = 0; b < BVH_BIN_COUNT; b++) {
+            aabb_empty(&bins[b].bounds);
+            bins[b].count = 0;
+        }
+        
+        for(u32 i = begin; i < end; i++) {
+            u32 b = MIN((u32)((centroids[ids[i]][axis] - c_min)*scale), BVH_BIN_COUNT-1);
+            bins[b].count++;
+            aabb_merge(&bins[b].bounds, prim_bounds+ids[i]);
+        }
+        
+        aabb_t acc;
+        u32 acc_count = 0;
+        aabb_empty(&acc);
+        for(u32 b = BVH_BIN_COUNT-1; b > 0; b--) {
+            aabb_merge(&acc, &bins[b].bounds);
+            acc_count += bins[b].count;
+            right_cost[b] = acc_count*aabb_area(&acc);
+        }
+        
+        acc_count = 0;
+        aabb_empty(&acc);
+        for(u32 b = 0; b < BVH_BIN_COUNT-1; b++) {
+            aabb_merge(&acc, &bins[b].bounds);
+            acc_count += bins[b].count;
+            
+            f32 cost = acc_count*aabb_area(&acc) + right_cost[b+1];
+            if(cost < best_cost) {
+                best_cost = cost;
+                best_axis = axis;
+                best_bin = b;
+            }
+        }
+    }
+    
+    // NOTE(ajeej): every centroid is in the same spot, split by index
+    if(best_axis < 0)
+        return (count <= BVH_MAX_LEAF_SIZE) ? begin : begin + count/2;
+    
+    f32 area = aabb_area(node_bounds);
+    f32 split_cost = BVH_TRAVERSAL_COST + ((area > 0) ? best_cost/area : 0.0f);
+    if(count <= BVH_MAX_LEAF_SIZE && split_cost >= (f32)count)
+        return begin;
+    
+    f32 c_min = centroid_bounds->min[best_axis];
+    f32 scale = BVH_BIN_COUNT/(centroid_bounds->max[best_axis] - c_min);
+    u32 i = begin, j = end;
+    while(i < j)
+    {
+        u32 b = MIN((u32)((centroids[ids[i]][best_axis] - c_min)*scale), BVH_BIN_COUNT-1);
+        if(b <= best_bin)
+            i++;
+        else {
+            u32 temp = ids[i];
+            ids[i] = ids[--j];
+            ids[j] = temp;
+        }
+    }
+    
+    if(i == begin || i == end)
+        i = begin + count/2;
+    
+    return i;
+}
+
+// NOTE(ajeej): the codes in [begin, end) share every bit above the highest
+// one where the first and last code differ, the split goes where that bit
+// turns on. Returns begin if the node should be a leaf.
+static u32
+split_lbvh_node(u32 *codes, u32 begin, u32 end, u32 depth)
+{
+    u32 count = end - begin;
+    if(count <= BVH_LBVH_LEAF_SIZE || depth >= BVH_STACK_SIZE-1)
+        return begin;
+    
+    u32 diff = codes[begin] ^ codes[end-1];
+    if(diff == 0)
+        return begin + count/2;
+    
+    u32 bit = diff;
+    bit |= bit >> 1;
+    bit |= bit >> 2;
+    bit |= bit >> 4;
+    bit |= bit >> 8;
+    bit |= bit >> 16;
+    bit = (bit >> 1) + 1;
+    
+    u32 lo = begin, hi = end-1;
+    while(lo < hi) {
+        u32 mid = lo + (hi - lo)/2;
+        if(codes[mid] & bit)
+            hi = mid;
+        else
+            lo = mid+1;
+    }
+    
+    return lo;
+}
+
+static void push_bvh_build_task(bvh_builder_t *builder, STACK(bvh_build_task_t) **tasks,
+                                u32 node_idx, u32 begin, u32 end, u32 depth);
+
+// NOTE(ajeej): builds the subtree of one task, the children are built right
+// here unless they are big enough to be handed to the thread pool
+static void
+build_bvh_subtree(bvh_builder_t *builder, bvh_build_task_t root)
+{
+    bvh_t *bvh = builder->bvh;
+    aabb_t *prim_bounds = builder->prim_bounds;
+    vec3 *centroids = builder->centroids;
+    
+    STACK(bvh_build_task_t) *tasks = NULL;
+    *(bvh_build_task_t *)stack_push(&tasks) = root;
+    
+    while(get_stack_count(tasks))
+    {
+        bvh_build_task_t task = *get_stack_last(tasks);
+        stack_pop(tasks);
+        
+        aabb_t node_bounds, centroid_bounds;
+        aabb_empty(&node_bounds);
+        aabb_empty(&centroid_bounds);
+        for(u32 i = task.begin; i < task.end; i++) {
+            aabb_merge(&node_bounds, prim_bounds+bvh->prim_ids[i]);
+            aabb_grow(&centroid_bounds, centroids[bvh->prim_ids[i]]);
+        }
+        
+        bvh_node_t *node = bvh->nodes+task.node_idx;
+        glm_vec3_copy(node_bounds.min, node->min);
+        glm_vec3_copy(node_bounds.max, node->max);
+        
+        u32 mid = (builder->preset == BVH_BUILD_LBVH) ?
+            split_lbvh_node(builder->morton, task.begin, task.end, task.depth) :
+            split_bvh_node(bvh->prim_ids, task.begin, task.end, task.depth,
+                           prim_bounds, centroids, &node_bounds, &centroid_bounds);
+        if(mid == task.begin) {
+            node->first = task.begin;
+            node->count = task.end - task.begin;
+            continue;
+        }
+        
+        u32 left = builder->node_count.fetch_add(2);
+        node->first = left;
+        node->count = 0;
+        
+        push_bvh_build_task(builder, &tasks, left+1, mid, task.end, task.depth+1);
+        push_bvh_build_task(builder, &tasks, left, task.begin, mid, task.depth+1);
+    }
+    
+    stack_free(tasks);
+}
+
+static void
+bvh_build_job_proc(void *data)
+{
+    bvh_build_job_t *job = (bvh_build_job_t *)data;
+    build_bvh_subtree(job->builder, job->task);
+    free(job);
+}
+
+static void
+push_bvh_build_task(bvh_builder_t *builder, STACK(bvh_build_task_t) **tasks,
+                    u32 node_idx, u32 begin, u32 end, u32 depth)
+{
+    bvh_build_task_t task;
+    task.node_idx = node_idx;
+    task.begin = begin;
+    task.end = end;
+    task.depth = depth;
+    
+    if(builder->pool && end - begin >= BVH_PARALLEL_MIN_PRIMS) {
+        bvh_build_job_t *job = (bvh_build_job_t *)malloc(sizeof(bvh_build_job_t));
+        job->builder = builder;
+        job->task = task;
+        push_job(builder->pool, bvh_build_job_proc, job, &builder->counter);
+    }
+    else
+        *(bvh_build_task_t *)stack_push(tasks) = task;
+}
+
+// NOTE(ajeej): spreads 10 bits so there are two zero bits between each
+static u32
+expand_morton_bits(u32 v)
+{
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+static void
+bvh_morton_job_proc(void *data)
+{
+    bvh_morton_job_t *job = (bvh_morton_job_t *)data;
+    bvh_builder_t *builder = job->builder;
+    
+    for(u32 i = job->begin; i < job->end; i++)
+    {
+        u32 code = 0;
+        for(u32 axis = 0; axis < 3; axis++) {
+            f32 c = (builder->centroids[i][axis] - job->offset[axis])*job->scale[axis];
+            u32 q = (u32)MIN(MAX(c, 0.0f), 1023.0f);
+            code |= expand_morton_bits(q) << (2-axis);
+        }
+        builder->morton[i] = code;
+    }
+}
+
+// NOTE(ajeej): lsd radix sort of the codes, ids are moved along with them
+static void
+radix_sort_morton(u32 *codes, u32 *ids, u32 count)
+{
+    u32 *temp_codes = (u32 *)malloc(sizeof(u32)*count);
+    u32 *temp_ids = (u32 *)malloc(sizeof(u32)*count);
+    
+    for(u32 shift = 0; shift < 32; shift += 8)
+    {
+        u32 offsets[256] = {0};
+        for(u32 i = 0; i < count; i++)
+            offsets[(codes[i] >> shift) & 0xFF]++;
+        
+        u32 sum = 0;
+        for(u32 b = 0; b < 256; b++) {
+            u32 c = offsets[b];
+            offsets[b] = sum;
+            sum += c;
+        }
+        
+        for(u32 i = 0; i < count; i++) {
+            u32 dst = offsets[(codes[i] >> shift) & 0xFF]++;
+            temp_codes[dst] = codes[i];
+            temp_ids[dst] = ids[i];
+        }
+        
+        memcpy(codes, temp_codes, sizeof(u32)*count);
+        memcpy(ids, temp_ids, sizeof(u32)*count);
+    }
+    
+    free(temp_codes);
+    free(temp_ids);
+}
+
+// NOTE(ajeej): morton codes of the centroids are computed in chunks on the
+// pool and sorted together with prim_ids
+static void
+sort_bvh_prims_morton(bvh_builder_t *builder, u32 prim_count)
+{
+    aabb_t centroid_bounds;
+    aabb_empty(&centroid_bounds);
+    for(u32 i = 0; i < prim_count; i++)
+        aabb_grow(&centroid_bounds, builder->centroids[i]);
+    
+    vec3 scale;
+    for(u32 axis = 0; axis < 3; axis++) {
+        f32 extent = centroid_bounds.max[axis] - centroid_bounds.min[axis];
+        scale[axis] = (extent > 0) ? 1023.0f/extent : 0.0f;
+    }
+    
+    u32 chunk_count = (prim_count + BVH_PARALLEL_MIN_PRIMS-1)/BVH_PARALLEL_MIN_PRIMS;
+    bvh_morton_job_t *jobs = (bvh_morton_job_t *)malloc(sizeof(bvh_morton_job_t)*chunk_count);
+    for(u32 i = 0; i < chunk_count; i++)
+    {
+        bvh_morton_job_t *job = jobs+i;
+        job->builder = builder;
+        job->begin = i*BVH_PARALLEL_MIN_PRIMS;
+        job->end = MIN(job->begin + BVH_PARALLEL_MIN_PRIMS, prim_count);
+        glm_vec3_copy(centroid_bounds.min, job->offset);
+        glm_vec3_copy(scale, job->scale);
+        
+        if(builder->pool)
+            push_job(builder->pool, bvh_morton_job_proc, job, &builder->counter);
+        else
+            bvh_morton_job_proc(job);
+    }
+    
+    if(builder->pool)
+        wait_for_jobs(builder->pool, &builder->counter);
+    free(jobs);
+    
+    radix_sort_morton(builder->morton, builder->bvh->prim_ids, prim_count);
+}
+
+// NOTE(ajeej): the jobs of a build on the pool take their nodes from a
+// shared counter, so the slot of a node depends on which job got there
+// first. This moves the nodes to the slots a build without the pool gives
+// them: depth first, left before right, with the two children of a node
+// next to each other. The shape of the tree does not depend on the pool,
+// so neither does the node array after this.
+static void
+order_bvh_nodes(bvh_t *bvh)
+{
+    bvh_node_t *nodes = (bvh_node_t *)_mm_malloc(sizeof(bvh_node_t)*2*bvh->prim_count, 64);
+    u32 node_count = 1;
+    
+    STACK(bvh_order_entry_t) *entries = NULL;
+    bvh_order_entry_t *root = (bvh_order_entry_t *)stack_push(&entries);
+    root->node_idx = 0;
+    root->new_idx = 0;
+    
+    while(get_stack_count(entries))
+    {
+        bvh_order_entry_t entry = *get_stack_last(entries);
+        stack_pop(entries);
+        
+        bvh_node_t *node = nodes+entry.new_idx;
+        *node = bvh->nodes[entry.node_idx];
+        if(node->count)
+            continue;
+        
+        u32 old_first = node->first;
+        node->first = node_count;
+        node_count += 2;
+        
+        for(u32 i = 2; i-- > 0;) {
+            bvh_order_entry_t *child = (bvh_order_entry_t *)stack_push(&entries);
+            child->node_idx = old_first+i;
+            child->new_idx = node->first+i;
+        }
+    }
+    
+    stack_free(entries);
+    _mm_free(bvh->nodes);
+    bvh->nodes = nodes;
+}
+
+// NOTE(ajeej): builds a flattened bvh over the given primitive bounds, the
+// primitive order is kept in prim_ids. Big subtrees are built as jobs on
+// the pool if one is given, stats can be NULL.
+static void
+build_bvh_parallel(bvh_t *bvh, aabb_t *prim_bounds, u32 prim_count,
+                   thread_pool_t *pool, u32 preset, bvh_build_stats_t *stats)
+{
+    timer_t timer;
+    init_timer(&timer);
+    start_timer(&timer);
+    
+    free_bvh(bvh);
+    if(prim_count == 0)
+        return;
+    
+    bvh->prim_count = prim_count;
+    bvh->prim_ids = (u32 *)malloc(sizeof(u32)*prim_count);
+    bvh->nodes = (bvh_node_t *)_mm_malloc(sizeof(bvh_node_t)*2*prim_count, 64);
+    
+    bvh_builder_t builder;
+    builder.bvh = bvh;
+    builder.prim_bounds = prim_bounds;
+    builder.centroids = (vec3 *)malloc(sizeof(vec3)*prim_count);
+    builder.morton = NULL;
+    builder.preset = preset;
+    builder.pool = pool;
+    builder.node_count = 1;
+    builder.counter = 0;
+    
+    for(u32 i = 0; i < prim_count; i++) {
+        bvh->prim_ids[i] = i;
+        glm_vec3_add(prim_bounds[i].min, prim_bounds[i].max, builder.centroids[i]);
+        glm_vec3_scale(builder.centroids[i], 0.5f, builder.centroids[i]);
+    }
+    
+    if(preset == BVH_BUILD_LBVH) {
+        builder.morton = (u32 *)malloc(sizeof(u32)*prim_count);
+        sort_bvh_prims_morton(&builder, prim_count);
+    }
+    
+    bvh_build_task_t root;
+    root.node_idx = 0;
+    root.begin = 0;
+    root.end = prim_count;
+    root.depth = 0;
+    build_bvh_subtree(&builder, root);
+    if(pool)
+        wait_for_jobs(pool, &builder.counter);
+    
+    bvh->node_count = builder.node_count;
+    if(pool)
+        order_bvh_nodes(bvh);
+    free(builder.centroids);
+    if(builder.morton)
+        free(builder.morton);
+    
+    link_bvh_nodes(bvh);
+    end_timer(&timer);
+    
+    if(stats)
+    {
+        u32 leaf_count = 0;
+        for(u32 i = 0; i < bvh->node_count; i++)
+            leaf_count += (bvh->nodes[i].count) ? 1 : 0;
+        
+        u32 total = stats->prim_count + prim_count;
+        stats->sah_cost = (stats->sah_cost*stats->prim_count + bvh->build_cost*prim_count)/total;
+        stats->bvh_count++;
+        stats->prim_count = total;
+        stats->node_count += bvh->node_count;
+        stats->leaf_count += leaf_count;
+        stats->build_ms += timer.nanos_elapsed/1E6;
+    }
+}
+
+static void
+build_bvh(bvh_t *bvh, aabb_t *prim_bounds, u32 prim_count)
+{
+    build_bvh_parallel(bvh, prim_bounds, prim_count, NULL, BVH_BUILD_SAH, NULL);
+}
+
+// NOTE(ajeej): a bvh that is one leaf over every prim, for when the real
+// tree is built somewhere else and only the bounds are needed here
+static void
+build_bvh_leaf(bvh_t *bvh, aabb_t *prim_bounds, u32 prim_count)
+{
+    free_bvh(bvh);
+    if(prim_count == 0)
+        return;
+    
+    bvh->prim_count = prim_count;
+    bvh->node_count = 1;
+    bvh->prim_ids = (u32 *)malloc(sizeof(u32)*prim_count);
+    bvh->nodes = (bvh_node_t *)_mm_malloc(sizeof(bvh_node_t), 64);
+    
+    aabb_t root;
+    aabb_empty(&root);
+    for(u32 i = 0; i < prim_count; i++) {
+        bvh->prim_ids[i] = i;
+        aabb_merge(&root, prim_bounds+i);
+    }
+    
+    glm_vec3_copy(root.min, bvh->nodes[0].min);
+    glm_vec3_copy(root.max, bvh->nodes[0].max);
+    bvh->nodes[0].first = 0;
+    bvh->nodes[0].count = prim_count;
+    
+    link_bvh_nodes(bvh);
+}
+
+static void
+print_bvh_stats(bvh_build_stats_t *stats)
+{
+    printf("bvh: %u trees, %u prims, %u nodes, %u leaves, %.2f ms, sah cost %.2f\n",
+           stats->bvh_count, stats->prim_count, stats->node_count, stats->leaf_count,
+           stats->build_ms, stats->sah_cost);
+}
+
+static void
+init_bvh_rebuild(bvh_rebuild_t *rebuild)
+{
+    rebuild->done = false;
+    rebuild->running = false;
+    rebuild->bounds = NULL;
+    rebuild->prim_count = 0;
+    memset(&rebuild->bvh, 0, sizeof(rebuild->bvh));
+}
+
+static void
+bvh_rebuild_proc(bvh_rebuild_t *rebuild)
+{
+    build_bvh(&rebuild->bvh, rebuild->bounds, rebuild->prim_count);
+    rebuild->done = true;
+}
+
+static void
+start_bvh_rebuild(bvh_rebuild_t *rebuild, aabb_t *bounds, u32 prim_count)
+{
+    if(rebuild->running)
+        return;
+    
+    rebuild->bounds = (aabb_t *)malloc(sizeof(aabb_t)*MAX(prim_count, 1));
+    memcpy(rebuild->bounds, bounds, sizeof(aabb_t)*prim_count);
+    rebuild->prim_count = prim_count;
+    rebuild->done = false;
+    rebuild->running = true;
+    rebuild->thread = std::thread(bvh_rebuild_proc, rebuild);
+}
+
+// NOTE(ajeej): moves the rebuilt bvh into out once the thread is done (or
+// after waiting for it), the caller still has to refit it since the
+// bounds could have changed since the rebuild started
+static bool
+finish_bvh_rebuild(bvh_rebuild_t *rebuild, bvh_t *out, bool wait)
+{
+    if(!rebuild->running || (!wait && !rebuild->done))
+        return false;
+    
+    rebuild->thread.join();
+    rebuild->running = false;
+    free(rebuild->bounds);
+    rebuild->bounds = NULL;
+    
+    free_bvh(out);
+    *out = rebuild->bvh;
+    memset(&rebuild->bvh, 0, sizeof(rebuild->bvh));
+    
+    return true;
+}
+
+static void
+cancel_bvh_rebuild(bvh_rebuild_t *rebuild)
+{
+    bvh_t discard = {0};
+    if(finish_bvh_rebuild(rebuild, &discard, true))
+        free_bvh(&discard);
+}
+
+// NOTE(ajeej): ordered traversal, the nearer child is visited first and the
+// other one is pushed with its entry distance so it can be skipped once
+// something closer was hit. Returns the closest prim id or -1.
+static i32
+traverse_bvh(bvh_t *bvh, vec3 p, vec3 dir, f32 *t_max,
+             bvh_leaf_func_t *intersect_leaf, void *data)
+{
+    i32 closest = -1;
+    if(bvh->node_count == 0)
+        return closest;
+    
+    vec3 inv_dir;
+    for(u32 i = 0; i < 3; i++)
+        inv_dir[i] = 1.0f/dir[i];
+    
+    if(intersect_aabb(bvh->nodes[0].min, bvh->nodes[0].max, p, inv_dir, *t_max) == FLT_MAX)
+        return closest;
+    
+    bvh_stack_entry_t stack[BVH_STACK_SIZE];
+    u32 stack_count = 0;
+    bvh_node_t *node = bvh->nodes;
+    
+    for(;;)
+    {
+        if(node->count)
+        {
+            i32 hit = intersect_leaf(data, bvh->prim_ids+node->first, node->count, p, dir, t_max);
+            if(hit >= 0)
+                closest = hit;
+        }
+        else
+        {
+            bvh_node_t *near_node = bvh->nodes+node->first, *far_node = near_node+1;
+            f32 t_near = intersect_aabb(near_node->min, near_node->max, p, inv_dir, *t_max);
+            f32 t_far = intersect_aabb(far_node->min, far_node->max, p, inv_dir, *t_max);
+            
+            if(t_far < t_near) {
+                bvh_node_t *temp_node = near_node; near_node = far_node; far_node = temp_node;
+                f32 temp = t_near; t_near = t_far; t_far = temp;
+            }
+            
+            if(t_near != FLT_MAX) {
+                if(t_far != FLT_MAX) {
+                    stack[stack_count].node_idx = (u32)(far_node - bvh->nodes);
+                    stack[stack_count].t = t_far;
+                    stack_count++;
+                }
+                node = near_node;
+                continue;
+            }
+        }
+        
+        // NOTE(ajeej): skip nodes that are further than the closest hit
+        do {
+            if(stack_count == 0)
+                return closest;
+            stack_count--;
+        } while(stack[stack_count].t >= *t_max);
+        node = bvh->nodes+stack[stack_count].node_idx;
+    }
+}
+
+static void
+prepare_bvh_packet(bvh_packet_t *packet)
+{
+    packet->coherent = true;
+    
+    for(u32 i = 0; i < packet->count; i++)
+    {
+        packet->closest[i] = -1;
+        
+        // NOTE(ajeej): a zero direction gets a huge but finite inverse so
+        // neither the bvh8 slab test nor the interval math sees 0*inf
+        for(u32 axis = 0; axis < 3; axis++) {
+            f32 d = packet->dir[i][axis];
+            f32 inv = 1.0f/((fabsf(d) > 1E-20f) ? d : copysignf(1E-20f, d));
+            packet->inv_dir[i][axis] = inv;
+            if(i == 0) {
+                packet->inv_min[axis] = packet->inv_max[axis] = inv;
+                continue;
+            }
+            
+            if((inv < 0) != (packet->inv_min[axis] < 0))
+                packet->coherent = false;
+            packet->inv_min[axis] = fminf(packet->inv_min[axis], inv);
+            packet->inv_max[axis] = fmaxf(packet->inv_max[axis], inv);
+        }
+    }
+}
+
+// NOTE(ajeej): interval version of the slab test over every ray of a
+// coherent packet, returns true if no ray of the packet can hit the box
+// nearer than t_max
+static bool
+cull_bvh_packet_box(bvh_packet_t *packet, vec3 min, vec3 max, f32 t_max)
+{
+    if(!packet->coherent)
+        return false;
+    
+    f32 t_near = 0.0f, t_far = t_max;
+    for(u32 axis = 0; axis < 3; axis++)
+    {
+        f32 lo = packet->inv_min[axis], hi = packet->inv_max[axis];
+        f32 near_d = min[axis] - packet->origin[axis];
+        f32 far_d = max[axis] - packet->origin[axis];
+        if(lo < 0) {
+            f32 temp = near_d; near_d = far_d; far_d = temp;
+        }
+        
+        t_near = fmaxf(t_near, fminf(near_d*lo, near_d*hi));
+        t_far = fminf(t_far, fmaxf(far_d*lo, far_d*hi));
+    }
+    
+    return t_near > t_far;
+}
+
+static f32
+get_bvh_packet_t_max(bvh_packet_t *packet)
+{
+    f32 t_max = 0.0f;
+    for(u32 i = 0; i < packet->count; i++)
+        t_max = fmaxf(t_max, packet->t[i]);
+    return t_max;
+}
+
+// NOTE(ajeej): traces every ray of the packet through the bvh at once. A node
+// is skipped if the packet misses it as a whole, otherwise the rays are
+// tested in order until one hits it and only that ray and the ones after it
+// go on to the children.
+static void
+traverse_bvh_packet(bvh_t *bvh, bvh_packet_t *packet, bvh_packet_leaf_func_t *intersect_prim)
+{
+    prepare_bvh_packet(packet);
+    if(bvh->node_count == 0 || packet->count == 0)
+        return;
+    
+    f32 t_max = get_bvh_packet_t_max(packet);
+    vec3 o;
+    glm_vec3_copy(packet->origin, o);
+    
+    bvh_packet_entry_t stack[BVH_STACK_SIZE];
+    u32 stack_count = 1;
+    stack[0].node_idx = 0;
+    stack[0].first = 0;
+    
+    while(stack_count)
+    {
+        bvh_packet_entry_t entry = stack[--stack_count];
+        bvh_node_t *node = bvh->nodes+entry.node_idx;
+        if(cull_bvh_packet_box(packet, node->min, node->max, t_max))
+            continue;
+        
+        u32 first = entry.first;
+        while(first < packet->count &&
+              intersect_aabb(node->min, node->max, o, packet->inv_dir[first], packet->t[first]) == FLT_MAX)
+            first++;
+        if(first == packet->count)
+            continue;
+        
+        if(node->count)
+        {
+            for(u32 i = 0; i < node->count; i++)
+            {
+                u32 id = bvh->prim_ids[node->first+i];
+                u32 hit_mask = intersect_prim(id, packet, first);
+                for(u32 r = first; r < packet->count; r++)
+                    if(hit_mask & (1u << r))
+                        packet->closest[r] = id;
+            }
+            
+            t_max = get_bvh_packet_t_max(packet);
+            continue;
+        }
+        
+        // NOTE(ajeej): the child the first active ray enters first is
+        // popped first
+        bvh_node_t *near_node = bvh->nodes+node->first, *far_node = near_node+1;
+        f32 t_near = intersect_aabb(near_node->min, near_node->max, o, packet->inv_dir[first], packet->t[first]);
+        f32 t_far = intersect_aabb(far_node->min, far_node->max, o, packet->inv_dir[first], packet->t[first]);
+        if(t_far < t_near) {
+            bvh_node_t *temp_node = near_node; near_node = far_node; far_node = temp_node;
+        }
+        
+        stack[stack_count].node_idx = (u32)(far_node - bvh->nodes);
+        stack[stack_count].first = first;
+        stack_count++;
+        stack[stack_count].node_idx = (u32)(near_node - bvh->nodes);
+        stack[stack_count].first = first;
+        stack_count++;
+    }
+}
+
+static void
+free_bvh8(bvh8_t *bvh8)
+{
+    if(bvh8->nodes)
+        _mm_free(bvh8->nodes);
+    if(bvh8->leaves)
+        _mm_free(bvh8->leaves);
+    if(bvh8->leaf_tris)
+        free(bvh8->leaf_tris);
+    memset(bvh8, 0, sizeof(*bvh8));
+}
+
+static f32
+get_bvh8_scale(i8 exp)
+{
+    u32 bits = (u32)(exp + 127) << 23;
+    f32 scale;
+    memcpy(&scale, &bits, sizeof(scale));
+    return scale;
+}
+
+// NOTE(ajeej): a wide node over the box of a binary node, the children get
+// offsets from its min corner in steps that fit the extent into 255
+static void
+init_bvh8_node(bvh8_node_t *wide, bvh_node_t *node)
+{
+    memset(wide, 0, sizeof(*wide));
+    glm_vec3_copy(node->min, wide->origin);
+    for(u32 axis = 0; axis < 3; axis++) {
+        f32 extent = node->max[axis] - node->min[axis];
+        i32 exp = (extent > 0) ? (i32)ceilf(log2f(extent/255.0f)) : -126;
+        wide->exp[axis] = (i8)MIN(MAX(exp, -126), 127);
+    }
+}
+
+// NOTE(ajeej): fills one child slot with the box of a binary node, the
+// offsets are rounded down for the min and up for the max
+static void
+quantize_bvh8_child(bvh8_node_t *wide, u32 slot, bvh_node_t *node)
+{
+    for(u32 axis = 0; axis < 3; axis++)
+    {
+        f32 inv_scale = 1.0f/get_bvh8_scale(wide->exp[axis]);
+        f32 lo = floorf((node->min[axis] - wide->origin[axis])*inv_scale);
+        f32 hi = ceilf((node->max[axis] - wide->origin[axis])*inv_scale);
+        wide->q_min[axis][slot] = (u8)MIN(MAX(lo, 0.0f), 255.0f);
+        wide->q_max[axis][slot] = (u8)MIN(MAX(hi, 0.0f), 255.0f);
+    }
+}
+
+// NOTE(ajeej): first vertex and both edges of a triangle of the mesh
+static void
+get_bvh_mesh_tri(bvh_tri_mesh_t *mesh, u32 tri_id, vec3 v0, vec3 e1, vec3 e2)
+{
+    u32 *idx = mesh->indices + tri_id*3;
+    f32 *p0 = mesh->verts + idx[0]*3;
+    f32 *p1 = mesh->verts + idx[1]*3;
+    f32 *p2 = mesh->verts + idx[2]*3;
+    
+    glm_vec3_copy(p0, v0);
+    glm_vec3_sub(p1, p0, e1);
+    glm_vec3_sub(p2, p0, e2);
+}
+
+// NOTE(ajeej): fills a leaf block from the triangle ids of its lanes, ids
+// of -1 leave the lane zeroed so it is never hit
+static void
+fill_bvh8_leaf(bvh8_leaf_t *leaf, u32 *ids, bvh_tri_mesh_t *mesh)
+{
+    memset(leaf, 0, sizeof(*leaf));
+    
+    for(u32 lane = 0; lane < BVH8_WIDTH; lane++)
+    {
+        leaf->tri_id[lane] = ids[lane];
+        if(ids[lane] == (u32)-1)
+            continue;
+        
+        vec3 v0, e1, e2;
+        get_bvh_mesh_tri(mesh, ids[lane], v0, e1, e2);
+        for(u32 axis = 0; axis < 3; axis++) {
+            leaf->v0[axis][lane] = v0[axis];
+            leaf->e1[axis][lane] = e1[axis];
+            leaf->e2[axis][lane] = e2[axis];
+        }
+    }
+}
+
+// NOTE(ajeej): leaf block of a bvh8, read from the mesh into scratch if the
+// bvh8 does not keep copies of its triangles
+static bvh8_leaf_t *
+get_bvh8_leaf(bvh8_t *bvh8, bvh_tri_mesh_t *mesh, u32 block, bvh8_leaf_t *scratch)
+{
+    if(bvh8->leaves)
+        return bvh8->leaves+block;
+    
+    fill_bvh8_leaf(scratch, bvh8->leaf_tris + block*BVH8_WIDTH, mesh);
+    return scratch;
+}
+
+// NOTE(ajeej): child value for count leaf blocks from first on. A child
+// only has room for BVH8_LEAF_MAX_BLOCKS blocks, more than that (leaves the
+// builders had to stop splitting at BVH_STACK_SIZE) get extra wide nodes
+// with the box of the binary leaf that split the blocks between their
+// children.
+static u32
+get_bvh8_leaf_child(bvh8_t *bvh8, bvh_node_t *node, u32 first, u32 count)
+{
+    assert(first + count <= (1u << BVH8_LEAF_COUNT_SHIFT));
+    if(count <= BVH8_LEAF_MAX_BLOCKS)
+        return BVH8_LEAF_FLAG | (count << BVH8_LEAF_COUNT_SHIFT) | first;
+    
+    u32 wide_idx = bvh8->node_count++;
+    bvh8_node_t *wide = bvh8->nodes+wide_idx;
+    init_bvh8_node(wide, node);
+    
+    u32 child_count = MIN((count + BVH8_LEAF_MAX_BLOCKS-1)/BVH8_LEAF_MAX_BLOCKS, BVH8_WIDTH);
+    u32 child_blocks = (count + child_count-1)/child_count;
+    wide->child_count = (u8)child_count;
+    for(u32 i = 0; i < child_count; i++) {
+        u32 begin = i*child_blocks;
+        quantize_bvh8_child(wide, i, node);
+        wide->child[i] = get_bvh8_leaf_child(bvh8, node, first+begin,
+                                             MIN(child_blocks, count-begin));
+    }
+    
+    return wide_idx;
+}
+
+// NOTE(ajeej): puts the triangles of a binary leaf into blocks of 8,
+// returns the child value that points at them
+static u32
+add_bvh8_leaf(bvh8_t *bvh8, bvh_t *bvh, bvh_node_t *node, bvh_tri_mesh_t *mesh)
+{
+    u32 first = bvh8->leaf_count;
+    u32 block_count = (node->count + BVH8_WIDTH-1)/BVH8_WIDTH;
+    
+    for(u32 b = 0; b < block_count; b++)
+    {
+        u32 block = bvh8->leaf_count++;
+        u32 ids[BVH8_WIDTH];
+        for(u32 lane = 0; lane < BVH8_WIDTH; lane++) {
+            u32 i = b*BVH8_WIDTH + lane;
+            ids[lane] = (i < node->count) ? bvh->prim_ids[node->first+i] : (u32)-1;
+        }
+        
+        if(bvh8->leaves)
+            fill_bvh8_leaf(bvh8->leaves+block, ids, mesh);
+        else
+            memcpy(bvh8->leaf_tris + block*BVH8_WIDTH, ids, sizeof(ids));
+    }
+    
+    return get_bvh8_leaf_child(bvh8, node, first, block_count);
+}
+
+// NOTE(ajeej): collapses a binary bvh over triangles into a bvh8. Every wide
+// node starts with the two children of a binary node and keeps opening the
+// interior child with the largest area until it has 8 children. copy_tris
+// stores the triangles in the leaves, which is faster to trace but takes
+// about 40 bytes per triangle instead of 4.
+static void
+build_bvh8(bvh8_t *bvh8, bvh_t *bvh, bvh_tri_mesh_t *mesh, bool copy_tris)
+{
+    free_bvh8(bvh8);
+    if(bvh->node_count == 0)
+        return;
+    
+    // NOTE(ajeej): a leaf split by get_bvh8_leaf_child takes fewer extra
+    // nodes than it has children
+    u32 leaf_cap = 0, node_cap = bvh->node_count;
+    for(u32 i = 0; i < bvh->node_count; i++) {
+        u32 blocks = (bvh->nodes[i].count + BVH8_WIDTH-1)/BVH8_WIDTH;
+        leaf_cap += blocks;
+        if(blocks > BVH8_LEAF_MAX_BLOCKS)
+            node_cap += (blocks + BVH8_LEAF_MAX_BLOCKS-1)/BVH8_LEAF_MAX_BLOCKS;
+    }
+    
+    bvh8->nodes = (bvh8_node_t *)_mm_malloc(sizeof(bvh8_node_t)*node_cap, 64);
+    if(copy_tris)
+        bvh8->leaves = (bvh8_leaf_t *)_mm_malloc(sizeof(bvh8_leaf_t)*MAX(leaf_cap, 1), 64);
+    else
+        bvh8->leaf_tris = (u32 *)malloc(sizeof(u32)*BVH8_WIDTH*MAX(leaf_cap, 1));
+    bvh8->node_count = 1;
+    
+    STACK(bvh8_build_entry_t) *entries = NULL;
+    bvh8_build_entry_t *root = (bvh8_build_entry_t *)stack_push(&entries);
+    root->node_idx = 0;
+    root->wide_idx = 0;
+    
+    while(get_stack_count(entries))
+    {
+        bvh8_build_entry_t entry = *get_stack_last(entries);
+        stack_pop(entries);
+        
+        bvh_node_t *node = bvh->nodes+entry.node_idx;
+        bvh8_node_t *wide = bvh8->nodes+entry.wide_idx;
+        init_bvh8_node(wide, node);
+        
+        u32 children[BVH8_WIDTH], child_count = 0;
+        if(node->count)
+            children[child_count++] = entry.node_idx;
+        else {
+            children[child_count++] = node->first;
+            children[child_count++] = node->first+1;
+        }
+        
+        while(child_count < BVH8_WIDTH)
+        {
+            i32 best = -1;
+            f32 best_area = -1.0f;
+            for(u32 i = 0; i < child_count; i++) {
+                bvh_node_t *child = bvh->nodes+children[i];
+                f32 area = get_bvh_node_area(child);
+                if(child->count == 0 && area > best_area) {
+                    best_area = area;
+                    best = i;
+                }
+            }
+            if(best < 0)
+                break;
+            
+            u32 first = bvh->nodes[children[best]].first;
+            children[best] = first;
+            children[child_count++] = first+1;
+        }
+        
+        wide->child_count = (u8)child_count;
+        
+        for(u32 i = 0; i < child_count; i++)
+        {
+            bvh_node_t *child = bvh->nodes+children[i];
+            quantize_bvh8_child(wide, i, child);
+            
+            if(child->count) {
+                wide->child[i] = add_bvh8_leaf(bvh8, bvh, child, mesh);
+            }
+            else {
+                bvh8_build_entry_t *next = (bvh8_build_entry_t *)stack_push(&entries);
+                next->node_idx = children[i];
+                next->wide_idx = bvh8->node_count++;
+                wide->child[i] = next->wide_idx;
+            }
+        }
+    }
+    
+    stack_free(entries);
+}
+
+// NOTE(ajeej): tests the ray against all 8 triangles of a leaf block in the
+// object space of the mesh. The distance comes from the plane through v0 with
+// the normal e1 x e2 and the barycentrics from (p - v0) x dir, only front
+// faces (counter clockwise when seen from the ray) are hit. Returns the lane
+// of the closest hit nearer than t_max (which gets updated) or -1.
+static i32
+intersect_bvh8_leaf(bvh8_leaf_t *leaf, vec3 p, vec3 dir, f32 *t_max)
+{
+    i32 closest = -1;
+    
+#if defined(__AVX2__)
+    __m256 dx = _mm256_set1_ps(dir[0]), dy = _mm256_set1_ps(dir[1]), dz = _mm256_set1_ps(dir[2]);
+    __m256 e1x = _mm256_load_ps(leaf->e1[0]), e1y = _mm256_load_ps(leaf->e1[1]), e1z = _mm256_load_ps(leaf->e1[2]);
+    __m256 e2x = _mm256_load_ps(leaf->e2[0]), e2y = _mm256_load_ps(leaf->e2[1]), e2z = _mm256_load_ps(leaf->e2[2]);
+    __m256 ox = _mm256_sub_ps(_mm256_set1_ps(p[0]), _mm256_load_ps(leaf->v0[0]));
+    __m256 oy = _mm256_sub_ps(_mm256_set1_ps(p[1]), _mm256_load_ps(leaf->v0[1]));
+    __m256 oz = _mm256_sub_ps(_mm256_set1_ps(p[2]), _mm256_load_ps(leaf->v0[2]));
+    
+    // NOTE(ajeej): norm = e1 x e2, dv0o = v0o x dir
+    __m256 nx = _mm256_sub_ps(_mm256_mul_ps(e1y, e2z), _mm256_mul_ps(e1z, e2y));
+    __m256 ny = _mm256_sub_ps(_mm256_mul_ps(e1z, e2x), _mm256_mul_ps(e1x, e2z));
+    __m256 nz = _mm256_sub_ps(_mm256_mul_ps(e1x, e2y), _mm256_mul_ps(e1y, e2x));
+    __m256 cx = _mm256_sub_ps(_mm256_mul_ps(oy, dz), _mm256_mul_ps(oz, dy));
+    __m256 cy = _mm256_sub_ps(_mm256_mul_ps(oz, dx), _mm256_mul_ps(ox, dz));
+    __m256 cz = _mm256_sub_ps(_mm256_mul_ps(ox, dy), _mm256_mul_ps(oy, dx));
+    
+    __m256 zero = _mm256_setzero_ps();
+    __m256 det = _mm256_sub_ps(zero, _mm256_add_ps(_mm256_mul_ps(dx, nx),
+                                                   _mm256_add_ps(_mm256_mul_ps(dy, ny), _mm256_mul_ps(dz, nz))));
+    __m256 inv_det = _mm256_div_ps(_mm256_set1_ps(1.0f), det);
+    __m256 t = _mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(ox, nx),
+                                           _mm256_add_ps(_mm256_mul_ps(oy, ny), _mm256_mul_ps(oz, nz))), inv_det);
+    __m256 u = _mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(e2x, cx),
+                                           _mm256_add_ps(_mm256_mul_ps(e2y, cy), _mm256_mul_ps(e2z, cz))), inv_det);
+    __m256 v = _mm256_sub_ps(zero, _mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(e1x, cx),
+                                                               _mm256_add_ps(_mm256_mul_ps(e1y, cy), _mm256_mul_ps(e1z, cz))), inv_det));
+    
+    __m256 mask = _mm256_cmp_ps(det, _mm256_set1_ps(1E-6f), _CMP_GE_OQ);
+    mask = _mm256_and_ps(mask, _mm256_cmp_ps(t, zero, _CMP_GE_OQ));
+    mask = _mm256_and_ps(mask, _mm256_cmp_ps(t, _mm256_set1_ps(*t_max), _CMP_LT_OQ));
+    mask = _mm256_and_ps(mask, _mm256_cmp_ps(u, zero, _CMP_GE_OQ));
+    mask = _mm256_and_ps(mask, _mm256_cmp_ps(v, zero, _CMP_GE_OQ));
+    mask = _mm256_and_ps(mask, _mm256_cmp_ps(_mm256_add_ps(u, v), _mm256_set1_ps(1.0f), _CMP_LE_OQ));
+    
+    u32 lane_mask = _mm256_movemask_ps(mask);
+    if(lane_mask == 0)
+        return closest;
+    
+    alignas(32) f32 dists[BVH8_WIDTH];
+    _mm256_store_ps(dists, t);
+    for(u32 lane = 0; lane < BVH8_WIDTH; lane++) {
+        if((lane_mask & (1u << lane)) && dists[lane] < *t_max) {
+            *t_max = dists[lane];
+            closest = (i32)lane;
+        }
+    }
+#else
+    for(u32 lane = 0; lane < BVH8_WIDTH; lane++)
+    {
+        vec3 v0, e1, e2, norm, v0o, dv0o;
+        for(u32 axis = 0; axis < 3; axis++) {
+            v0[axis] = leaf->v0[axis][lane];
+            e1[axis] = leaf->e1[axis][lane];
+            e2[axis] = leaf->e2[axis][lane];
+        }
+        glm_vec3_cross(e1, e2, norm);
+        
+        f32 det = -glm_vec3_dot(dir, norm);
+        if(det < 1E-6)
+            continue;
+        
+        glm_vec3_sub(p, v0, v0o);
+        f32 inv_det = 1.0f/det;
+        f32 dist = glm_vec3_dot(v0o, norm)*inv_det;
+        if(dist < 0 || dist >= *t_max)
+            continue;
+        
+        glm_vec3_cross(v0o, dir, dv0o);
+        f32 u = glm_vec3_dot(e2, dv0o)*inv_det;
+        f32 v = -glm_vec3_dot(e1, dv0o)*inv_det;
+        if(u < 0 || v < 0 || u + v > 1)
+            continue;
+        
+        *t_max = dist;
+        closest = (i32)lane;
+    }
+#endif
+    
+    return closest;
+}
+
+// NOTE(ajeej): slab test against the 8 quantized child boxes, writes the
+// entry distance of every child that is hit and returns them as a mask
+static u32
+intersect_bvh8_children(bvh8_node_t *node, vec3 p, vec3 inv_dir, f32 t_max, f32 *t_out)
+{
+    u32 hit_mask = 0;
+    
+#if defined(__AVX2__)
+    __m256 t_near = _mm256_setzero_ps();
+    __m256 t_far = _mm256_set1_ps(t_max);
+    
+    for(u32 axis = 0; axis < 3; axis++)
+    {
+        f32 scale = get_bvh8_scale(node->exp[axis]);
+        __m128i q_min = _mm_loadl_epi64((__m128i *)node->q_min[axis]);
+        __m128i q_max = _mm_loadl_epi64((__m128i *)node->q_max[axis]);
+        __m256 lo = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(q_min));
+        __m256 hi = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(q_max));
+        
+        // NOTE(ajeej): (origin + q*scale - p)*inv_dir = q*a + b
+        __m256 a = _mm256_set1_ps(scale*inv_dir[axis]);
+        __m256 b = _mm256_set1_ps((node->origin[axis] - p[axis])*inv_dir[axis]);
+        __m256 t0 = _mm256_add_ps(_mm256_mul_ps(lo, a), b);
+        __m256 t1 = _mm256_add_ps(_mm256_mul_ps(hi, a), b);
+        
+        t_near = _mm256_max_ps(t_near, _mm256_min_ps(t0, t1));
+        t_far = _mm256_min_ps(t_far, _mm256_max_ps(t0, t1));
+    }
+    
+    hit_mask = _mm256_movemask_ps(_mm256_cmp_ps(t_near, t_far, _CMP_LE_OQ));
+    hit_mask &= (1u << node->child_count) - 1;
+    _mm256_storeu_ps(t_out, t_near);
+#else
+    for(u32 i = 0; i < node->child_count; i++)
+    {
+        f32 t_near = 0.0f, t_far = t_max;
+        for(u32 axis = 0; axis < 3; axis++) {
+            f32 scale = get_bvh8_scale(node->exp[axis]);
+            f32 b = (node->origin[axis] - p[axis])*inv_dir[axis];
+            f32 t0 = node->q_min[axis][i]*scale*inv_dir[axis] + b;
+            f32 t1 = node->q_max[axis][i]*scale*inv_dir[axis] + b;
+            t_near = fmaxf(t_near, fminf(t0, t1));
+            t_far = fminf(t_far, fmaxf(t0, t1));
+        }
+        
+        t_out[i] = t_near;
+        if(t_near <= t_far)
+            hit_mask |= 1u << i;
+    }
+#endif
+    
+    return hit_mask;
+}
+
+// NOTE(ajeej): closest hit through a bvh8, the children that are hit get
+// pushed furthest first so the nearest one is popped next. Returns the
+// index of the closest triangle or -1. mesh is the one the bvh8 was built
+// from.
+static i32
+traverse_bvh8(bvh8_t *bvh8, bvh_tri_mesh_t *mesh, vec3 p, vec3 dir, f32 *t_max)
+{
+    i32 closest = -1;
+    if(bvh8->node_count == 0)
+        return closest;
+    
+    // NOTE(ajeej): a zero direction would give 0*inf in the slab test
+    vec3 inv_dir;
+    for(u32 i = 0; i < 3; i++)
+        inv_dir[i] = 1.0f/((fabsf(dir[i]) > 1E-20f) ? dir[i] : copysignf(1E-20f, dir[i]));
+    
+    alignas(32) bvh8_leaf_t scratch;
+    bvh8_stack_entry_t stack[BVH8_STACK_SIZE];
+    u32 stack_count = 1;
+    stack[0].child = 0;
+    stack[0].t = 0.0f;
+    
+    while(stack_count)
+    {
+        bvh8_stack_entry_t entry = stack[--stack_count];
+        if(entry.t >= *t_max)
+            continue;
+        
+        if(entry.child & BVH8_LEAF_FLAG)
+        {
+            u32 first = entry.child & ((1u << BVH8_LEAF_COUNT_SHIFT)-1);
+            u32 count = (entry.child & ~BVH8_LEAF_FLAG) >> BVH8_LEAF_COUNT_SHIFT;
+            for(u32 i = 0; i < count; i++) {
+                bvh8_leaf_t *leaf = get_bvh8_leaf(bvh8, mesh, first+i, &scratch);
+                i32 lane = intersect_bvh8_leaf(leaf, p, dir, t_max);
+                if(lane >= 0)
+                    closest = (i32)leaf->tri_id[lane];
+            }
+            continue;
+        }
+        
+        bvh8_node_t *node = bvh8->nodes+entry.child;
+        f32 t_near[BVH8_WIDTH];
+        u32 hit_mask = intersect_bvh8_children(node, p, inv_dir, *t_max, t_near);
+        
+        // NOTE(ajeej): insertion sort of the hit children, furthest first
+        bvh8_stack_entry_t hits[BVH8_WIDTH];
+        u32 hit_count = 0;
+        for(u32 i = 0; i < node->child_count; i++)
+        {
+            if(!(hit_mask & (1u << i)))
+                continue;
+            
+            u32 j = hit_count++;
+            while(j > 0 && hits[j-1].t < t_near[i]) {
+                hits[j] = hits[j-1];
+                j--;
+            }
+            hits[j].child = node->child[i];
+            hits[j].t = t_near[i];
+        }
+        
+        assert(stack_count + hit_count <= BVH8_STACK_SIZE);
+        for(u32 i = 0; i < hit_count; i++)
+            stack[stack_count++] = hits[i];
+    }
+    
+    return closest;
+}
+
+// NOTE(ajeej): interval test of the 8 children of a node against a coherent
+// packet, returns the children that some ray of the packet might hit
+static u32
+cull_bvh8_packet_children(bvh8_node_t *node, bvh_packet_t *packet, f32 t_max)
+{
+    u32 mask = (1u << node->child_count) - 1;
+    if(!packet->coherent)
+        return mask;
+    
+    for(u32 i = 0; i < node->child_count; i++)
+    {
+        vec3 min, max;
+        for(u32 axis = 0; axis < 3; axis++) {
+            f32 scale = get_bvh8_scale(node->exp[axis]);
+            min[axis] = node->origin[axis] + node->q_min[axis][i]*scale;
+            max[axis] = node->origin[axis] + node->q_max[axis][i]*scale;
+        }
+        
+        if(cull_bvh_packet_box(packet, min, max, t_max))
+            mask &= ~(1u << i);
+    }
+    
+    return mask;
+}
+
+// NOTE(ajeej): packet version of traverse_bvh8, the closest triangle of every
+// ray ends up in packet->closest. Children the packet misses as a whole are
+// dropped. Every other interior child goes on with the first ray that hits
+// it and every ray after that, leaves only get the rays that hit them.
+static void
+traverse_bvh8_packet(bvh8_t *bvh8, bvh_tri_mesh_t *mesh, bvh_packet_t *packet)
+{
+    prepare_bvh_packet(packet);
+    if(bvh8->node_count == 0 || packet->count == 0)
+        return;
+    
+    alignas(32) bvh8_leaf_t scratch;
+    f32 t_max = get_bvh_packet_t_max(packet);
+    bvh8_packet_entry_t stack[BVH8_STACK_SIZE];
+    u32 stack_count = 1;
+    stack[0].child = 0;
+    stack[0].ray_mask = (1u << packet->count) - 1;
+    
+    while(stack_count)
+    {
+        bvh8_packet_entry_t entry = stack[--stack_count];
+        
+        if(entry.child & BVH8_LEAF_FLAG)
+        {
+            u32 first_block = entry.child & ((1u << BVH8_LEAF_COUNT_SHIFT)-1);
+            u32 count = (entry.child & ~BVH8_LEAF_FLAG) >> BVH8_LEAF_COUNT_SHIFT;
+            for(u32 i = 0; i < count; i++)
+            {
+                bvh8_leaf_t *leaf = get_bvh8_leaf(bvh8, mesh, first_block+i, &scratch);
+                for(u32 r = 0; r < packet->count; r++) {
+                    if(!(entry.ray_mask & (1u << r)))
+                        continue;
+                    
+                    i32 lane = intersect_bvh8_leaf(leaf, packet->origin, packet->dir[r], packet->t+r);
+                    if(lane >= 0)
+                        packet->closest[r] = (i32)leaf->tri_id[lane];
+                }
+            }
+            
+            t_max = get_bvh_packet_t_max(packet);
+            continue;
+        }
+        
+        bvh8_node_t *node = bvh8->nodes+entry.child;
+        u32 left = cull_bvh8_packet_children(node, packet, t_max);
+        u32 leaf_children = 0;
+        for(u32 i = 0; i < node->child_count; i++)
+            if(node->child[i] & BVH8_LEAF_FLAG)
+                leaf_children |= 1u << i;
+        
+        // NOTE(ajeej): the rays are tested in order until every interior
+        // child has found the first ray that hits it, leaf children need
+        // to know every ray that hits them
+        u32 ray_masks[BVH8_WIDTH] = {0};
+        f32 child_t[BVH8_WIDTH];
+        u32 hit_children = 0, open = left;
+        for(u32 r = 0; r < packet->count && open; r++)
+        {
+            if(!(entry.ray_mask & (1u << r)))
+                continue;
+            
+            f32 t_near[BVH8_WIDTH];
+            u32 mask = intersect_bvh8_children(node, packet->origin, packet->inv_dir[r],
+                                               packet->t[r], t_near) & left;
+            
+            for(u32 i = 0; i < BVH8_WIDTH; i++)
+            {
+                if(!(mask & (1u << i)))
+                    continue;
+                
+                if(!(hit_children & (1u << i))) {
+                    child_t[i] = t_near[i];
+                    ray_masks[i] = (leaf_children & (1u << i)) ? 0 : (entry.ray_mask & ~((1u << r) - 1));
+                }
+                if(leaf_children & (1u << i))
+                    ray_masks[i] |= 1u << r;
+            }
+            hit_children |= mask;
+            open &= ~(mask & ~leaf_children);
+        }
+        
+        // NOTE(ajeej): insertion sort by the distance of the first ray,
+        // furthest first
+        bvh8_packet_entry_t hits[BVH8_WIDTH];
+        f32 hit_t[BVH8_WIDTH];
+        u32 hit_count = 0;
+        for(u32 i = 0; i < node->child_count; i++)
+        {
+            if(!(hit_children & (1u << i)))
+                continue;
+            
+            u32 j = hit_count++;
+            while(j > 0 && hit_t[j-1] < child_t[i]) {
+                hits[j] = hits[j-1];
+                hit_t[j] = hit_t[j-1];
+                j--;
+            }
+            hits[j].child = node->child[i];
+            hits[j].ray_mask = ray_masks[i];
+            hit_t[j] = child_t[i];
+        }
+        
+        assert(stack_count + hit_count <= BVH8_STACK_SIZE);
+        for(u32 i = 0; i < hit_count; i++)
+            stack[stack_count++] = hits[i];
+    }
+}
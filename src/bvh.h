@@ -0,0 +1,233 @@
+
+#ifndef BVH_H
+#define BVH_H
+
+#define BVH_BIN_COUNT 16
+#define BVH_MAX_LEAF_SIZE 8
+#define BVH_STACK_SIZE 64
+#define BVH_TRAVERSAL_COST 1.0f
+
+// NOTE(ajeej): leaves of a morton code build stop splitting at this size
+#define BVH_LBVH_LEAF_SIZE 4
+
+// NOTE(ajeej): subtrees with at least this many prims become their own
+// job when the bvh is built on the thread pool
+#define BVH_PARALLEL_MIN_PRIMS 4096
+
+// NOTE(ajeej): presets of build_bvh_parallel, sah splits every node with
+// binned sah while lbvh splits sorted morton codes which is a lot faster
+// but gives a slower tree
+#define BVH_BUILD_SAH 0
+#define BVH_BUILD_LBVH 1
+
+// NOTE(ajeej): most rays that traverse_bvh_packet traces together
+#define BVH_PACKET_SIZE 16
+
+// NOTE(ajeej): leaf children of a bvh8 node have the flag set, the bits
+// below BVH8_LEAF_COUNT_SHIFT index the first leaf block and the bits
+// above it say how many blocks follow
+#define BVH8_WIDTH 8
+#define BVH8_LEAF_FLAG 0x80000000
+#define BVH8_LEAF_COUNT_SHIFT 24
+#define BVH8_LEAF_MAX_BLOCKS ((BVH8_LEAF_FLAG >> BVH8_LEAF_COUNT_SHIFT) - 1)
+
+// NOTE(ajeej): binary bvhs are at most BVH_STACK_SIZE levels deep and a leaf
+// too big for one child adds at most 8 levels of wide nodes, every level
+// takes one entry off the stack and puts up to 8 on
+#define BVH8_MAX_DEPTH (BVH_STACK_SIZE + 8)
+#define BVH8_STACK_SIZE ((BVH8_WIDTH-1)*BVH8_MAX_DEPTH + 1)
+
+// NOTE(ajeej): a refitted bvh gets rebuilt once its sah cost is this many
+// times the cost it had right after it was built
+#define BVH_REFIT_REBUILD_RATIO 1.5f
+
+struct aabb_t {
+    vec3 min;
+    vec3 max;
+};
+
+// NOTE(ajeej): 32 bytes so two nodes share a cache line. For interior
+// nodes first is the index of the left child and the right child is
+// always first+1, for leaves first indexes into bvh_t::prim_ids.
+struct bvh_node_t {
+    vec3 min;
+    u32 first;
+    vec3 max;
+    u32 count;
+};
+
+// NOTE(ajeej): parents and prim_nodes (the leaf every prim ended up in) are
+// only needed to refit. sah_sum is the unnormalized sah cost that refits
+// keep up to date, build_cost is the normalized cost after the build.
+struct bvh_t {
+    bvh_node_t *nodes;
+    u32 *prim_ids;
+    u32 *parents;
+    u32 *prim_nodes;
+    u32 node_count;
+    u32 prim_count;
+    
+    f32 sah_sum;
+    f32 build_cost;
+};
+
+struct bvh_bin_t {
+    aabb_t bounds;
+    u32 count;
+};
+
+struct bvh_build_task_t {
+    u32 node_idx;
+    u32 begin, end;
+    u32 depth;
+};
+
+// NOTE(ajeej): a node of a finished build and the slot it moves to
+struct bvh_order_entry_t {
+    u32 node_idx;
+    u32 new_idx;
+};
+
+// NOTE(ajeej): shared by every job of one build, morton holds the sorted
+// codes of prim_ids for lbvh builds
+struct bvh_builder_t {
+    bvh_t *bvh;
+    aabb_t *prim_bounds;
+    vec3 *centroids;
+    u32 *morton;
+    u32 preset;
+    
+    thread_pool_t *pool;
+    std::atomic<u32> node_count;
+    std::atomic<u32> counter;
+};
+
+struct bvh_build_job_t {
+    bvh_builder_t *builder;
+    bvh_build_task_t task;
+};
+
+struct bvh_morton_job_t {
+    bvh_builder_t *builder;
+    u32 begin, end;
+    vec3 offset, scale;
+};
+
+// NOTE(ajeej): sah_cost is weighted by the prim count when the stats of
+// several builds are added together
+struct bvh_build_stats_t {
+    u32 bvh_count;
+    u32 prim_count, node_count, leaf_count;
+    f64 build_ms;
+    f32 sah_cost;
+};
+
+struct bvh_stack_entry_t {
+    u32 node_idx;
+    f32 t;
+};
+
+// NOTE(ajeej): rays that share an origin, like the primary rays of a block of
+// pixels. t and closest work like t_max and the return value of traverse_bvh
+// for every ray, data is anything the leaf function needs for that ray.
+// prepare_bvh_packet fills inv_dir, the range of inv_dir over the packet and
+// whether every ray points the same way on every axis, which is needed for
+// the packet to be culled as a whole.
+struct bvh_packet_t {
+    vec3 origin;
+    vec3 dir[BVH_PACKET_SIZE];
+    f32 t[BVH_PACKET_SIZE];
+    i32 closest[BVH_PACKET_SIZE];
+    void *data[BVH_PACKET_SIZE];
+    u32 count;
+    
+    vec3 inv_dir[BVH_PACKET_SIZE];
+    vec3 inv_min, inv_max;
+    bool coherent;
+};
+
+// NOTE(ajeej): rays before first missed the parent of the node
+struct bvh_packet_entry_t {
+    u32 node_idx;
+    u32 first;
+};
+
+// NOTE(ajeej): 8 wide node collapsed from a binary bvh. The child boxes are
+// stored as 8 bit offsets from origin in steps of 2^exp on every axis,
+// rounded outwards so they never get smaller than the real boxes.
+struct bvh8_node_t {
+    vec3 origin;
+    i8 exp[3];
+    u8 child_count;
+    u32 child[BVH8_WIDTH];
+    u8 q_min[3][BVH8_WIDTH];
+    u8 q_max[3][BVH8_WIDTH];
+};
+
+// NOTE(ajeej): up to 8 triangles as one vertex and the two edges leaving
+// it, unused lanes are zero (so they are never hit) with a tri_id of -1
+struct bvh8_leaf_t {
+    f32 v0[3][BVH8_WIDTH];
+    f32 e1[3][BVH8_WIDTH];
+    f32 e2[3][BVH8_WIDTH];
+    u32 tri_id[BVH8_WIDTH];
+};
+
+// NOTE(ajeej): leaves holds copies of the triangles of every leaf block.
+// A bvh8 built without copies has leaf_tris instead, the BVH8_WIDTH
+// triangle ids of every block (-1 for unused lanes), and reads the
+// triangles from the mesh they were built from.
+struct bvh8_t {
+    bvh8_node_t *nodes;
+    bvh8_leaf_t *leaves;
+    u32 *leaf_tris;
+    u32 node_count;
+    u32 leaf_count;
+};
+
+// NOTE(ajeej): the triangles of a mesh as indices into shared vertices,
+// three floats per vertex and three indices per triangle
+struct bvh_tri_mesh_t {
+    f32 *verts;
+    u32 *indices;
+};
+
+struct bvh8_build_entry_t {
+    u32 node_idx;
+    u32 wide_idx;
+};
+
+struct bvh8_stack_entry_t {
+    u32 child;
+    f32 t;
+};
+
+// NOTE(ajeej): bit r of ray_mask is set if ray r of the packet goes on
+// to the child
+struct bvh8_packet_entry_t {
+    u32 child;
+    u32 ray_mask;
+};
+
+// NOTE(ajeej): a bvh built on its own thread from a copy of the prim
+// bounds, it is picked up with finish_bvh_rebuild once done
+struct bvh_rebuild_t {
+    std::thread thread;
+    std::atomic<bool> done;
+    bool running;
+    
+    aabb_t *bounds;
+    u32 prim_count;
+    bvh_t bvh;
+};
+
+// NOTE(ajeej): tests the count primitives of a leaf, returns the closest one
+// hit nearer than t (which gets shortened) or -1
+typedef i32 bvh_leaf_func_t(void *data, u32 *prim_ids, u32 count, vec3 p, vec3 dir, f32 *t);
+
+// NOTE(ajeej): packet version of bvh_leaf_func_t, tests one primitive against
+// the rays of the packet from first on and returns the rays it shortened t of
+// as a mask
+typedef u32 bvh_packet_leaf_func_t(u32 prim_id, bvh_packet_t *packet, u32 first);
+
+#endif //BVH_H
@@ -7,6 +7,8 @@
 
 #include <cglm/cglm.h>
 
+#include <immintrin.h>
+
 #include <opencv2/opencv.hpp>
 
 
@@ -15,8 +17,15 @@
 
 #include <cstdio>
 #include <cstdlib>
+#include <cfloat>
+#include <cassert>
 #include <ctime>
 
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
 // settings
 const unsigned int SCR_WIDTH = 800;
 const unsigned int SCR_HEIGHT = 800;
@@ -40,7 +49,17 @@ typedef double f64;
 
 #define ARRAY_COUNT(x) (sizeof((x))/sizeof((x)[0]))
 
+// NOTE(ajeej): opencv defines the same macros
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef MAX
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
 #include "stack.h"
+#include "thread_pool.h"
+#include "bvh.h"
 
 #include "ray_tracer.h"
 #include "renderer.h"
@@ -64,8 +83,11 @@ void processInput(GLFWwindow *window, camera_t *cam, video_info_t *v_info, scene
 static bool centering_mouse = false;
 
 #include "shader.cpp"
+#include "thread_pool.cpp"
+#include "bvh.cpp"
+#include "sampling.cpp"
 
-// NOTE(ajeej): the software raytracer is no longer being used
+// NOTE(ajeej): the software raytracer is only used by the cpu backend
 #include "ray_tracer.cpp"
 #include "renderer.cpp"
 
@@ -114,14 +136,168 @@ mouse_callback(GLFWwindow *window, double x, double y)
     data->m_last_y = y;
 }
 
-int main()
+static void
+build_scene(scene_t *scene)
+{
+    f32 vs[] = {
+        0.0f, 1.0f, 0.0f,
+        0.5f, 0.0f, -0.5f,
+        -0.5f, 0.0f, -0.5f,
+        0.0f, 0.0f, 0.5f,
+    };
+    
+    u32 is[] = {
+        0, 1, 2,
+        0, 2, 3,
+        0, 3, 1,
+        1, 3, 2,
+    };
+    
+    u32 mirror = add_material(scene, vec3{1.0f, 1.0f, 1.0f,}, vec3{0.0f, 0.0f, 0.0f}, 0.0f, 1.0f);
+    u32 light = add_material(scene, vec3{0.0f, 0.0f, 0.0f}, vec3{1.0f, 1.0f, 1.0f}, 60.0f, 0.0f);
+    u32 red = add_material(scene, vec3{0.82f, 0.25f, 0.28f}, vec3{0.0f, 0.0f, 0.0f}, 0.0f, 0.2f);
+    u32 blue = add_material(scene, vec3{0.0f, 0.0f, 0.98f}, vec3{0.0f, 0.0f, 0.0f}, 0.0f, 0.4f);
+    u32 grey = add_material(scene, vec3{0.67f, 0.67f, 0.67f}, vec3{0.0f, 0.0, 0.0f}, 0.0f, 0.3f);
+    
+    add_quad(scene, vec3{0.0f, 0.0f, 0.0f}, vec3{0.0f, 0.0f, 200.0f}, vec3{200.0f, 0.0f, 0.0f}, grey);
+    
+    add_sphere(scene, vec3{1000.0f, 500.0f, 0.0f}, 200.0f, light);
+    add_sphere(scene, vec3{-20.0f, 5.0f, -5.0f}, 5.0f, red);
+    u32 tetra = add_mesh(scene, vs, ARRAY_COUNT(vs)/3, is, ARRAY_COUNT(is), blue);
+    set_mesh_pos(scene, tetra, vec3{15.0f, 0.0f, -10.0f});
+    scale_mesh(scene, tetra, 15.0f);
+    
+    add_sphere(scene, vec3{0.0f, 10.0f, 20.0f}, 10.0f, mirror);
+}
+
+int main(int argc, char **argv)
 {
     srand(time(NULL));
     
+    // NOTE(ajeej): -cpu renders with the software ray tracer instead of the
+    // compute shader. -o <file> renders -frames <n> frames on the cpu without
+    // opening a window and saves the image. -threads <n> sets the worker count.
+    // -bvh <sah|lbvh> picks how the mesh bvhs are built. -packets <on|off>
+    // turns tracing the cpu primary rays in packets on or off. -wavefront
+    // <on|off> renders on the cpu with the wavefront path tracer instead.
+    // -tricache <on|off> keeps a copy of every triangle next to the indexed
+    // meshes, which traces faster but takes several times the memory.
+    // -stackless <on|off> builds the compute shader with the stackless bvh
+    // traversal. -bench <n> times n gpu frames with the stack based and the
+    // stackless traversal and exits. -gpubvh <on|off> builds the mesh bvhs
+    // with the compute shader lbvh builder. The cpu renderer and the
+    // stackless traversal (which -bench also runs) need them built on the
+    // cpu, so it is ignored with those. -sampler <random|sobol|bluenoise>
+    // picks where the pixel jitter and bounce directions come from. -sun
+    // <on|off> puts a sun in the sky that every bounce samples as a light.
+    // -samplercheck prints how the error of neighbouring pixels correlates
+    // with every sampler and exits with 1 if blue noise is no better than
+    // random.
+    bool use_cpu = false;
+    const char *out_path = NULL;
+    u32 out_frames = 16, thread_count = 0, bvh_preset = BVH_BUILD_SAH;
+    u32 bench_frames = 0;
+    bool ray_packets = true, wavefront = false, tri_cache = false, stackless = false;
+    bool gpu_bvh = false, sun = false, sampler_check = false;
+    u32 sampler = SAMPLER_SOBOL;
+    for(int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "-cpu") == 0)
+            use_cpu = true;
+        else if(strcmp(argv[i], "-o") == 0 && i+1 < argc) {
+            out_path = argv[++i];
+            use_cpu = true;
+        }
+        else if(strcmp(argv[i], "-frames") == 0 && i+1 < argc)
+            out_frames = atoi(argv[++i]);
+        else if(strcmp(argv[i], "-threads") == 0 && i+1 < argc)
+            thread_count = atoi(argv[++i]);
+        else if(strcmp(argv[i], "-bvh") == 0 && i+1 < argc)
+            bvh_preset = (strcmp(argv[++i], "lbvh") == 0) ? BVH_BUILD_LBVH : BVH_BUILD_SAH;
+        else if(strcmp(argv[i], "-packets") == 0 && i+1 < argc)
+            ray_packets = (strcmp(argv[++i], "off") != 0);
+        else if(strcmp(argv[i], "-wavefront") == 0 && i+1 < argc)
+            wavefront = (strcmp(argv[++i], "on") == 0);
+        else if(strcmp(argv[i], "-tricache") == 0 && i+1 < argc)
+            tri_cache = (strcmp(argv[++i], "on") == 0);
+        else if(strcmp(argv[i], "-stackless") == 0 && i+1 < argc)
+            stackless = (strcmp(argv[++i], "on") == 0);
+        else if(strcmp(argv[i], "-bench") == 0 && i+1 < argc)
+            bench_frames = atoi(argv[++i]);
+        else if(strcmp(argv[i], "-gpubvh") == 0 && i+1 < argc)
+            gpu_bvh = (strcmp(argv[++i], "on") == 0);
+        else if(strcmp(argv[i], "-sampler") == 0 && i+1 < argc) {
+            i++;
+            if(strcmp(argv[i], "random") == 0)
+                sampler = SAMPLER_RANDOM;
+            else if(strcmp(argv[i], "bluenoise") == 0)
+                sampler = SAMPLER_BLUE_NOISE;
+            else
+                sampler = SAMPLER_SOBOL;
+        }
+        else if(strcmp(argv[i], "-sun") == 0 && i+1 < argc)
+            sun = (strcmp(argv[++i], "on") == 0);
+        else if(strcmp(argv[i], "-samplercheck") == 0)
+            sampler_check = true;
+    }
+    
+    if(sampler_check)
+        return check_sampler_noise(256, 256) ? 0 : 1;
+    
+    u64 frame_id = 1;
+    camera_t cam;
+    scene_t scene;
+    init_camera(&cam, vec3{0, 5, -20}, 10.0f, 15.0f, 9, 9, 0.1f, 0.1f, vec3{0.0f, 0.0f, -1.0f}, vec3{1.0f, 0.0f, 0.0f});
+    
+    render_settings_t setting = {0}; {
+        setting.max_bounce = 30;
+        setting.samples_per_frame = 4;
+        setting.bvh_preset = bvh_preset;
+        setting.ray_packets = ray_packets;
+        setting.wavefront = wavefront;
+        setting.tri_cache = tri_cache;
+        setting.stackless = stackless;
+        setting.gpu_bvh = gpu_bvh && !use_cpu && !stackless && !bench_frames;
+        setting.sampler = sampler;
+        glm_vec3_copy(vec3{1, 1, 1}, setting.horizon_color);
+        glm_vec3_copy(vec3{0.08, 0.36, 0.7}, setting.zenith_color);
+        glm_vec3_copy(vec3{0.35, 0.35, 0.35}, setting.ground_color);
+        glm_vec3_normalize_to(vec3{-0.5, 0.7, 0.5}, setting.sun_dir);
+        glm_vec3_copy(vec3{1, 0.95, 0.85}, setting.sun_color);
+        setting.sun_angle = 0.02f;
+        setting.sun_intensity = sun ? 3.0f : 0.0f;
+    }
+    init_scene(&scene, setting);
+    build_scene(&scene);
+    
+    // NOTE(ajeej): the pool is also used to build the bvhs for the gpu
+    thread_pool_t pool;
+    accum_buffer_t accum;
+    init_thread_pool(&pool, thread_count);
+    scene.pool = &pool;
+    if(use_cpu) {
+        init_accum_buffer(&accum, cam.width, cam.height);
+        setup_cpu_scene(&scene);
+        print_bvh_stats(&scene.bvh_stats);
+    }
+    
+    if(out_path) {
+        scene.moving = false;
+        for(u64 i = 1; i <= out_frames; i++)
+            render_scene_cpu(&cam, &scene, &pool, &accum, i);
+        
+        if(!save_accum_buffer(&accum, out_path))
+            std::cout << "Failed to save image: " << out_path << std::endl;
+        
+        free_accum_buffer(&accum);
+        free_thread_pool(&pool);
+        free_scene(&scene);
+        return 0;
+    }
+    
     // glfw: initialize and configure
     // ------------------------------
     glfwInit();
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
     glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
     glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
     
@@ -135,6 +311,7 @@ int main()
     if (window == NULL)
     {
         std::cout << "Failed to create GLFW window" << std::endl;
+        free_thread_pool(&pool);
         glfwTerminate();
         return -1;
     }
@@ -149,11 +326,9 @@ int main()
     char *compute_src = load_shader_source(compute_filename);
     char *blend_src = load_shader_source("blend.glsl");
     u32 shader_program = create_shader(vert_src, frag_src);
-    u32 compute_program = create_compute_shader(compute_src);
     u32 blend_program = create_compute_shader(blend_src);
     free(vert_src);
     free(frag_src);
-    free(compute_src);
     free(blend_src);
     
     // set up vertex data (and buffer(s)) and configure vertex attributes
@@ -196,19 +371,6 @@ int main()
     glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &alignment);
     
     
-    u64 frame_id = 1;
-    camera_t cam;
-    scene_t scene;
-    init_camera(&cam, vec3{0, 5, -20}, 10.0f, 15.0f, 9, 9, 0.1f, 0.1f, vec3{0.0f, 0.0f, -1.0f}, vec3{1.0f, 0.0f, 0.0f});
-    
-    render_settings_t setting = {0}; {
-        setting.max_bounce = 30;
-        glm_vec3_copy(vec3{1, 1, 1}, setting.horizon_color);
-        glm_vec3_copy(vec3{0.08, 0.36, 0.7}, setting.zenith_color);
-        glm_vec3_copy(vec3{0.35, 0.35, 0.35}, setting.ground_color);
-    }
-    init_scene(&scene, setting);
-    
     // TODO(ajeej): create a function for each of these things
     u32 texture, new_texture, clear_texture;
     glGenTextures(1, &texture);
@@ -234,39 +396,22 @@ int main()
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
     
-    f32 vs[] = {
-        0.0f, 1.0f, 0.0f,
-        0.5f, 0.0f, -0.5f,
-        -0.5f, 0.0f, -0.5f,
-        0.0f, 0.0f, 0.5f,
-    };
-    
-    u32 is[] = {
-        0, 1, 2,
-        0, 2, 3,
-        0, 3, 1,
-        1, 3, 2,
-    };
-    
-    u32 mirror = add_material(&scene, vec3{1.0f, 1.0f, 1.0f,}, vec3{0.0f, 0.0f, 0.0f}, 0.0f, 1.0f);
-    u32 light = add_material(&scene, vec3{0.0f, 0.0f, 0.0f}, vec3{1.0f, 1.0f, 1.0f}, 60.0f, 0.0f);
-    u32 red = add_material(&scene, vec3{0.82f, 0.25f, 0.28f}, vec3{0.0f, 0.0f, 0.0f}, 0.0f, 0.2f);
-    u32 blue = add_material(&scene, vec3{0.0f, 0.0f, 0.98f}, vec3{0.0f, 0.0f, 0.0f}, 0.0f, 0.4f);
-    u32 grey = add_material(&scene, vec3{0.67f, 0.67f, 0.67f}, vec3{0.0f, 0.0, 0.0f}, 0.0f, 0.3f);
-    
-    u32 plane = add_plane(&scene, grey, 200.0f, 200.0f);
-    rotate_mesh(&scene, plane, glm_rad(90.0f), vec3{1, 0, 0});
-    
-    
-    add_sphere(&scene, vec3{1000.0f, 500.0f, 0.0f}, 200.0f, light);
-    add_sphere(&scene, vec3{-20.0f, 5.0f, -5.0f}, 5.0f, red);
-    u32 tetra = add_mesh(&scene, vs, is, ARRAY_COUNT(is), blue);
-    set_mesh_pos(&scene, tetra, vec3{15.0f, 0.0f, -10.0f});
-    scale_mesh(&scene, tetra, 15.0f);
+    if(bench_frames) {
+        benchmark_gpu_traversal(&cam, &scene, compute_src, texture, bench_frames);
+        free(compute_src);
+        free_thread_pool(&pool);
+        free_scene(&scene);
+        glfwTerminate();
+        return 0;
+    }
     
-    add_sphere(&scene, vec3{0.0f, 10.0f, 20.0f}, 10.0f, mirror);
+    gpu_wavefront_t gpu_wave;
+    init_gpu_wavefront(&gpu_wave, compute_src, cam.width, cam.height, scene.settings.stackless);
+    free(compute_src);
     
-    setup_scene(&cam, &scene, compute_program);
+    setup_scene(&cam, &scene, &gpu_wave);
+    if(!use_cpu)
+        print_bvh_stats(&scene.bvh_stats);
     
     
     timer_t timer;
@@ -302,7 +447,12 @@ int main()
             
             frame_id = 1;
             
-            render_frame(&cam, &scene, compute_program, texture, frame_id);
+            if(use_cpu) {
+                render_scene_cpu(&cam, &scene, &pool, &accum, frame_id);
+                upload_accum_buffer(&accum, texture);
+            }
+            else
+                render_frame(&cam, &scene, &gpu_wave, texture, frame_id);
         }
         
         
@@ -329,14 +479,24 @@ int main()
                 glm_vec3_cross(cam.side, cam.front, cam.up);
                 
                 frame_id = 1;
-                render_frame(&cam, &scene, compute_program, texture, frame_id++);
+                if(use_cpu) {
+                    render_scene_cpu(&cam, &scene, &pool, &accum, frame_id++);
+                    upload_accum_buffer(&accum, texture);
+                }
+                else
+                    render_frame(&cam, &scene, &gpu_wave, texture, frame_id++);
                 
                 u64 nanos_elapsed = check_timer(&render_delay);
                 while(nanos_elapsed < v_info.seconds_per_render * 1E9) {
                     glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
                     glClear(GL_COLOR_BUFFER_BIT);
                     
-                    render_scene(&cam, &scene, compute_program, blend_program, texture, new_texture, frame_id++);
+                    if(use_cpu) {
+                        render_scene_cpu(&cam, &scene, &pool, &accum, frame_id++);
+                        upload_accum_buffer(&accum, texture);
+                    }
+                    else
+                        render_scene(&cam, &scene, &gpu_wave, blend_program, texture, new_texture, frame_id++);
                     
                     
                     glBindTexture(GL_TEXTURE_2D, texture);
@@ -379,7 +539,12 @@ int main()
                 v_info.play_idx++;
         }
         
-        render_scene(&cam, &scene, compute_program, blend_program, texture, new_texture, frame_id++);
+        if(use_cpu) {
+            render_scene_cpu(&cam, &scene, &pool, &accum, frame_id++);
+            upload_accum_buffer(&accum, texture);
+        }
+        else
+            render_scene(&cam, &scene, &gpu_wave, blend_program, texture, new_texture, frame_id++);
         
         u64 ne = check_timer(&timer);
         if(ne >= 1/v_info.frames_per_second * 1E9 && v_info.is_recording)
@@ -416,6 +581,10 @@ int main()
     }
     
     free_scene(&scene);
+    free_gpu_wavefront(&gpu_wave);
+    free_thread_pool(&pool);
+    if(use_cpu)
+        free_accum_buffer(&accum);
     
     // optional: de-allocate all resources once they've outlived their purpose:
     // ------------------------------------------------------------------------
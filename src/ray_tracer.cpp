@@ -59,137 +59,2172 @@ intersect_sphere(vec3 p, vec3 dir, sphere_t *s)
     return result;
 }*/
 
+static void
+free_sphere_soa(sphere_soa_t *soa)
+{
+    if(soa->x)
+        _mm_free(soa->x);
+    if(soa->runs)
+        free(soa->runs);
+    memset(soa, 0, sizeof(*soa));
+}
+
+// NOTE(ajeej): closest of the 8 spheres from lane first on, which has to be
+// a multiple of 8. Returns the id of the one nearer than t_max (which gets
+// updated) or -1 if none is hit.
+static i32
+intersect_sphere8(sphere_soa_t *soa, u32 first, vec3 p, vec3 dir, f32 *t_max)
+{
+    i32 closest = -1;
+    f32 a = glm_vec3_dot(dir, dir), inv_a = 1.0f/a;
+    
+#if defined(__AVX2__)
+    __m256 zero = _mm256_setzero_ps();
+    __m256 fx = _mm256_sub_ps(_mm256_set1_ps(p[0]), _mm256_load_ps(soa->x+first));
+    __m256 fy = _mm256_sub_ps(_mm256_set1_ps(p[1]), _mm256_load_ps(soa->y+first));
+    __m256 fz = _mm256_sub_ps(_mm256_set1_ps(p[2]), _mm256_load_ps(soa->z+first));
+    __m256 r = _mm256_load_ps(soa->r+first);
+    
+    __m256 b = _mm256_add_ps(_mm256_mul_ps(fx, _mm256_set1_ps(dir[0])),
+                             _mm256_add_ps(_mm256_mul_ps(fy, _mm256_set1_ps(dir[1])),
+                                           _mm256_mul_ps(fz, _mm256_set1_ps(dir[2]))));
+    __m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_mul_ps(fx, fx),
+                                           _mm256_add_ps(_mm256_mul_ps(fy, fy), _mm256_mul_ps(fz, fz))),
+                             _mm256_mul_ps(r, r));
+    __m256 disc = _mm256_sub_ps(_mm256_mul_ps(b, b), _mm256_mul_ps(_mm256_set1_ps(a), c));
+    
+    // NOTE(ajeej): t = (-b - sqrt(disc))/a, the sqrt of a negative disc
+    // is masked out below
+    __m256 t = _mm256_mul_ps(_mm256_sub_ps(zero, _mm256_add_ps(b, _mm256_sqrt_ps(_mm256_max_ps(disc, zero)))),
+                             _mm256_set1_ps(inv_a));
+    
+    __m256 best_t = _mm256_set1_ps(*t_max);
+    __m256 mask = _mm256_and_ps(_mm256_cmp_ps(disc, zero, _CMP_GE_OQ),
+                                _mm256_cmp_ps(t, zero, _CMP_GE_OQ));
+    mask = _mm256_and_ps(mask, _mm256_cmp_ps(t, best_t, _CMP_LT_OQ));
+    best_t = _mm256_blendv_ps(best_t, t, mask);
+    
+    // NOTE(ajeej): min reduction across the lanes, then pick the lane that holds it
+    __m256 min_t = _mm256_min_ps(best_t, _mm256_permute2f128_ps(best_t, best_t, 1));
+    min_t = _mm256_min_ps(min_t, _mm256_shuffle_ps(min_t, min_t, _MM_SHUFFLE(1, 0, 3, 2)));
+    min_t = _mm256_min_ps(min_t, _mm256_shuffle_ps(min_t, min_t, _MM_SHUFFLE(2, 3, 0, 1)));
+    
+    f32 min_dist = _mm256_cvtss_f32(min_t);
+    if(min_dist < *t_max) {
+        u32 lane_mask = _mm256_movemask_ps(_mm256_and_ps(mask, _mm256_cmp_ps(best_t, min_t, _CMP_EQ_OQ)));
+        
+        u32 lane = 0;
+        while(!(lane_mask & (1u << lane)))
+            lane++;
+        
+        closest = (i32)soa->ids[first+lane];
+        *t_max = min_dist;
+    }
+#else
+    for(u32 i = first; i < first+8; i++)
+    {
+        f32 fx = p[0] - soa->x[i], fy = p[1] - soa->y[i], fz = p[2] - soa->z[i];
+        f32 b = fx*dir[0] + fy*dir[1] + fz*dir[2];
+        f32 c = fx*fx + fy*fy + fz*fz - soa->r[i]*soa->r[i];
+        f32 disc = b*b - a*c;
+        if(disc < 0)
+            continue;
+        
+        f32 t = (-b - sqrt(disc))*inv_a;
+        if(t >= 0 && t < *t_max) {
+            *t_max = t;
+            closest = (i32)soa->ids[i];
+        }
+    }
+#endif
+    
+    return closest;
+}
+
+// NOTE(ajeej): intersect_sphere8 over the run of count spheres that starts
+// at lane first
+static i32
+intersect_sphere_run(sphere_soa_t *soa, u32 first, u32 count, vec3 p, vec3 dir, f32 *t_max)
+{
+    i32 closest = -1;
+    for(u32 i = 0; i < count; i += 8) {
+        i32 hit = intersect_sphere8(soa, first+i, p, dir, t_max);
+        if(hit >= 0)
+            closest = hit;
+    }
+    
+    return closest;
+}
+
+static void
+rotate_vertex(vec3 vert, versor quat, vec3 out)
+{
+    vec3 qv = {quat[0], quat[1], quat[2]}, t, c;
+    
+    glm_vec3_cross(qv, vert, t);
+    glm_vec3_scale(t, 2.0f, t);
+    glm_vec3_cross(qv, t, c);
+    
+    for(u32 i = 0; i < 3; i++)
+        out[i] = vert[i] + quat[3]*t[i] + c[i];
+}
+
+static void
+transform_vertex(vec3 vert, mesh_t *mesh, vec3 out)
+{
+    glm_vec3_mul(vert, mesh->scale, out);
+    rotate_vertex(out, mesh->rot, out);
+    glm_vec3_add(out, mesh->pos, out);
+}
+
+// NOTE(ajeej): same test as intersect_triangle in ray_tracer.glsl, the
+// triangle is moved into world space by the mesh transform (the edges are
+// not translated) and only the front face (counter clockwise when seen from
+// the ray) is hit
 static hit_info_t
-intersect_sphere(vec3 p, vec3 dir, sphere_t *s)
+intersect_triangle(vec3 p, vec3 dir, triangle_t *tri, mesh_t *mesh)
 {
     hit_info_t result = {0};
+    vec3 v0, v0v1, v0v2, norm, v0o, dv0o;
+    
+    transform_vertex(tri->v0, mesh, v0);
+    glm_vec3_mul(tri->e1, mesh->scale, v0v1);
+    rotate_vertex(v0v1, mesh->rot, v0v1);
+    glm_vec3_mul(tri->e2, mesh->scale, v0v2);
+    rotate_vertex(v0v2, mesh->rot, v0v2);
+    glm_vec3_cross(v0v1, v0v2, norm);
+    
+    glm_vec3_sub(p, v0, v0o);
+    glm_vec3_cross(v0o, dir, dv0o);
+    
+    f32 det = -glm_vec3_dot(dir, norm);
+    if(det < 1E-6)
+        return result;
+    
+    f32 inv_det = 1.0f/det;
+    f32 dist = glm_vec3_dot(v0o, norm)*inv_det;
+    f32 u = glm_vec3_dot(v0v2, dv0o)*inv_det;
+    f32 v = -glm_vec3_dot(v0v1, dv0o)*inv_det;
+    f32 w = 1 - u - v;
+    
+    if(dist >= 0 && u >= 0 && v >= 0 && w >= 0) {
+        result.hit = true;
+        result.dist = dist;
+        result.mat_id = mesh->mat_id;
+        
+        glm_vec3_scale(dir, dist, result.enter_point);
+        glm_vec3_add(result.enter_point, p, result.enter_point);
+        
+        glm_vec3_normalize_to(norm, result.norm);
+    }
+    
+    return result;
+}
+
+static bool
+intersect_sphere_dist(vec3 p, vec3 dir, sphere_t *s, f32 *t)
+{
     vec3 delta;
     glm_vec3_sub(p, s->pos, delta);
     
     f32 a = glm_vec3_dot(dir, dir);
-    f32 b = 2 * glm_vec3_dot(delta, dir);
+    f32 b = glm_vec3_dot(delta, dir);
     f32 c = glm_vec3_dot(delta, delta) - s->r*s->r;
+    f32 disc = b*b - a*c;
+    if(disc < 0)
+        return false;
+    
+    f32 dist = (-b - sqrt(disc))/a;
+    if(dist < 0 || dist >= *t)
+        return false;
+    
+    *t = dist;
+    return true;
+}
+
+static void
+free_sphere_grid(sphere_grid_t *grid)
+{
+    if(grid->cells)
+        free(grid->cells);
+    if(grid->prims)
+        free(grid->prims);
+    memset(grid, 0, sizeof(*grid));
+}
+
+// NOTE(ajeej): a grid only pays off when there are a lot of spheres and
+// none of them is so big that it fills many cells
+static bool
+use_sphere_grid(sphere_t *spheres, u32 count)
+{
+    if(count < SPHERE_GRID_MIN_SPHERES)
+        return false;
+    
+    f32 r_sum = 0.0f, r_max = 0.0f;
+    for(u32 i = 0; i < count; i++) {
+        r_sum += spheres[i].r;
+        r_max = MAX(r_max, spheres[i].r);
+    }
+    
+    return r_max <= SPHERE_GRID_MAX_RADIUS_RATIO*r_sum/count;
+}
+
+static void
+get_sphere_grid_cells(sphere_grid_t *grid, sphere_t *s, u32 *lo, u32 *hi)
+{
+    for(u32 axis = 0; axis < 3; axis++) {
+        f32 min = (s->pos[axis] - s->r - grid->bounds.min[axis])*grid->inv_cell_size[axis];
+        f32 max = (s->pos[axis] + s->r - grid->bounds.min[axis])*grid->inv_cell_size[axis];
+        lo[axis] = (u32)MIN(MAX(min, 0.0f), (f32)(grid->res[axis]-1));
+        hi[axis] = (u32)MIN(MAX(max, 0.0f), (f32)(grid->res[axis]-1));
+    }
+}
+
+static void
+count_sphere_grid_job_proc(void *data)
+{
+    sphere_grid_job_t *job = (sphere_grid_job_t *)data;
+    sphere_grid_t *grid = job->grid;
+    
+    for(u32 i = job->begin; i < job->end; i++)
+    {
+        u32 lo[3], hi[3];
+        get_sphere_grid_cells(grid, job->spheres+i, lo, hi);
+        for(u32 z = lo[2]; z <= hi[2]; z++)
+            for(u32 y = lo[1]; y <= hi[1]; y++)
+                for(u32 x = lo[0]; x <= hi[0]; x++)
+                    job->counts[(z*grid->res[1] + y)*grid->res[0] + x]++;
+    }
+}
+
+static void
+scatter_sphere_grid_job_proc(void *data)
+{
+    sphere_grid_job_t *job = (sphere_grid_job_t *)data;
+    sphere_grid_t *grid = job->grid;
+    
+    for(u32 i = job->begin; i < job->end; i++)
+    {
+        u32 lo[3], hi[3];
+        get_sphere_grid_cells(grid, job->spheres+i, lo, hi);
+        for(u32 z = lo[2]; z <= hi[2]; z++)
+            for(u32 y = lo[1]; y <= hi[1]; y++)
+                for(u32 x = lo[0]; x <= hi[0]; x++)
+                    grid->prims[job->counts[(z*grid->res[1] + y)*grid->res[0] + x]++] = i;
+    }
+}
+
+static void
+run_sphere_grid_jobs(sphere_grid_job_t *jobs, u32 job_count, job_func_t *func,
+                     thread_pool_t *pool)
+{
+    std::atomic<u32> counter(0);
+    for(u32 i = 0; i < job_count; i++) {
+        if(pool)
+            push_job(pool, func, jobs+i, &counter);
+        else
+            func(jobs+i);
+    }
+    
+    if(pool)
+        wait_for_jobs(pool, &counter);
+}
+
+// NOTE(ajeej): the resolution makes the cells about cube shaped. The cells
+// are filled with a counting sort over chunks of spheres on the pool if
+// there is one, first every chunk counts the spheres it puts in every cell,
+// then the prefix sum over the cells and the chunks inside them gives where
+// every chunk writes in every cell and the spheres are scattered. The
+// spheres of a cell end up in the order of their ids whatever the
+// scheduling.
+static void
+build_sphere_grid(sphere_grid_t *grid, sphere_t *spheres, u32 count, thread_pool_t *pool)
+{
+    free_sphere_grid(grid);
+    if(count == 0)
+        return;
     
-    f32 disc = b*b - 4*a*c;
+    aabb_empty(&grid->bounds);
+    for(u32 i = 0; i < count; i++) {
+        vec3 min, max;
+        glm_vec3_adds(spheres[i].pos, -spheres[i].r, min);
+        glm_vec3_adds(spheres[i].pos, spheres[i].r, max);
+        aabb_grow(&grid->bounds, min);
+        aabb_grow(&grid->bounds, max);
+    }
+    
+    vec3 extent;
+    glm_vec3_sub(grid->bounds.max, grid->bounds.min, extent);
+    f32 volume = MAX(extent[0]*extent[1]*extent[2], 1E-12f);
+    f32 cells_per_unit = cbrtf(SPHERE_GRID_DENSITY*count/volume);
+    
+    grid->cell_count = 1;
+    for(u32 axis = 0; axis < 3; axis++) {
+        u32 res = (u32)(extent[axis]*cells_per_unit);
+        grid->res[axis] = MIN(MAX(res, 1), SPHERE_GRID_MAX_RES);
+        grid->cell_size[axis] = MAX(extent[axis], 1E-6f)/grid->res[axis];
+        grid->inv_cell_size[axis] = 1.0f/grid->cell_size[axis];
+        grid->cell_count *= grid->res[axis];
+    }
+    
+    u32 job_count = MIN((count + SPHERE_GRID_CHUNK-1)/SPHERE_GRID_CHUNK, SPHERE_GRID_MAX_JOBS);
+    u32 chunk = (count + job_count-1)/job_count;
+    u32 *counts = (u32 *)calloc((size_t)grid->cell_count*job_count, sizeof(u32));
+    sphere_grid_job_t *jobs = (sphere_grid_job_t *)malloc(sizeof(sphere_grid_job_t)*job_count);
+    for(u32 i = 0; i < job_count; i++) {
+        jobs[i].grid = grid;
+        jobs[i].spheres = spheres;
+        jobs[i].counts = counts + (size_t)i*grid->cell_count;
+        jobs[i].begin = MIN(i*chunk, count);
+        jobs[i].end = MIN(jobs[i].begin + chunk, count);
+    }
+    
+    run_sphere_grid_jobs(jobs, job_count, count_sphere_grid_job_proc, pool);
+    
+    grid->cells = (u32 *)malloc(sizeof(u32)*(grid->cell_count+1));
+    u32 offset = 0;
+    for(u32 c = 0; c < grid->cell_count; c++) {
+        grid->cells[c] = offset;
+        for(u32 i = 0; i < job_count; i++) {
+            u32 job_cell_count = jobs[i].counts[c];
+            jobs[i].counts[c] = offset;
+            offset += job_cell_count;
+        }
+    }
+    grid->cells[grid->cell_count] = offset;
+    
+    grid->prim_count = offset;
+    grid->prims = (u32 *)malloc(sizeof(u32)*MAX(grid->prim_count, 1));
+    run_sphere_grid_jobs(jobs, job_count, scatter_sphere_grid_job_proc, pool);
+    
+    free(jobs);
+    free(counts);
+}
+
+// NOTE(ajeej): 3d dda through the cells the ray crosses, nearest first. A
+// sphere can be hit past the cell it was found in since it overlaps other
+// cells, so the walk only stops once the closest hit is before the next cell.
+static i32
+traverse_sphere_grid(sphere_grid_t *grid, sphere_soa_t *soa, vec3 p, vec3 dir, f32 *t)
+{
+    if(grid->cell_count == 0)
+        return -1;
+    
+    // NOTE(ajeej): a ray parallel to the slabs of an axis is either always
+    // or never between them, 1/0 would give 0*inf for an origin on a bound
+    vec3 inv_dir;
+    f32 t_enter = 0.0f, t_exit = *t;
+    for(u32 axis = 0; axis < 3; axis++) {
+        if(dir[axis] == 0) {
+            if(p[axis] < grid->bounds.min[axis] || p[axis] > grid->bounds.max[axis])
+                return -1;
+            inv_dir[axis] = 0.0f;
+            continue;
+        }
+        
+        inv_dir[axis] = 1.0f/dir[axis];
+        f32 t0 = (grid->bounds.min[axis] - p[axis])*inv_dir[axis];
+        f32 t1 = (grid->bounds.max[axis] - p[axis])*inv_dir[axis];
+        t_enter = MAX(t_enter, MIN(t0, t1));
+        t_exit = MIN(t_exit, MAX(t0, t1));
+    }
+    if(t_enter > t_exit)
+        return -1;
+    
+    i32 cell[3], step[3];
+    f32 t_next[3], t_delta[3];
+    for(u32 axis = 0; axis < 3; axis++)
+    {
+        f32 offset = p[axis] + dir[axis]*t_enter - grid->bounds.min[axis];
+        i32 c = (i32)(offset*grid->inv_cell_size[axis]);
+        cell[axis] = MIN(MAX(c, 0), (i32)grid->res[axis]-1);
+        
+        if(dir[axis] > 0) {
+            step[axis] = 1;
+            t_next[axis] = t_enter + ((cell[axis]+1)*grid->cell_size[axis] - offset)*inv_dir[axis];
+            t_delta[axis] = grid->cell_size[axis]*inv_dir[axis];
+        } else if(dir[axis] < 0) {
+            step[axis] = -1;
+            t_next[axis] = t_enter + (cell[axis]*grid->cell_size[axis] - offset)*inv_dir[axis];
+            t_delta[axis] = -grid->cell_size[axis]*inv_dir[axis];
+        } else {
+            step[axis] = 0;
+            t_next[axis] = FLT_MAX;
+            t_delta[axis] = FLT_MAX;
+        }
+    }
+    
+    i32 closest = -1;
+    while(true)
+    {
+        u32 c = (cell[2]*grid->res[1] + cell[1])*grid->res[0] + cell[0];
+        i32 hit = intersect_sphere_run(soa, soa->runs[grid->cells[c]], grid->cells[c+1] - grid->cells[c],
+                                       p, dir, t);
+        if(hit >= 0)
+            closest = hit;
+        
+        u32 axis = (t_next[0] < t_next[1]) ?
+            ((t_next[0] < t_next[2]) ? 0 : 2) : ((t_next[1] < t_next[2]) ? 1 : 2);
+        if(*t <= t_next[axis] || t_next[axis] > t_exit)
+            break;
+        
+        cell[axis] += step[axis];
+        if(cell[axis] < 0 || cell[axis] >= (i32)grid->res[axis])
+            break;
+        t_next[axis] += t_delta[axis];
+    }
+    
+    return closest;
+}
+
+// NOTE(ajeej): spheres that are in the grid are not top level prims
+static u32
+get_tlas_sphere_count(scene_t *sc)
+{
+    return (sc->sphere_grid.cell_count) ? 0 : get_stack_count(sc->spheres);
+}
+
+// NOTE(ajeej): the spheres among ids[first] up to ids[first+count], the
+// other prims of a top level leaf are skipped
+static u32
+get_sphere_run_count(u32 *ids, u32 first, u32 count, u32 sphere_count)
+{
+    u32 run_count = 0;
+    for(u32 i = first; i < first+count; i++)
+        if(ids[i] < sphere_count)
+            run_count++;
+    return run_count;
+}
+
+// NOTE(ajeej): the spheres are copied in the order the cells of the sphere
+// grid list them or, without a grid, in the order of the top level leaves.
+// Every cell or leaf gets its own run of lanes so it is tested with aligned
+// loads, the padding lanes repeat the first sphere of the run, which can not
+// win over the lane that already tests it. Has to be built again whenever
+// the top level bvh gets new leaves.
+static void
+build_sphere_soa(sphere_soa_t *soa, scene_t *sc)
+{
+    free_sphere_soa(soa);
+    
+    sphere_grid_t *grid = &sc->sphere_grid;
+    bvh_t *bvh = &sc->bvh;
+    u32 sphere_count = get_tlas_sphere_count(sc);
+    u32 *ids = bvh->prim_ids;
+    u32 id_count = bvh->prim_count, group_count = bvh->node_count;
+    if(grid->cell_count) {
+        sphere_count = get_stack_count(sc->spheres);
+        ids = grid->prims;
+        id_count = grid->prim_count;
+        group_count = grid->cell_count;
+    }
+    if(sphere_count == 0)
+        return;
+    
+    // NOTE(ajeej): groups are the cells of the grid or the nodes of the
+    // bvh, where interior nodes hold nothing
+    u32 lane_count = 0;
+    for(u32 g = 0; g < group_count; g++) {
+        u32 first = (grid->cell_count) ? grid->cells[g] : bvh->nodes[g].first;
+        u32 count = (grid->cell_count) ? grid->cells[g+1]-first : bvh->nodes[g].count;
+        lane_count += (get_sphere_run_count(ids, first, count, sphere_count) + 7) & ~7u;
+    }
+    
+    f32 *block = (f32 *)_mm_malloc(5*MAX(lane_count, 8)*sizeof(f32), 32);
+    soa->x = block;
+    soa->y = soa->x + lane_count;
+    soa->z = soa->y + lane_count;
+    soa->r = soa->z + lane_count;
+    soa->ids = (u32 *)(soa->r + lane_count);
+    soa->runs = (u32 *)calloc(MAX(id_count, 1), sizeof(u32));
+    soa->lane_count = lane_count;
+    
+    u32 lane = 0;
+    for(u32 g = 0; g < group_count; g++)
+    {
+        u32 first = (grid->cell_count) ? grid->cells[g] : bvh->nodes[g].first;
+        u32 count = (grid->cell_count) ? grid->cells[g+1]-first : bvh->nodes[g].count;
+        u32 run_count = get_sphere_run_count(ids, first, count, sphere_count);
+        if(run_count == 0)
+            continue;
+        
+        soa->runs[first] = lane;
+        u32 run_first = lane;
+        for(u32 i = first; i < first+count; i++) {
+            if(ids[i] >= sphere_count)
+                continue;
+            
+            sphere_t *sphere = sc->spheres+ids[i];
+            soa->x[lane] = sphere->pos[0];
+            soa->y[lane] = sphere->pos[1];
+            soa->z[lane] = sphere->pos[2];
+            soa->r[lane] = sphere->r;
+            soa->ids[lane++] = ids[i];
+        }
+        
+        for(; lane & 7; lane++) {
+            soa->x[lane] = soa->x[run_first];
+            soa->y[lane] = soa->y[run_first];
+            soa->z[lane] = soa->z[run_first];
+            soa->r[lane] = soa->r[run_first];
+            soa->ids[lane] = soa->ids[run_first];
+        }
+    }
+}
+
+// NOTE(ajeej): planes, quads and disks are only hit from the front and
+// boxes only from outside, like triangles
+static bool
+intersect_shape_dist(vec3 p, vec3 dir, shape_t *s, f32 *t)
+{
+    f32 dist;
     
-    if (disc >= 0) {
-        f32 dist = (-b - sqrt(disc)) / (2*a);
+    if(s->type == SHAPE_BOX) {
+        // NOTE(ajeej): t_near is negative when the ray starts inside,
+        // which also drops rays leaving a face they were shot from
+        f32 t_near = -FLT_MAX, t_far = FLT_MAX;
+        for(u32 i = 0; i < 3; i++)
+        {
+            f32 inv_dir = 1.0f/dir[i];
+            f32 t0 = (s->pos[i] - p[i])*inv_dir;
+            f32 t1 = (s->u[i] - p[i])*inv_dir;
+            t_near = MAX(t_near, MIN(t0, t1));
+            t_far = MIN(t_far, MAX(t0, t1));
+        }
         
-        if(dist >= 0) {
-            result.hit = true;
-            result.dist = dist;
-            result.mat_id = s->mat_id;
+        if(t_near > t_far)
+            return false;
+        dist = t_near;
+    } else {
+        vec3 norm, delta;
+        if(s->type == SHAPE_PLANE)
+            glm_vec3_copy(s->u, norm);
+        else
+            glm_vec3_cross(s->u, s->v, norm);
+        
+        f32 denom = glm_vec3_dot(dir, norm);
+        if(denom > -1E-6)
+            return false;
+        
+        glm_vec3_sub(s->pos, p, delta);
+        dist = glm_vec3_dot(delta, norm)/denom;
+        
+        if(s->type != SHAPE_PLANE) {
+            // NOTE(ajeej): coordinates of the hit along the two edges,
+            // -1 to 1 inside the quad
+            vec3 local;
+            glm_vec3_scale(dir, dist, local);
+            glm_vec3_sub(local, delta, local);
+            f32 a = glm_vec3_dot(local, s->u)/glm_vec3_dot(s->u, s->u);
+            f32 b = glm_vec3_dot(local, s->v)/glm_vec3_dot(s->v, s->v);
             
-            glm_vec3_scale(dir, dist, result.enter_point);
-            glm_vec3_add(result.enter_point, p, result.enter_point);
+            if(s->type == SHAPE_QUAD && (fabsf(a) > 1.0f || fabsf(b) > 1.0f))
+                return false;
+            if(s->type == SHAPE_DISK && a*a + b*b > 1.0f)
+                return false;
+        }
+    }
+    
+    if(dist < 0 || dist >= *t)
+        return false;
+    
+    *t = dist;
+    return true;
+}
+
+static void
+get_shape_hit_info(vec3 p, vec3 dir, shape_t *s, hit_info_t *info)
+{
+    info->hit = true;
+    info->mat_id = s->mat_id;
+    
+    glm_vec3_scale(dir, info->dist, info->enter_point);
+    glm_vec3_add(info->enter_point, p, info->enter_point);
+    
+    if(s->type == SHAPE_PLANE) {
+        glm_vec3_copy(s->u, info->norm);
+        return;
+    }
+    
+    if(s->type != SHAPE_BOX) {
+        glm_vec3_cross(s->u, s->v, info->norm);
+        glm_vec3_normalize(info->norm);
+        return;
+    }
+    
+    // NOTE(ajeej): the face that was hit is the one the hit point is
+    // furthest out towards relative to the size of the box
+    u32 axis = 0;
+    f32 max_d = 0.0f;
+    for(u32 i = 0; i < 3; i++)
+    {
+        f32 half = 0.5f*(s->u[i] - s->pos[i]);
+        f32 d = (info->enter_point[i] - (s->pos[i] + half))/MAX(half, 1E-6f);
+        if(fabsf(d) > fabsf(max_d)) {
+            max_d = d;
+            axis = i;
+        }
+    }
+    
+    glm_vec3_zero(info->norm);
+    info->norm[axis] = (max_d < 0) ? -1.0f : 1.0f;
+}
+
+static void
+get_shape_bounds(shape_t *s, aabb_t *out)
+{
+    if(s->type == SHAPE_BOX) {
+        glm_vec3_copy(s->pos, out->min);
+        glm_vec3_copy(s->u, out->max);
+        return;
+    }
+    
+    for(u32 i = 0; i < 3; i++)
+    {
+        f32 extent = (s->type == SHAPE_DISK) ?
+            sqrtf(s->u[i]*s->u[i] + s->v[i]*s->v[i]) : fabsf(s->u[i]) + fabsf(s->v[i]);
+        out->min[i] = s->pos[i] - extent;
+        out->max[i] = s->pos[i] + extent;
+    }
+}
+
+// NOTE(ajeej): planes have no bounds so they stay out of the bvh and
+// are tested with every ray, returns the closest one hit before t
+static i32
+intersect_planes(scene_t *sc, vec3 p, vec3 dir, f32 *t)
+{
+    i32 closest = -1;
+    for(u32 i = 0; i < get_stack_count(sc->planes); i++)
+        if(intersect_shape_dist(p, dir, sc->planes+i, t))
+            closest = i;
+    return closest;
+}
+
+// NOTE(ajeej): an axis scaled by 0 is left alone, which is exact as long
+// as the mesh is flat along it
+static void
+get_inverse_scale(mesh_t *mesh, vec3 out)
+{
+    for(u32 i = 0; i < 3; i++)
+        out[i] = (mesh->scale[i] != 0.0f) ? 1.0f/mesh->scale[i] : 1.0f;
+}
+
+// NOTE(ajeej): the triangles of a mesh in the shared vertex pool, indexed
+// from the first triangle of the mesh like its bvhs
+static bvh_tri_mesh_t
+get_mesh_tris(scene_t *sc, mesh_t *mesh)
+{
+    bvh_tri_mesh_t tris;
+    tris.verts = sc->verts;
+    tris.indices = sc->indices + mesh->tri_idx*3;
+    return tris;
+}
+
+// NOTE(ajeej): inverse of transform_vertex. The direction is not normalized
+// afterwards so a distance along it is the same in both spaces.
+static void
+inverse_transform_ray(mesh_t *mesh, vec3 p, vec3 dir, vec3 out_p, vec3 out_dir)
+{
+    versor inv_rot = {-mesh->rot[0], -mesh->rot[1], -mesh->rot[2], mesh->rot[3]};
+    vec3 inv_scale;
+    get_inverse_scale(mesh, inv_scale);
+    
+    glm_vec3_sub(p, mesh->pos, out_p);
+    rotate_vertex(out_p, inv_rot, out_p);
+    glm_vec3_mul(out_p, inv_scale, out_p);
+    
+    rotate_vertex(dir, inv_rot, out_dir);
+    glm_vec3_mul(out_dir, inv_scale, out_dir);
+}
+
+// NOTE(ajeej): one mesh or shape of the top level bvh, the spheres are
+// tested by intersect_scene_leaf
+static bool
+intersect_scene_prim(scene_trace_t *trace, u32 prim_id, vec3 p, vec3 dir, f32 *t)
+{
+    scene_t *sc = trace->sc;
+    
+    if(prim_id >= trace->shape_first)
+        return intersect_shape_dist(p, dir, sc->shapes+prim_id-trace->shape_first, t);
+    
+    u32 mesh_id = prim_id - trace->sphere_count;
+    mesh_t *mesh = sc->meshes+mesh_id;
+    bvh_tri_mesh_t tris = get_mesh_tris(sc, mesh);
+    vec3 obj_p, obj_dir;
+    inverse_transform_ray(mesh, p, dir, obj_p, obj_dir);
+    
+    i32 tri_id = traverse_bvh8(sc->mesh_bvh8s+mesh->blas_id, &tris, obj_p, obj_dir, t);
+    if(tri_id < 0)
+        return false;
+    
+    trace->mesh_id = mesh_id;
+    trace->tri_id = mesh->tri_idx+tri_id;
+    return true;
+}
+
+// NOTE(ajeej): the spheres of a leaf are tested 8 at a time from their run
+// in the sphere soa, every other prim on its own
+static i32
+intersect_scene_leaf(void *data, u32 *prim_ids, u32 count, vec3 p, vec3 dir, f32 *t)
+{
+    scene_trace_t *trace = (scene_trace_t *)data;
+    sphere_soa_t *soa = &trace->sc->sphere_soa;
+    u32 sphere_count = 0;
+    i32 closest = -1;
+    
+    for(u32 i = 0; i < count; i++)
+    {
+        u32 id = prim_ids[i];
+        if(id < trace->sphere_count)
+            sphere_count++;
+        else if(intersect_scene_prim(trace, id, p, dir, t))
+            closest = id;
+    }
+    
+    if(sphere_count) {
+        u32 first = soa->runs[prim_ids - trace->sc->bvh.prim_ids];
+        i32 hit = intersect_sphere_run(soa, first, sphere_count, p, dir, t);
+        if(hit >= 0)
+            closest = hit;
+    }
+    
+    return closest;
+}
+
+// NOTE(ajeej): packet version of intersect_scene_prim. The rays of a packet
+// still share their origin in the object space of a mesh, so they go through
+// its bvh8 as one packet too.
+static u32
+intersect_scene_packet(u32 prim_id, bvh_packet_t *packet, u32 first)
+{
+    scene_trace_t *trace = (scene_trace_t *)packet->data[first];
+    scene_t *sc = trace->sc;
+    u32 hit_mask = 0;
+    
+    if(prim_id < trace->sphere_count) {
+        for(u32 r = first; r < packet->count; r++)
+            if(intersect_sphere_dist(packet->origin, packet->dir[r], sc->spheres+prim_id, packet->t+r))
+                hit_mask |= 1u << r;
+        return hit_mask;
+    }
+    
+    if(prim_id >= trace->shape_first) {
+        shape_t *s = sc->shapes+prim_id-trace->shape_first;
+        for(u32 r = first; r < packet->count; r++)
+            if(intersect_shape_dist(packet->origin, packet->dir[r], s, packet->t+r))
+                hit_mask |= 1u << r;
+        return hit_mask;
+    }
+    
+    u32 mesh_id = prim_id - trace->sphere_count;
+    mesh_t *mesh = sc->meshes+mesh_id;
+    bvh_packet_t obj_packet;
+    obj_packet.count = packet->count - first;
+    
+    for(u32 i = 0; i < obj_packet.count; i++) {
+        inverse_transform_ray(mesh, packet->origin, packet->dir[first+i],
+                              obj_packet.origin, obj_packet.dir[i]);
+        obj_packet.t[i] = packet->t[first+i];
+    }
+    
+    bvh_tri_mesh_t tris = get_mesh_tris(sc, mesh);
+    traverse_bvh8_packet(sc->mesh_bvh8s+mesh->blas_id, &tris, &obj_packet);
+    
+    for(u32 i = 0; i < obj_packet.count; i++)
+    {
+        if(obj_packet.closest[i] < 0)
+            continue;
+        
+        u32 r = first+i;
+        scene_trace_t *ray_trace = (scene_trace_t *)packet->data[r];
+        ray_trace->mesh_id = mesh_id;
+        ray_trace->tri_id = mesh->tri_idx+obj_packet.closest[i];
+        packet->t[r] = obj_packet.t[i];
+        hit_mask |= 1u << r;
+    }
+    
+    return hit_mask;
+}
+
+static void
+get_sphere_hit_info(vec3 p, vec3 dir, sphere_t *s, hit_info_t *info)
+{
+    info->hit = true;
+    info->mat_id = s->mat_id;
+    
+    glm_vec3_scale(dir, info->dist, info->enter_point);
+    glm_vec3_add(info->enter_point, p, info->enter_point);
+    
+    glm_vec3_sub(info->enter_point, s->pos, info->norm);
+    glm_vec3_normalize(info->norm);
+}
+
+// NOTE(ajeej): fills info from the closest top level prim, info->dist has
+// to be the distance to it already
+static void
+get_scene_hit_info(scene_trace_t *trace, i32 closest, vec3 p, vec3 dir, hit_info_t *info)
+{
+    scene_t *sc = trace->sc;
+    if(closest < 0)
+        return;
+    
+    if((u32)closest < trace->sphere_count) {
+        get_sphere_hit_info(p, dir, sc->spheres+closest, info);
+        return;
+    }
+    
+    if((u32)closest >= trace->shape_first) {
+        get_shape_hit_info(p, dir, sc->shapes+closest-trace->shape_first, info);
+        return;
+    }
+    
+    // NOTE(ajeej): normals go back to world space with the inverse
+    // transpose, which is the rotation after dividing by the scale
+    mesh_t *mesh = sc->meshes+trace->mesh_id;
+    bvh_tri_mesh_t tris = get_mesh_tris(sc, mesh);
+    vec3 v0, e1, e2, inv_scale;
+    get_bvh_mesh_tri(&tris, trace->tri_id - mesh->tri_idx, v0, e1, e2);
+    get_inverse_scale(mesh, inv_scale);
+    
+    info->hit = true;
+    info->mat_id = mesh->mat_id;
+    
+    glm_vec3_scale(dir, info->dist, info->enter_point);
+    glm_vec3_add(info->enter_point, p, info->enter_point);
+    
+    glm_vec3_cross(e1, e2, info->norm);
+    glm_vec3_mul(info->norm, inv_scale, info->norm);
+    rotate_vertex(info->norm, mesh->rot, info->norm);
+    glm_vec3_normalize(info->norm);
+}
+
+// NOTE(ajeej): walks the top level bvh over the spheres, meshes and shapes,
+// the ray only enters the bottom level bvh of a mesh in its object space.
+// The sphere grid and the planes are tested first, every test after them
+// only looks for hits before the closest one so far.
+static void
+traverse_scene_bvh(scene_t *sc, vec3 p, vec3 dir, hit_info_t *info)
+{
+    scene_trace_t trace = {0};
+    trace.sc = sc;
+    trace.sphere_count = get_tlas_sphere_count(sc);
+    trace.shape_first = trace.sphere_count + get_stack_count(sc->meshes);
+    
+    i32 sphere = traverse_sphere_grid(&sc->sphere_grid, &sc->sphere_soa, p, dir, &info->dist);
+    i32 plane = intersect_planes(sc, p, dir, &info->dist);
+    i32 closest = -1;
+    if(sc->bvh.node_count)
+        closest = traverse_bvh(&sc->bvh, p, dir, &info->dist, intersect_scene_leaf, &trace);
+    
+    if(closest < 0 && plane >= 0)
+        get_shape_hit_info(p, dir, sc->planes+plane, info);
+    else if(closest < 0 && sphere >= 0)
+        get_sphere_hit_info(p, dir, sc->spheres+sphere, info);
+    get_scene_hit_info(&trace, closest, p, dir, info);
+}
+
+static hit_info_t
+get_ray_collision(scene_t *sc, vec3 p, vec3 dir)
+{
+    hit_info_t closest_info = {0};
+    closest_info.dist = 10000000.0f;
+    
+    if(sc->bvh.node_count || sc->sphere_grid.cell_count) {
+        traverse_scene_bvh(sc, p, dir, &closest_info);
+        return closest_info;
+    }
+    
+    // NOTE(ajeej): without a bvh every shape and triangle is tested, the
+    // spheres are always in the bvh or the grid
+    i32 plane = intersect_planes(sc, p, dir, &closest_info.dist);
+    if(plane >= 0)
+        get_shape_hit_info(p, dir, sc->planes+plane, &closest_info);
+    
+    for(u32 i = 0; i < get_stack_count(sc->shapes); i++)
+        if(intersect_shape_dist(p, dir, sc->shapes+i, &closest_info.dist))
+            get_shape_hit_info(p, dir, sc->shapes+i, &closest_info);
+    
+    for(u32 i = 0; i < get_stack_count(sc->meshes); i++)
+    {
+        mesh_t *mesh = sc->meshes + i;
+        bvh_tri_mesh_t tris = get_mesh_tris(sc, mesh);
+        
+        for(u32 j = 0; j < mesh->tri_count; j++)
+        {
+            triangle_t tri;
+            get_bvh_mesh_tri(&tris, j, tri.v0, tri.e1, tri.e2);
+            hit_info_t info = intersect_triangle(p, dir, &tri, mesh);
             
-            glm_vec3_sub(result.enter_point, s->pos, result.norm);
-            glm_vec3_normalize(result.norm);
+            if(info.hit && info.dist < closest_info.dist)
+                closest_info = info;
+        }
+    }
+    
+    return closest_info;
+}
+
+// NOTE(ajeej): closest hits of rays that all start at p, traced through the
+// top level bvh and the meshes as one packet
+static void
+get_packet_collisions(scene_t *sc, vec3 p, vec3 *dirs, u32 count, hit_info_t *infos)
+{
+    if(sc->bvh.node_count == 0) {
+        for(u32 i = 0; i < count; i++)
+            infos[i] = get_ray_collision(sc, p, dirs[i]);
+        return;
+    }
+    
+    bvh_packet_t packet;
+    scene_trace_t traces[BVH_PACKET_SIZE] = {0};
+    i32 spheres[BVH_PACKET_SIZE], planes[BVH_PACKET_SIZE];
+    glm_vec3_copy(p, packet.origin);
+    packet.count = count;
+    
+    for(u32 i = 0; i < count; i++) {
+        traces[i].sc = sc;
+        traces[i].sphere_count = get_tlas_sphere_count(sc);
+        traces[i].shape_first = traces[i].sphere_count + get_stack_count(sc->meshes);
+        glm_vec3_copy(dirs[i], packet.dir[i]);
+        packet.t[i] = 10000000.0f;
+        packet.data[i] = traces+i;
+        spheres[i] = traverse_sphere_grid(&sc->sphere_grid, &sc->sphere_soa, p, dirs[i], packet.t+i);
+        planes[i] = intersect_planes(sc, p, dirs[i], packet.t+i);
+    }
+    
+    traverse_bvh_packet(&sc->bvh, &packet, intersect_scene_packet);
+    
+    for(u32 i = 0; i < count; i++) {
+        memset(infos+i, 0, sizeof(hit_info_t));
+        infos[i].dist = packet.t[i];
+        if(packet.closest[i] < 0 && planes[i] >= 0)
+            get_shape_hit_info(p, dirs[i], sc->planes+planes[i], infos+i);
+        else if(packet.closest[i] < 0 && spheres[i] >= 0)
+            get_sphere_hit_info(p, dirs[i], sc->spheres+spheres[i], infos+i);
+        get_scene_hit_info(traces+i, packet.closest[i], p, dirs[i], infos+i);
+    }
+}
+
+// NOTE(ajeej): the bottom level bvh of a mesh is built once in object
+// space when the mesh is first seen, add_mesh never changes triangles of
+// meshes that already exist. Instances use the bvh of the mesh they were
+// made from, which was added before them. The builds use the scene pool if
+// it has one and add to the scene bvh stats. The cpu traces the bvh8
+// collapsed from it, the binary bvh is kept for the gpu upload.
+static void
+build_mesh_bvhs(scene_t *sc)
+{
+    for(u32 i = 0; i < get_stack_count(sc->meshes); i++)
+    {
+        mesh_t *mesh = sc->meshes+i;
+        if(mesh->blas_id < get_stack_count(sc->mesh_bvhs))
+            continue;
+        
+        bvh_t *bvh = (bvh_t *)stack_push(&sc->mesh_bvhs);
+        aabb_t *bounds = (aabb_t *)calloc(MAX(mesh->tri_count, 1), sizeof(aabb_t));
+        
+        bvh_tri_mesh_t tris = get_mesh_tris(sc, mesh);
+        for(u32 j = 0; j < mesh->tri_count; j++) {
+            u32 *idx = tris.indices + j*3;
+            aabb_empty(bounds+j);
+            for(u32 k = 0; k < 3; k++)
+                aabb_grow(bounds+j, tris.verts + idx[k]*3);
+        }
+        
+        // NOTE(ajeej): with gpu_bvh the compute shader builds the tree, the
+        // cpu only keeps the bounds of the mesh for the top level bvh
+        bvh8_t *bvh8 = (bvh8_t *)stack_push(&sc->mesh_bvh8s);
+        memset(bvh8, 0, sizeof(*bvh8));
+        if(sc->settings.gpu_bvh)
+            build_bvh_leaf(bvh, bounds, mesh->tri_count);
+        else {
+            build_bvh_parallel(bvh, bounds, mesh->tri_count, sc->pool,
+                               sc->settings.bvh_preset, &sc->bvh_stats);
+            build_bvh8(bvh8, bvh, &tris, sc->settings.tri_cache);
+        }
+        free(bounds);
+    }
+}
+
+// NOTE(ajeej): world space box around the object space root of the mesh
+static void
+get_mesh_bounds(mesh_t *mesh, bvh_t *bvh, aabb_t *out)
+{
+    aabb_empty(out);
+    if(bvh->node_count == 0)
+        return;
+    
+    bvh_node_t *root = bvh->nodes;
+    for(u32 i = 0; i < 8; i++)
+    {
+        vec3 corner = {
+            (i & 1) ? root->max[0] : root->min[0],
+            (i & 2) ? root->max[1] : root->min[1],
+            (i & 4) ? root->max[2] : root->min[2],
+        };
+        transform_vertex(corner, mesh, corner);
+        aabb_grow(out, corner);
+    }
+}
+
+// NOTE(ajeej): collects the spheres next event estimation samples, every
+// sphere whose material gives off any light
+static void
+build_scene_lights(scene_t *sc)
+{
+    stack_clear(sc->lights);
+    for(u32 i = 0; i < get_stack_count(sc->spheres); i++)
+    {
+        material_t *mat = sc->mats+sc->spheres[i].mat_id;
+        f32 emission = glm_max(mat->emission_color[0], glm_max(mat->emission_color[1], mat->emission_color[2]));
+        if(emission*mat->emission_strength > 0)
+            *(u32 *)stack_push(&sc->lights) = i;
+    }
+}
+
+// NOTE(ajeej): rebuilds the top level bvh over the spheres, the mesh
+// instances and the shapes, only the meshes that were added since the last
+// call get a new bottom level bvh. Lots of similar spheres go into the
+// sphere grid instead and the emissive spheres are collected for light
+// sampling. Has to be called after add_sphere,
+// add_mesh, add_instance or any of the shapes, moved meshes are handled by
+// update_scene_bvh.
+static void
+rebuild_scene_bvh(scene_t *sc)
+{
+    cancel_bvh_rebuild(&sc->tlas_rebuild);
+    build_mesh_bvhs(sc);
+    build_scene_lights(sc);
+    
+    free_sphere_grid(&sc->sphere_grid);
+    if(use_sphere_grid(sc->spheres, get_stack_count(sc->spheres)))
+        build_sphere_grid(&sc->sphere_grid, sc->spheres, get_stack_count(sc->spheres), sc->pool);
+    
+    u32 sphere_count = get_tlas_sphere_count(sc);
+    u32 mesh_count = get_stack_count(sc->meshes);
+    u32 shape_count = get_stack_count(sc->shapes);
+    u32 prim_count = sphere_count+mesh_count+shape_count;
+    if(sc->tlas_bounds)
+        free(sc->tlas_bounds);
+    sc->tlas_bounds = (aabb_t *)calloc(MAX(prim_count, 1), sizeof(aabb_t));
+    aabb_t *bounds = sc->tlas_bounds;
+    
+    for(u32 i = 0; i < sphere_count; i++) {
+        sphere_t *s = sc->spheres+i;
+        glm_vec3_adds(s->pos, -s->r, bounds[i].min);
+        glm_vec3_adds(s->pos, s->r, bounds[i].max);
+    }
+    
+    for(u32 i = 0; i < mesh_count; i++)
+        get_mesh_bounds(sc->meshes+i, sc->mesh_bvhs+sc->meshes[i].blas_id, bounds+sphere_count+i);
+    
+    for(u32 i = 0; i < shape_count; i++)
+        get_shape_bounds(sc->shapes+i, bounds+sphere_count+mesh_count+i);
+    
+    build_bvh(&sc->bvh, bounds, prim_count);
+    build_sphere_soa(&sc->sphere_soa, sc);
+    stack_clear(sc->moved_meshes);
+    sc->bvh_dirty = false;
+}
+
+// NOTE(ajeej): brings the top level bvh up to date, returns true if it
+// changed. Moved meshes only refit the path from their leaf to the root,
+// once that made the tree too slow compared to when it was built a new
+// one is built in the background and swapped in when it is done.
+static bool
+update_scene_bvh(scene_t *sc)
+{
+    if(sc->bvh_dirty) {
+        rebuild_scene_bvh(sc);
+        return true;
+    }
+    
+    u32 sphere_count = get_tlas_sphere_count(sc);
+    u32 moved_count = get_stack_count(sc->moved_meshes);
+    
+    // NOTE(ajeej): the moved mesh ids are turned into top level prim ids
+    for(u32 i = 0; i < moved_count; i++) {
+        u32 mesh_id = sc->moved_meshes[i];
+        get_mesh_bounds(sc->meshes+mesh_id, sc->mesh_bvhs+sc->meshes[mesh_id].blas_id,
+                        sc->tlas_bounds+sphere_count+mesh_id);
+        sc->moved_meshes[i] += sphere_count;
+    }
+    
+    // NOTE(ajeej): meshes could have moved while the new tree was being
+    // built, so all of it gets refitted once
+    if(finish_bvh_rebuild(&sc->tlas_rebuild, &sc->bvh, false)) {
+        refit_bvh_all(&sc->bvh, sc->tlas_bounds);
+        sc->bvh.build_cost = get_bvh_sah_cost(&sc->bvh);
+        build_sphere_soa(&sc->sphere_soa, sc);
+        stack_clear(sc->moved_meshes);
+        return true;
+    }
+    
+    if(moved_count == 0)
+        return false;
+    
+    refit_bvh(&sc->bvh, sc->tlas_bounds, sc->moved_meshes, moved_count);
+    stack_clear(sc->moved_meshes);
+    
+    if(get_bvh_sah_cost(&sc->bvh) > sc->bvh.build_cost*BVH_REFIT_REBUILD_RATIO)
+        start_bvh_rebuild(&sc->tlas_rebuild, sc->tlas_bounds, sc->bvh.prim_count);
+    
+    return true;
+}
+
+// NOTE(ajeej): cpu counterpart of setup_scene, anything added after it is
+// picked up by the next rebuild of the bvh
+static void
+setup_cpu_scene(scene_t *sc)
+{
+    rebuild_scene_bvh(sc);
+}
+
+// NOTE(ajeej): pcg output permutation of one lcg step, gives well mixed
+// bits even for consecutive inputs
+static u32
+pcg_hash(u32 v)
+{
+    u32 state = v*747796405u + 2891336453u;
+    u32 word = ((state >> ((state >> 28u) + 4u)) ^ state)*277803737u;
+    return (word >> 22u) ^ word;
+}
+
+static void
+init_rng(rng_t *rng, u32 pixel, u32 sample_id)
+{
+    rng->key = pcg_hash(pixel + pcg_hash(sample_id));
+    rng->counter = 0;
+}
+
+// NOTE(ajeej): the top 24 bits of the hash, so the value is in [0, 1) and
+// exactly the same as a float in the shader
+static f32
+random_value(rng_t *rng)
+{
+    return (pcg_hash(rng->key + rng->counter++) >> 8)*(1.0f/16777216.0f);
+}
+
+// NOTE(ajeej): the next count values of the stream, 8 at a time
+static void
+random_values(rng_t *rng, f32 *out, u32 count)
+{
+#if defined(__AVX2__)
+    __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256 scale = _mm256_set1_ps(1.0f/16777216.0f);
+    for(u32 i = 0; i < count; i += 8)
+    {
+        __m256i v = _mm256_add_epi32(_mm256_set1_epi32((i32)(rng->key + rng->counter + i)), lane);
+        __m256i state = _mm256_add_epi32(_mm256_mullo_epi32(v, _mm256_set1_epi32((i32)747796405u)),
+                                         _mm256_set1_epi32((i32)2891336453u));
+        __m256i shift = _mm256_add_epi32(_mm256_srli_epi32(state, 28), _mm256_set1_epi32(4));
+        __m256i word = _mm256_mullo_epi32(_mm256_xor_si256(_mm256_srlv_epi32(state, shift), state),
+                                          _mm256_set1_epi32((i32)277803737u));
+        word = _mm256_xor_si256(_mm256_srli_epi32(word, 22), word);
+        __m256 values = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(word, 8)), scale);
+        
+        if(count - i >= 8)
+            _mm256_storeu_ps(out+i, values);
+        else {
+            alignas(32) f32 lanes[8];
+            _mm256_store_ps(lanes, values);
+            memcpy(out+i, lanes, sizeof(f32)*(count - i));
         }
     }
+    rng->counter += count;
+#else
+    for(u32 i = 0; i < count; i++)
+        out[i] = random_value(rng);
+#endif
+}
+
+// NOTE(ajeej): direction numbers of the first four sobol dimensions, the
+// first is the van der corput sequence and the others come from the
+// joe-kuo primitive polynomials x+1, x^2+x+1 and x^3+x+1
+static const u32 sobol_directions[SAMPLER_DIMS][32] = {
+    {
+        0x80000000, 0x40000000, 0x20000000, 0x10000000, 0x08000000, 0x04000000, 0x02000000, 0x01000000,
+        0x00800000, 0x00400000, 0x00200000, 0x00100000, 0x00080000, 0x00040000, 0x00020000, 0x00010000,
+        0x00008000, 0x00004000, 0x00002000, 0x00001000, 0x00000800, 0x00000400, 0x00000200, 0x00000100,
+        0x00000080, 0x00000040, 0x00000020, 0x00000010, 0x00000008, 0x00000004, 0x00000002, 0x00000001,
+    },
+    {
+        0x80000000, 0xc0000000, 0xa0000000, 0xf0000000, 0x88000000, 0xcc000000, 0xaa000000, 0xff000000,
+        0x80800000, 0xc0c00000, 0xa0a00000, 0xf0f00000, 0x88880000, 0xcccc0000, 0xaaaa0000, 0xffff0000,
+        0x80008000, 0xc000c000, 0xa000a000, 0xf000f000, 0x88008800, 0xcc00cc00, 0xaa00aa00, 0xff00ff00,
+        0x80808080, 0xc0c0c0c0, 0xa0a0a0a0, 0xf0f0f0f0, 0x88888888, 0xcccccccc, 0xaaaaaaaa, 0xffffffff,
+    },
+    {
+        0x80000000, 0xc0000000, 0x60000000, 0x90000000, 0xe8000000, 0x5c000000, 0x8e000000, 0xc5000000,
+        0x68800000, 0x9cc00000, 0xee600000, 0x55900000, 0x80680000, 0xc09c0000, 0x60ee0000, 0x90550000,
+        0xe8808000, 0x5cc0c000, 0x8e606000, 0xc5909000, 0x6868e800, 0x9c9c5c00, 0xeeee8e00, 0x5555c500,
+        0x8000e880, 0xc0005cc0, 0x60008e60, 0x9000c590, 0xe8006868, 0x5c009c9c, 0x8e00eeee, 0xc5005555,
+    },
+    {
+        0x80000000, 0xc0000000, 0x20000000, 0x50000000, 0xf8000000, 0x74000000, 0xa2000000, 0x93000000,
+        0xd8800000, 0x25400000, 0x59e00000, 0xe6d00000, 0x78080000, 0xb40c0000, 0x82020000, 0xc3050000,
+        0x208f8000, 0x51474000, 0xfbea2000, 0x75d93000, 0xa0858800, 0x914e5400, 0xdbe79e00, 0x25db6d00,
+        0x58800080, 0xe54000c0, 0x79e00020, 0xb6d00050, 0x800800f8, 0xc00c0074, 0x200200a2, 0x50050093,
+    },
+};
+
+// NOTE(ajeej): steps of the r2 sequence in 0.32 fixed point for the blue
+// noise mask and of the r4 sequence for the samples of a pixel
+static const u32 r2_alphas[2] = {0xC13FA9A9, 0x91E10DA6};
+static const u32 r4_alphas[SAMPLER_DIMS] = {0xDB4F0B91, 0xBBE05633, 0xA0F2EC76, 0x89E18285};
+
+static u32
+reverse_bits(u32 v)
+{
+    v = ((v >> 1) & 0x55555555u) | ((v & 0x55555555u) << 1);
+    v = ((v >> 2) & 0x33333333u) | ((v & 0x33333333u) << 2);
+    v = ((v >> 4) & 0x0F0F0F0Fu) | ((v & 0x0F0F0F0Fu) << 4);
+    v = ((v >> 8) & 0x00FF00FFu) | ((v & 0x00FF00FFu) << 8);
+    return (v >> 16) | (v << 16);
+}
+
+// NOTE(ajeej): laine-karras permutation, a hash in which every bit only
+// changes the bits above it
+static u32
+laine_karras_permutation(u32 x, u32 seed)
+{
+    x += seed;
+    x ^= x*0x6c50b47cu;
+    x ^= x*0xb82f1e52u;
+    x ^= x*0xc7afe638u;
+    x ^= x*0x8d22f6e6u;
+    return x;
+}
+
+// NOTE(ajeej): owen scrambling, every bit is flipped by a hash of the bits
+// above it
+static u32
+nested_uniform_scramble(u32 x, u32 seed)
+{
+    return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+}
+
+static u32
+get_sobol(u32 index, u32 dim)
+{
+    u32 x = 0;
+    for(u32 bit = 0; index; bit++, index >>= 1)
+        if(index & 1)
+            x ^= sobol_directions[dim][bit];
+    return x;
+}
+
+static void
+init_sampler(sampler_t *smp, u32 type, u32 x, u32 y, u32 width, u32 sample_id)
+{
+    smp->type = type;
+    smp->x = x;
+    smp->y = y;
+    smp->sample_id = sample_id;
+    init_rng(&smp->rng, y*width + x, sample_id);
+}
+
+// NOTE(ajeej): the next SAMPLER_DIMS dimensions of the sample, the same as
+// get_sample_dims in ray_tracer.glsl. Sobol points are shuffled and owen
+// scrambled with a seed of the pixel and the dimension group (burley 2020).
+// Blue noise points step through the r4 sequence from an r2 mask over the
+// pixels. Their random offset only changes with the dimension group, an
+// offset per pixel would undo the mask and make the error white again.
+static void
+get_sample_dims(sampler_t *smp, f32 *out)
+{
+    if(smp->type == SAMPLER_RANDOM) {
+        random_values(&smp->rng, out, SAMPLER_DIMS);
+        return;
+    }
     
-    return result;
+    u32 group = smp->rng.counter/SAMPLER_DIMS;
+    u32 seed = pcg_hash(pcg_hash(smp->y*0x10000u + smp->x) + group);
+    u32 index = nested_uniform_scramble(smp->sample_id, seed);
+    for(u32 d = 0; d < SAMPLER_DIMS; d++)
+    {
+        u32 v;
+        if(smp->type == SAMPLER_SOBOL)
+            v = nested_uniform_scramble(get_sobol(index, d), pcg_hash(seed + d));
+        else {
+            u32 mask = (d & 1) ? smp->x*r2_alphas[1] + smp->y*r2_alphas[0] :
+                smp->x*r2_alphas[0] + smp->y*r2_alphas[1];
+            v = mask + pcg_hash(group*SAMPLER_DIMS + d) + smp->sample_id*r4_alphas[d];
+        }
+        out[d] = (v >> 8)*(1.0f/16777216.0f);
+    }
+    smp->rng.counter += SAMPLER_DIMS;
 }
 
-static hit_info_t
-get_ray_collision(vec3 p, vec3 dir, sphere_t *ss, u32 s_count)
+// NOTE(ajeej): every pixel of a width by height frame estimates how much of
+// a flat sky above a horizon at u = 0.7 it sees with one sample and the
+// correlation of the error of neighbouring pixels is printed per sampler.
+// White noise is near 0, blue noise pushes the error of neighbours apart so
+// it is clearly below 0. Returns false if blue noise is not below random.
+static bool
+check_sampler_noise(u32 width, u32 height)
 {
-    hit_info_t closest_info = {0};
-    closest_info.dist = 10000000.0f;
+    const char *names[] = {"random", "sobol", "bluenoise"};
+    f32 *err = (f32 *)malloc(sizeof(f32)*width*height);
+    f32 corr[ARRAY_COUNT(names)];
     
-    for(u32 i = 0; i < s_count; i++)
+    for(u32 type = 0; type < ARRAY_COUNT(names); type++)
     {
-        hit_info_t info = intersect_sphere(p, dir, ss+i);
+        for(u32 y = 0; y < height; y++) {
+            for(u32 x = 0; x < width; x++) {
+                sampler_t smp;
+                f32 u[SAMPLER_DIMS];
+                init_sampler(&smp, type, x, y, width, 0);
+                get_sample_dims(&smp, u);
+                err[y*width + x] = ((u[0] < 0.7f) ? 1.0f : 0.0f) - 0.7f;
+            }
+        }
         
-        if (info.hit && info.dist < closest_info.dist) {
-            closest_info = info;
-            closest_info.mat_id = ss[i].mat_id;
+        f64 var = 0, cov = 0;
+        u32 pairs = 0;
+        for(u32 y = 0; y < height; y++) {
+            for(u32 x = 0; x < width; x++) {
+                f32 e = err[y*width + x];
+                var += e*e;
+                if(x+1 < width) {
+                    cov += e*err[y*width + x+1];
+                    pairs++;
+                }
+                if(y+1 < height) {
+                    cov += e*err[(y+1)*width + x];
+                    pairs++;
+                }
+            }
         }
+        
+        corr[type] = (f32)((cov/pairs)/(var/(width*height)));
+        printf("%s: neighbour correlation %.3f\n", names[type], corr[type]);
     }
     
-    return closest_info;
+    free(err);
+    return corr[SAMPLER_BLUE_NOISE] < corr[SAMPLER_RANDOM];
 }
 
-static float
-random_value(u32 *state)
+/*static void
+get_rand_dir_on_hemisphere(vec3 norm, vec3 dir)
+{
+    
+    for(u32 i = 0; i < 3; i++)
+        dir[i] = dist(gen);
+    
+    glm_vec3_normalize(dir);
+    
+    if(glm_vec3_dot(dir, norm) < 0)
+        glm_vec3_negate(dir);
+}*/
+
+static f32
+smooth_step(f32 edge0, f32 edge1, f32 x)
 {
-    *state += (*state + 195439) * (*state + 124395) * (*state + 845921);
-    return *state / 4294967295.0;
+    f32 t = glm_clamp((x - edge0)/(edge1 - edge0), 0.0f, 1.0f);
+    return t*t*(3.0f - 2.0f*t);
 }
 
-static float
-random_normal_dist(u32 *state)
+// NOTE(ajeej): normalizes and clamps the sun settings and works out the
+// cone of the disk once. 1 - cos is 2*sin^2 of half the angle, which keeps
+// its precision for a sun as small as the real one. The radiance times the
+// solid angle of the disk is sun_intensity.
+static void
+prepare_sun_settings(render_settings_t *settings)
 {
-    float theta = 2*3.1415926 * random_value(state);
-    float rho = sqrt(-2 * log(random_value(state)));
-    return rho * cos(theta);
+    if(glm_vec3_norm2(settings->sun_dir) == 0)
+        settings->sun_intensity = 0.0f;
+    glm_vec3_normalize(settings->sun_dir);
+    settings->sun_angle = MAX(settings->sun_angle, SUN_MIN_ANGLE);
+    
+    f32 half_sin = sinf(0.5f*settings->sun_angle);
+    settings->sun_one_minus_cos = 2.0f*half_sin*half_sin;
+    settings->sun_cone_pdf = get_cone_pdf(settings->sun_one_minus_cos);
+    glm_vec3_scale(settings->sun_color, settings->sun_intensity*settings->sun_cone_pdf,
+                   settings->sun_radiance);
 }
 
+// NOTE(ajeej): the sky is a gradient from the horizon to the zenith over a
+// flat ground with the sun disk on top, which is scaled by sun_weight
 static void
-random_direction(u32 * state, vec3 dir)
+get_color_from_environment(render_settings_t *settings, vec3 dir, f32 sun_weight, vec3 color)
 {
-    for(int i = 0; i < 3; i++)
-        dir[i] = random_normal_dist(state);
+    vec3 sky_gradient;
+    f32 sky_gradient_t = pow(smooth_step(0.0f, 0.4f, dir[1]), 0.35f);
+    glm_vec3_lerp(settings->horizon_color, settings->zenith_color, sky_gradient_t, sky_gradient);
     
-    glm_vec3_normalize(dir);
+    f32 ground_to_sky_t = smooth_step(-0.01f, 0.0f, dir[1]);
+    glm_vec3_lerp(settings->ground_color, sky_gradient, ground_to_sky_t, color);
+    
+    // NOTE(ajeej): the chord between dir and sun_dir is sqrt(2*(1 - cos))
+    if(settings->sun_intensity > 0 &&
+       glm_vec3_distance2(dir, settings->sun_dir) <= 2.0f*settings->sun_one_minus_cos)
+        glm_vec3_muladds(settings->sun_radiance, sun_weight, color);
+}
+
+// NOTE(ajeej): power heuristic weight of a sample taken with pdf against
+// the other strategy that could have taken it with other_pdf
+static f32
+get_mis_weight(f32 pdf, f32 other_pdf)
+{
+    return pdf*pdf/(pdf*pdf + other_pdf*other_pdf);
+}
+
+// NOTE(ajeej): cone of the directions from p that hit sphere s, returns
+// false if p is inside of it
+static bool
+get_light_cone(vec3 p, sphere_t *s, vec3 axis, f32 *one_minus_cos)
+{
+    glm_vec3_sub(s->pos, p, axis);
+    f32 dist2 = glm_vec3_dot(axis, axis);
+    if(dist2 <= s->r*s->r)
+        return false;
+    
+    glm_vec3_scale(axis, 1.0f/sqrtf(dist2), axis);
+    f32 sin2 = s->r*s->r/dist2;
+    *one_minus_cos = sin2/(1.0f + sqrtf(1.0f - sin2));
+    return true;
+}
+
+// NOTE(ajeej): the emissive spheres and the sun if it is on, which is the
+// last of them
+static u32
+get_light_choice_count(scene_t *sc)
+{
+    return get_stack_count(sc->lights) + (sc->settings.sun_intensity > 0 ? 1 : 0);
+}
+
+// NOTE(ajeej): pdf that sample_scene_light at origin picks the direction to
+// point, which is on the surface of a light or it would not have been found
+static f32
+get_light_pdf(scene_t *sc, vec3 origin, vec3 point)
+{
+    u32 light_count = get_stack_count(sc->lights);
+    for(u32 i = 0; i < light_count; i++)
+    {
+        sphere_t *s = sc->spheres+sc->lights[i];
+        if(fabsf(glm_vec3_distance(point, s->pos) - s->r) > s->r*1e-3f)
+            continue;
+        
+        vec3 axis;
+        f32 one_minus_cos;
+        if(!get_light_cone(origin, s, axis, &one_minus_cos))
+            return 0.0f;
+        return get_cone_pdf(one_minus_cos)/get_light_choice_count(sc);
+    }
+    
+    return 0.0f;
+}
+
+// NOTE(ajeej): pdf that sample_scene_light picks a direction in the sun disk
+static f32
+get_sun_pdf(scene_t *sc)
+{
+    return sc->settings.sun_cone_pdf/get_light_choice_count(sc);
+}
+
+// NOTE(ajeej): next event estimation, u[2] picks one of the lights and u[0]
+// and u[1] a direction in the cone it covers. shadow gets the ray towards it
+// and the light it gives through the diffuse part of the material, weighted
+// against finding the light by a bsdf sample. Returns false and leaves the
+// weight of shadow at 0 if there is nothing to trace.
+static bool
+sample_scene_light(scene_t *sc, hit_info_t *info, material_t *mat, f32 *u,
+                   vec3 r_color, shadow_ray_t *shadow)
+{
+    shadow->weight = 0.0f;
+    
+    u32 light_count = get_stack_count(sc->lights);
+    u32 choice_count = get_light_choice_count(sc);
+    f32 diffuse = 1.0f - mat->smoothness;
+    if(choice_count == 0 || diffuse <= 0)
+        return false;
+    
+    u32 choice = MIN((u32)(u[2]*choice_count), choice_count-1);
+    sphere_t *s = NULL;
+    vec3 axis, dir, emission;
+    f32 one_minus_cos;
+    if(choice == light_count) {
+        glm_vec3_copy(sc->settings.sun_dir, axis);
+        one_minus_cos = sc->settings.sun_one_minus_cos;
+        glm_vec3_copy(sc->settings.sun_radiance, emission);
+    } else {
+        s = sc->spheres+sc->lights[choice];
+        if(!get_light_cone(info->enter_point, s, axis, &one_minus_cos))
+            return false;
+        
+        material_t *light = sc->mats+s->mat_id;
+        glm_vec3_scale(light->emission_color, light->emission_strength, emission);
+    }
+    
+    sample_cone(axis, one_minus_cos, u[0], u[1], dir);
+    f32 cos_theta = glm_vec3_dot(info->norm, dir);
+    if(cos_theta <= 0)
+        return false;
+    
+    f32 light_t = 10000000.0f;
+    if(s && !intersect_sphere_dist(info->enter_point, dir, s, &light_t))
+        return false;
+    
+    f32 light_pdf = get_cone_pdf(one_minus_cos)/choice_count;
+    f32 bsdf_pdf = diffuse*get_cosine_hemisphere_pdf(cos_theta);
+    f32 weight = get_mis_weight(light_pdf, bsdf_pdf);
+    
+    glm_vec3_copy(info->enter_point, shadow->origin);
+    glm_vec3_copy(dir, shadow->dir);
+    glm_vec3_mul(mat->rgb, r_color, shadow->color);
+    glm_vec3_mul(shadow->color, emission, shadow->color);
+    shadow->weight = diffuse*(1.0f/3.1415926f)*cos_theta*weight/light_pdf;
+    shadow->light_t = light_t;
+    shadow->sun = !s;
+    
+    return true;
 }
 
+// NOTE(ajeej): adds the light of a sample_scene_light sample to final_color
+// if nothing is in the way. The sun is in the way of nothing, so its shadow
+// ray has to miss everything.
 static void
-random_hemisphere_direction(vec3 norm, u32 *state, vec3 dir)
+trace_shadow_ray(scene_t *sc, shadow_ray_t *shadow, vec3 final_color)
 {
-    random_direction(state, dir);
-    if(glm_vec3_dot(dir, norm) < 0)
-        glm_vec3_negate(dir);
+    hit_info_t hit = get_ray_collision(sc, shadow->origin, shadow->dir);
+    if(shadow->sun ? hit.hit : hit.dist < shadow->light_t*0.999f)
+        return;
+    
+    glm_vec3_muladds(shadow->color, shadow->weight, final_color);
 }
 
-/*static void
-get_rand_dir_on_hemisphere(vec3 norm, vec3 dir)
+// NOTE(ajeej): one bounce of the loop in shoot_ray. Adds what the hit or the
+// environment gives to final_color, then either picks the next direction
+// and returns true or returns false once the path ends. For hits u holds
+// the next BOUNCE_DIMS dimensions of the sampler and diffuse_dir the cosine
+// weighted direction around the normal they give, see draw_bounce_sample.
+// bsdf_pdf is the pdf the ray was picked with and gets the one of the next.
+// The light sample of the hit is left in shadow for the caller to trace,
+// whether the path goes on or not.
+static bool
+bounce_ray(scene_t *scene, hit_info_t *info, vec3 origin, vec3 dir,
+           vec3 r_color, vec3 final_color, f32 *bsdf_pdf, f32 *u, vec3 diffuse_dir,
+           shadow_ray_t *shadow)
 {
+    vec3 emission, temp, specular_dir;
+    shadow->weight = 0.0f;
     
-    for(u32 i = 0; i < 3; i++)
-        dir[i] = dist(gen);
+    if(!info->hit)
+    {
+        // NOTE(ajeej): the sun is weighted against sample_scene_light
+        // like the lights below
+        f32 sun_weight = 1.0f;
+        if(*bsdf_pdf > 0 && scene->settings.sun_intensity > 0)
+            sun_weight = get_mis_weight(*bsdf_pdf, get_sun_pdf(scene));
+        
+        get_color_from_environment(&scene->settings, dir, sun_weight, temp);
+        glm_vec3_mul(temp, r_color, temp);
+        glm_vec3_add(final_color, temp, final_color);
+        return false;
+    }
     
-    glm_vec3_normalize(dir);
+    material_t *mat = scene->mats+info->mat_id;
     
-    if(glm_vec3_dot(dir, norm) < 0)
-        glm_vec3_negate(dir);
-}*/
+    // NOTE(ajeej): lights that sample_scene_light could have found at the
+    // last hit are weighted against it
+    f32 weight = 1.0f;
+    if(*bsdf_pdf > 0 && mat->emission_strength > 0)
+        weight = get_mis_weight(*bsdf_pdf, get_light_pdf(scene, origin, info->enter_point));
+    
+    glm_vec3_scale(mat->emission_color, mat->emission_strength*weight, emission);
+    glm_vec3_mul(emission, r_color, temp);
+    glm_vec3_add(final_color, temp, final_color);
+    
+    glm_vec3_copy(info->enter_point, origin);
+    sample_scene_light(scene, info, mat, u+SAMPLER_DIMS, r_color, shadow);
+    
+    // NOTE(ajeej): The smoothness of the material is the chance that the
+    // bounce is specular instead of diffuse. Specular bounces keep the old
+    // mix of the two directions and are never sampled as lights.
+    if(u[3] < mat->smoothness) {
+        glm_vec3_scale(info->norm, -2.0f*glm_vec3_dot(dir, info->norm), specular_dir);
+        glm_vec3_add(dir, specular_dir, specular_dir);
+        glm_vec3_lerp(diffuse_dir, specular_dir, mat->smoothness, dir);
+        glm_vec3_normalize(dir);
+        *bsdf_pdf = 0.0f;
+    } else {
+        glm_vec3_copy(diffuse_dir, dir);
+        *bsdf_pdf = (1.0f - mat->smoothness)*get_cosine_hemisphere_pdf(glm_vec3_dot(info->norm, dir));
+    }
+    
+    // NOTE(ajeej): the cosine of a diffuse bounce cancels with the pdf of
+    // its direction, so what is left of the lambertian brdf is its albedo
+    glm_vec3_mul(r_color, mat->rgb, r_color);
+    
+    f32 p = glm_max(r_color[0], glm_max(r_color[1], r_color[2]));
+    if(u[2] >= p)
+        return false;
+    glm_vec3_scale(r_color, 1.0f/p, r_color);
+    
+    return true;
+}
+
+// NOTE(ajeej): the first two dimensions pick the diffuse direction, the
+// third is for russian roulette and the fourth picks diffuse or specular.
+// The second group is for the light sample. Misses do not use up any
+// dimensions.
+static void
+draw_bounce_sample(hit_info_t *info, sampler_t *smp, f32 *u, vec3 diffuse_dir)
+{
+    if(!info->hit)
+        return;
+    
+    get_sample_dims(smp, u);
+    get_sample_dims(smp, u+SAMPLER_DIMS);
+    sample_cosine_hemisphere(info->norm, u[0], u[1], diffuse_dir);
+}
 
+// NOTE(ajeej): same bounces as the wavefront stages of ray_tracer.glsl, first_hit
+// is the collision of the ray if it is already known
 static void
 shoot_ray(scene_t *scene,
           vec3 r_origin, vec3 r_dir, u32 max_bounce,
-          vec3 final_color, u32 *state)
+          vec3 final_color, sampler_t *smp, hit_info_t *first_hit)
 {
-    vec3 r_color = {1.0f, 1.0f, 1.0f}, emission, temp;
-    vec3 origin, dir;
+    vec3 r_color = {1.0f, 1.0f, 1.0f};
+    vec3 origin, dir, diffuse_dir;
+    f32 u[BOUNCE_DIMS];
+    f32 bsdf_pdf = 0.0f;
+    shadow_ray_t shadow;
     glm_vec3_copy(r_origin, origin);
     glm_vec3_copy(r_dir, dir);
     glm_vec3_zero(final_color);
-    material_t mat;
     
-    for (int i = 0; i < 30; i++)
+    for (u32 i = 0; i < max_bounce; i++)
+    {
+        hit_info_t info = (i == 0 && first_hit) ? *first_hit : get_ray_collision(scene, origin, dir);
+        
+        draw_bounce_sample(&info, smp, u, diffuse_dir);
+        bool alive = bounce_ray(scene, &info, origin, dir, r_color, final_color,
+                                &bsdf_pdf, u, diffuse_dir, &shadow);
+        if(shadow.weight > 0)
+            trace_shadow_ray(scene, &shadow, final_color);
+        if(!alive)
+            break;
+    }
+}
+
+static void
+init_wavefront(wavefront_t *wave)
+{
+    wave->paths = (wave_path_t *)malloc(sizeof(wave_path_t)*WAVEFRONT_SIZE);
+    wave->hits = (hit_info_t *)malloc(sizeof(hit_info_t)*WAVEFRONT_SIZE);
+    wave->queue = (u32 *)malloc(sizeof(u32)*WAVEFRONT_SIZE);
+    wave->keys = (u32 *)malloc(sizeof(u32)*WAVEFRONT_SIZE);
+    wave->shade_queue = (u32 *)malloc(sizeof(u32)*WAVEFRONT_SIZE);
+    wave->alive = (bool *)malloc(sizeof(bool)*WAVEFRONT_SIZE);
+    wave->shadows = (shadow_ray_t *)malloc(sizeof(shadow_ray_t)*WAVEFRONT_SIZE);
+    wave->shadow_queue = (u32 *)malloc(sizeof(u32)*WAVEFRONT_SIZE);
+    wave->buckets = 0;
+    wave->bucket_cap = 0;
+    wave->path_count = 0;
+    wave->queue_count = 0;
+    wave->shadow_count = 0;
+    wave->counter = 0;
+}
+
+static void
+free_wavefront(wavefront_t *wave)
+{
+    free(wave->paths);
+    free(wave->hits);
+    free(wave->queue);
+    free(wave->keys);
+    free(wave->shade_queue);
+    free(wave->alive);
+    free(wave->shadows);
+    free(wave->shadow_queue);
+    free(wave->buckets);
+}
+
+static void
+init_accum_buffer(accum_buffer_t *buf, u32 width, u32 height)
+{
+    buf->width = width;
+    buf->height = height;
+    buf->sample_count = 0;
+    buf->sum = (f32 *)calloc(width*height*3, sizeof(f32));
+    buf->pixels = (f32 *)calloc(width*height*4, sizeof(f32));
+    buf->wave = 0;
+}
+
+static void
+clear_accum_buffer(accum_buffer_t *buf)
+{
+    buf->sample_count = 0;
+    memset(buf->sum, 0, buf->width*buf->height*3*sizeof(f32));
+}
+
+static void
+free_accum_buffer(accum_buffer_t *buf)
+{
+    free(buf->sum);
+    free(buf->pixels);
+    if(buf->wave) {
+        free_wavefront(buf->wave);
+        delete buf->wave;
+    }
+}
+
+static void
+upload_accum_buffer(accum_buffer_t *buf, u32 texture)
+{
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, buf->width, buf->height,
+                    GL_RGBA, GL_FLOAT, buf->pixels);
+}
+
+static bool
+save_accum_buffer(accum_buffer_t *buf, const char *path)
+{
+    cv::Mat frame(buf->height, buf->width, CV_8UC3);
+    
+    // NOTE(ajeej): row 0 of the buffer is the bottom of the image
+    for(u32 y = 0; y < buf->height; y++)
     {
-        hit_info_t info = get_ray_collision(origin, dir, 
-                                            scene->spheres, get_stack_count(scene->spheres));
+        f32 *src = buf->pixels + (buf->height-1-y)*buf->width*4;
+        u8 *dst = frame.ptr<u8>(y);
         
-        if (info.hit)
+        for(u32 x = 0; x < buf->width; x++, src += 4, dst += 3) {
+            dst[0] = (u8)(glm_clamp(src[2], 0.0f, 1.0f)*255);
+            dst[1] = (u8)(glm_clamp(src[1], 0.0f, 1.0f)*255);
+            dst[2] = (u8)(glm_clamp(src[0], 0.0f, 1.0f)*255);
+        }
+    }
+    
+    return cv::imwrite(path, frame);
+}
+
+static void
+get_camera_ray(camera_t *cam, f32 x, f32 y, vec3 dir)
+{
+    f32 x_comp = (2.0f*x - cam->width)/cam->width;
+    f32 y_comp = (2.0f*y - cam->height)/cam->height;
+    
+    glm_vec3_scale(cam->front, -1.0f, dir);
+    glm_vec3_muladds(cam->side, x_comp, dir);
+    glm_vec3_muladds(cam->up, y_comp, dir);
+    glm_vec3_normalize(dir);
+}
+
+// NOTE(ajeej): every sample of a pixel jitters its primary ray inside the
+// pixel with the first dimensions of its sampler. With ray_packets on, the
+// primary rays of one sample of a RAY_PACKET_DIM square of pixels are
+// traced together, every bounce after that is traced on its own. Sample i of
+// a frame is sample frame_id*samples + i of the pixel.
+static void
+render_tile(void *data)
+{
+    render_tile_t *tile = (render_tile_t *)data;
+    camera_t *cam = tile->cam;
+    scene_t *sc = tile->sc;
+    accum_buffer_t *buf = tile->buf;
+    
+    f32 inv_count = 1.0f/(buf->sample_count + tile->samples);
+    u32 dim = sc->settings.ray_packets ? RAY_PACKET_DIM : 1;
+    vec3 dirs[RAY_PACKET_DIM*RAY_PACKET_DIM], color;
+    hit_info_t hits[RAY_PACKET_DIM*RAY_PACKET_DIM];
+    sampler_t samplers[RAY_PACKET_DIM*RAY_PACKET_DIM];
+    f32 u[SAMPLER_DIMS];
+    
+    for(u32 by = tile->y0; by < tile->y1; by += dim)
+    {
+        for(u32 bx = tile->x0; bx < tile->x1; bx += dim)
         {
-            mat = scene->mats[info.mat_id];
+            u32 x1 = MIN(bx + dim, tile->x1), y1 = MIN(by + dim, tile->y1);
+            
+            for(u32 i = 0; i < tile->samples; i++)
+            {
+                u32 count = 0;
+                for(u32 y = by; y < y1; y++)
+                {
+                    for(u32 x = bx; x < x1; x++, count++)
+                    {
+                        init_sampler(samplers+count, sc->settings.sampler, x, y, buf->width,
+                                     (u32)tile->frame_id*tile->samples + i);
+                        get_sample_dims(samplers+count, u);
+                        get_camera_ray(cam, x + u[0], y + u[1], dirs[count]);
+                    }
+                }
+                
+                if(dim > 1)
+                    get_packet_collisions(sc, cam->pos, dirs, count, hits);
+                else
+                    hits[0] = get_ray_collision(sc, cam->pos, dirs[0]);
+                
+                count = 0;
+                for(u32 y = by; y < y1; y++)
+                {
+                    for(u32 x = bx; x < x1; x++, count++)
+                    {
+                        f32 *sum = buf->sum + (y*buf->width + x)*3;
+                        shoot_ray(sc, cam->pos, dirs[count], sc->settings.max_bounce,
+                                  color, samplers+count, hits+count);
+                        glm_vec3_add(sum, color, sum);
+                    }
+                }
+            }
             
-            glm_vec3_copy(info.enter_point, origin);
-            //get_rand_dir_on_hemisphere(info.norm, dir);
-            random_hemisphere_direction(info.norm, state, dir);
+            for(u32 y = by; y < y1; y++)
+            {
+                for(u32 x = bx; x < x1; x++)
+                {
+                    u32 idx = y*buf->width + x;
+                    f32 *pixel = buf->pixels + idx*4;
+                    glm_vec3_scale(buf->sum + idx*3, inv_count, pixel);
+                    pixel[3] = 1.0f;
+                }
+            }
+        }
+    }
+}
+
+// NOTE(ajeej): splits count items into jobs of WAVEFRONT_CHUNK and waits for
+// all of them
+static void
+run_wave_jobs(wavefront_t *wave, thread_pool_t *pool, job_func_t *proc, u32 count)
+{
+    u32 job_count = (count + WAVEFRONT_CHUNK-1)/WAVEFRONT_CHUNK;
+    for(u32 i = 0; i < job_count; i++)
+    {
+        wave_job_t *job = wave->jobs+i;
+        job->wave = wave;
+        job->begin = i*WAVEFRONT_CHUNK;
+        job->end = MIN(job->begin + WAVEFRONT_CHUNK, count);
+        push_job(pool, proc, job, &wave->counter);
+    }
+    
+    wait_for_jobs(pool, &wave->counter);
+}
+
+// NOTE(ajeej): the octant of the direction goes in the top 3 bits and the
+// morton code of the origin inside the scene bounds in the low 27, so rays
+// that point the same way from nearby origins get traced one after another.
+// Sorts the count paths of queue by their next ray, or by their shadow ray
+// if shadows is set.
+static void
+sort_wave_rays(wavefront_t *wave, u32 *queue, u32 count, bool shadows)
+{
+    scene_t *sc = wave->sc;
+    vec3 offset = {0}, scale = {0};
+    if(sc->bvh.node_count) {
+        glm_vec3_copy(sc->bvh.nodes[0].min, offset);
+        for(u32 axis = 0; axis < 3; axis++) {
+            f32 extent = sc->bvh.nodes[0].max[axis] - offset[axis];
+            scale[axis] = (extent > 0) ? 511.0f/extent : 0.0f;
+        }
+    }
+    
+    for(u32 i = 0; i < count; i++)
+    {
+        u32 id = queue[i];
+        f32 *origin = shadows ? wave->shadows[id].origin : wave->paths[id].origin;
+        f32 *dir = shadows ? wave->shadows[id].dir : wave->paths[id].dir;
+        u32 key = 0;
+        for(u32 axis = 0; axis < 3; axis++) {
+            f32 c = (origin[axis] - offset[axis])*scale[axis];
+            u32 q = (u32)MIN(MAX(c, 0.0f), 511.0f);
+            key |= expand_morton_bits(q) << (2-axis);
+            if(dir[axis] < 0)
+                key |= 1u << (29+axis);
+        }
+        wave->keys[i] = key;
+    }
+    
+    radix_sort_morton(wave->keys, queue, count);
+}
+
+static void
+extend_wave_proc(void *data)
+{
+    wave_job_t *job = (wave_job_t *)data;
+    wavefront_t *wave = job->wave;
+    
+    for(u32 i = job->begin; i < job->end; i++) {
+        u32 id = wave->queue[i];
+        wave_path_t *path = wave->paths+id;
+        wave->hits[id] = get_ray_collision(wave->sc, path->origin, path->dir);
+    }
+}
+
+// NOTE(ajeej): the light samples of a path are added after its shade and
+// before the next one, in the same order as shoot_ray adds them
+static void
+connect_wave_proc(void *data)
+{
+    wave_job_t *job = (wave_job_t *)data;
+    wavefront_t *wave = job->wave;
+    
+    for(u32 i = job->begin; i < job->end; i++) {
+        u32 id = wave->shadow_queue[i];
+        trace_shadow_ray(wave->sc, wave->shadows+id, wave->paths[id].radiance);
+    }
+}
+
+// NOTE(ajeej): counting sort of the traced paths by the material they hit,
+// so every shade job mostly works on one material at a time
+static void
+sort_wave_hits(wavefront_t *wave)
+{
+    u32 bucket_count = get_stack_count(wave->sc->mats)+1;
+    if(bucket_count > wave->bucket_cap) {
+        free(wave->buckets);
+        wave->buckets = (u32 *)malloc(sizeof(u32)*bucket_count);
+        wave->bucket_cap = bucket_count;
+    }
+    
+    u32 *offsets = wave->buckets;
+    memset(offsets, 0, sizeof(u32)*bucket_count);
+    
+    for(u32 i = 0; i < wave->queue_count; i++) {
+        hit_info_t *hit = wave->hits+wave->queue[i];
+        offsets[hit->hit ? hit->mat_id : bucket_count-1]++;
+    }
+    
+    u32 sum = 0;
+    for(u32 b = 0; b < bucket_count; b++) {
+        u32 c = offsets[b];
+        offsets[b] = sum;
+        sum += c;
+    }
+    
+    for(u32 i = 0; i < wave->queue_count; i++) {
+        u32 id = wave->queue[i];
+        hit_info_t *hit = wave->hits+id;
+        wave->shade_queue[offsets[hit->hit ? hit->mat_id : bucket_count-1]++] = id;
+    }
+}
+
+// NOTE(ajeej): the diffuse directions of 8 paths are drawn at once, lanes of
+// paths that missed keep a made up normal and are never read
+static void
+shade_wave_proc(void *data)
+{
+    wave_job_t *job = (wave_job_t *)data;
+    wavefront_t *wave = job->wave;
+    scene_t *sc = wave->sc;
+    
+    f32 u[8][BOUNCE_DIMS];
+    f32 u0[8], u1[8];
+    f32 norm[3][8], dirs[3][8];
+    
+    for(u32 begin = job->begin; begin < job->end; begin += 8)
+    {
+        u32 count = MIN(8, job->end - begin);
+        for(u32 i = 0; i < 8; i++)
+        {
+            hit_info_t *hit = (i < count) ? wave->hits+wave->shade_queue[begin+i] : NULL;
+            if(hit && hit->hit) {
+                sampler_t *smp = &wave->paths[wave->shade_queue[begin+i]].sampler;
+                get_sample_dims(smp, u[i]);
+                get_sample_dims(smp, u[i]+SAMPLER_DIMS);
+                for(u32 axis = 0; axis < 3; axis++)
+                    norm[axis][i] = hit->norm[axis];
+            } else {
+                u[i][0] = u[i][1] = 0.0f;
+                norm[0][i] = norm[1][i] = 0.0f;
+                norm[2][i] = 1.0f;
+            }
+            u0[i] = u[i][0];
+            u1[i] = u[i][1];
+        }
+        
+        sample_cosine_hemisphere8(norm[0], norm[1], norm[2], u0, u1, dirs[0], dirs[1], dirs[2]);
+        
+        for(u32 i = 0; i < count; i++)
+        {
+            u32 id = wave->shade_queue[begin+i];
+            wave_path_t *path = wave->paths+id;
+            vec3 diffuse_dir = {dirs[0][i], dirs[1][i], dirs[2][i]};
             
-            glm_vec3_scale(mat.emission_color, mat.emission_strength, emission);
-            glm_vec3_mul(emission, r_color, temp);
-            glm_vec3_add(final_color, temp, final_color);
-            glm_vec3_mul(r_color, mat.rgb, r_color);
+            bool alive = bounce_ray(sc, wave->hits+id, path->origin, path->dir,
+                                    path->color, path->radiance, &path->bsdf_pdf, u[i], diffuse_dir,
+                                    wave->shadows+id);
+            wave->alive[id] = alive && ++path->bounce < sc->settings.max_bounce;
+        }
+    }
+}
+
+// NOTE(ajeej): path i of the wave is sample i%samples of pixel
+// wave->first_pixel + i/samples, and jitters its primary ray with the first
+// dimensions of its sampler like render_tile. With ray_packets on, runs of
+// paths (the samples of a pixel, then the next pixels along the row) are
+// traced as one packet.
+static void
+generate_wave_proc(void *data)
+{
+    wave_job_t *job = (wave_job_t *)data;
+    wavefront_t *wave = job->wave;
+    scene_t *sc = wave->sc;
+    camera_t *cam = wave->cam;
+    u32 samples = wave->samples;
+    u32 packet_size = sc->settings.ray_packets ? BVH_PACKET_SIZE : 1;
+    u32 path_end = job->end*samples;
+    
+    vec3 dirs[BVH_PACKET_SIZE];
+    hit_info_t hits[BVH_PACKET_SIZE];
+    f32 u[SAMPLER_DIMS];
+    
+    for(u32 begin = job->begin*samples; begin < path_end; begin += packet_size)
+    {
+        u32 count = MIN(packet_size, path_end - begin);
+        for(u32 i = 0; i < count; i++)
+        {
+            u32 id = begin + i;
+            u32 pixel = wave->first_pixel + id/samples;
+            u32 x = pixel % cam->width, y = pixel / cam->width;
             
-            //glm_vec3_copy(mat.rgb, final_color);
+            wave_path_t *path = wave->paths + id;
+            init_sampler(&path->sampler, sc->settings.sampler, x, y, cam->width,
+                         (u32)wave->frame_id*samples + id%samples);
+            get_sample_dims(&path->sampler, u);
+            get_camera_ray(cam, x + u[0], y + u[1], dirs[i]);
         }
+        
+        if(count > 1)
+            get_packet_collisions(sc, cam->pos, dirs, count, hits);
         else
-            break;
+            hits[0] = get_ray_collision(sc, cam->pos, dirs[0]);
+        
+        for(u32 i = 0; i < count; i++)
+        {
+            u32 id = begin + i;
+            wave_path_t *path = wave->paths + id;
+            glm_vec3_copy(cam->pos, path->origin);
+            glm_vec3_copy(dirs[i], path->dir);
+            glm_vec3_one(path->color);
+            glm_vec3_zero(path->radiance);
+            path->bsdf_pdf = 0.0f;
+            path->pixel = wave->first_pixel + id/samples;
+            path->bounce = 0;
+            wave->hits[id] = hits[i];
+            wave->queue[id] = id;
+        }
+    }
+}
+
+// NOTE(ajeej): streaming version of render_tile. Up to WAVEFRONT_SIZE paths
+// are in flight and every bounce goes through the same stages for all of
+// them: the hits are sorted by material and shaded (shade), the shadow rays
+// of the light samples shade made are sorted and traced and the light of
+// the ones that get through is added to their paths (connect), and the
+// rays of the paths that go on are sorted and traced (extend). The radiance
+// of every path is added to the image once the wave is done.
+static void
+render_wavefront(camera_t *cam, scene_t *sc, thread_pool_t *pool,
+                 accum_buffer_t *buf, u32 samples, u64 frame_id)
+{
+    if(!buf->wave) {
+        buf->wave = new wavefront_t;
+        init_wavefront(buf->wave);
     }
     
-    //glm_vec3_clamp(final_color, 0.0f, 1.0f);
-}
\ No newline at end of file
+    wavefront_t *wave = buf->wave;
+    wave->sc = sc;
+    wave->cam = cam;
+    wave->samples = MIN(samples, WAVEFRONT_SIZE);
+    wave->frame_id = frame_id;
+    
+    u32 pixel_count = buf->width*buf->height;
+    u32 wave_pixels = WAVEFRONT_SIZE/wave->samples;
+    
+    for(u32 first = 0; first < pixel_count; first += wave_pixels)
+    {
+        u32 count = MIN(wave_pixels, pixel_count - first);
+        wave->first_pixel = first;
+        wave->path_count = count*wave->samples;
+        wave->queue_count = sc->settings.max_bounce ? wave->path_count : 0;
+        if(wave->queue_count)
+            run_wave_jobs(wave, pool, generate_wave_proc, count);
+        
+        while(wave->queue_count)
+        {
+            sort_wave_hits(wave);
+            run_wave_jobs(wave, pool, shade_wave_proc, wave->queue_count);
+            
+            wave->shadow_count = 0;
+            for(u32 i = 0; i < wave->queue_count; i++)
+                if(wave->shadows[wave->shade_queue[i]].weight > 0)
+                    wave->shadow_queue[wave->shadow_count++] = wave->shade_queue[i];
+            
+            sort_wave_rays(wave, wave->shadow_queue, wave->shadow_count, true);
+            run_wave_jobs(wave, pool, connect_wave_proc, wave->shadow_count);
+            
+            // NOTE(ajeej): the paths that go on keep the order they were
+            // shaded in
+            u32 alive_count = 0;
+            for(u32 i = 0; i < wave->queue_count; i++)
+                if(wave->alive[wave->shade_queue[i]])
+                    wave->queue[alive_count++] = wave->shade_queue[i];
+            wave->queue_count = alive_count;
+            
+            sort_wave_rays(wave, wave->queue, wave->queue_count, false);
+            run_wave_jobs(wave, pool, extend_wave_proc, wave->queue_count);
+        }
+        
+        for(u32 i = 0; i < wave->path_count; i++) {
+            wave_path_t *path = wave->paths+i;
+            f32 *sum = buf->sum + path->pixel*3;
+            glm_vec3_add(sum, path->radiance, sum);
+        }
+    }
+    
+    f32 inv_count = 1.0f/(buf->sample_count + samples);
+    for(u32 i = 0; i < pixel_count; i++) {
+        glm_vec3_scale(buf->sum + i*3, inv_count, buf->pixels + i*4);
+        buf->pixels[i*4+3] = 1.0f;
+    }
+}
+
+// NOTE(ajeej): cpu counterpart of render_scene, the image is split into
+// tiles that are spread over the thread pool and accumulated into buf
+static void
+render_scene_cpu(camera_t *cam, scene_t *sc, thread_pool_t *pool,
+                 accum_buffer_t *buf, u64 frame_id)
+{
+    if(sc->moving || frame_id <= 1)
+        clear_accum_buffer(buf);
+    
+    update_scene_bvh(sc);
+    
+    u32 samples = sc->settings.samples_per_frame ? sc->settings.samples_per_frame : 1;
+    if(sc->settings.wavefront) {
+        render_wavefront(cam, sc, pool, buf, samples, frame_id);
+        buf->sample_count += samples;
+        return;
+    }
+    
+    u32 tiles_x = (buf->width + TILE_SIZE-1)/TILE_SIZE;
+    u32 tiles_y = (buf->height + TILE_SIZE-1)/TILE_SIZE;
+    render_tile_t *tiles = (render_tile_t *)malloc(sizeof(render_tile_t)*tiles_x*tiles_y);
+    std::atomic<u32> counter(0);
+    
+    for(u32 ty = 0; ty < tiles_y; ty++)
+    {
+        for(u32 tx = 0; tx < tiles_x; tx++)
+        {
+            render_tile_t *tile = tiles + ty*tiles_x + tx;
+            tile->cam = cam;
+            tile->sc = sc;
+            tile->buf = buf;
+            tile->x0 = tx*TILE_SIZE;
+            tile->y0 = ty*TILE_SIZE;
+            tile->x1 = MIN(tile->x0 + TILE_SIZE, buf->width);
+            tile->y1 = MIN(tile->y0 + TILE_SIZE, buf->height);
+            tile->samples = samples;
+            tile->frame_id = frame_id;
+            
+            push_job(pool, render_tile, tile, &counter);
+        }
+    }
+    
+    wait_for_jobs(pool, &counter);
+    buf->sample_count += samples;
+    
+    free(tiles);
+}
@@ -2,6 +2,21 @@
 #ifndef RAY_TRACER_H
 #define RAY_TRACER_H
 
+#define TILE_SIZE 16
+
+// NOTE(ajeej): primary rays are traced in packets of RAY_PACKET_DIM^2 pixels,
+// which has to fit in BVH_PACKET_SIZE
+#define RAY_PACKET_DIM 4
+
+// NOTE(ajeej): paths the wavefront renderer keeps in flight at once, and how
+// many rays or hits one job of a stage works on
+#define WAVEFRONT_SIZE (1 << 14)
+#define WAVEFRONT_CHUNK 256
+
+struct scene_t;
+struct camera_t;
+struct sphere_t;
+
 struct hit_info_t {
     vec3 enter_point, exit_point, norm;
     f32 dist;
@@ -9,4 +24,175 @@ struct hit_info_t {
     bool hit;
 };
 
+// NOTE(ajeej): leaf data of the top level bvh, the prim ids index the
+// spheres first (unless they are in the grid and sphere_count is 0), then
+// the meshes and the shapes from shape_first on. The
+// mesh and triangle of the closest triangle hit so far are kept here.
+struct scene_trace_t {
+    scene_t *sc;
+    u32 sphere_count, shape_first;
+    u32 mesh_id, tri_id;
+};
+
+// NOTE(ajeej): structure of arrays copy of scene_t::spheres for the
+// avx2 intersection kernel in the order they are traced. The spheres of a
+// grid cell or top level leaf whose prims start at ids[first] are one run
+// of lanes from runs[first] on, padded to a multiple of 8. ids maps the
+// lanes back to the spheres, the arrays are 32 byte aligned.
+struct sphere_soa_t {
+    f32 *x, *y, *z, *r;
+    u32 *ids;
+    u32 *runs;
+    u32 lane_count;
+};
+
+// NOTE(ajeej): the spheres go into a uniform grid instead of the top level
+// bvh once there are at least SPHERE_GRID_MIN_SPHERES of them and none has
+// a radius over SPHERE_GRID_MAX_RADIUS_RATIO times the average. The grid
+// gets about SPHERE_GRID_DENSITY cells per sphere. It is filled by chunks
+// of at least SPHERE_GRID_CHUNK spheres, at most SPHERE_GRID_MAX_JOBS of
+// them since every chunk counts the spheres of every cell on its own.
+#define SPHERE_GRID_MIN_SPHERES 4096
+#define SPHERE_GRID_MAX_RADIUS_RATIO 4.0f
+#define SPHERE_GRID_DENSITY 2.0f
+#define SPHERE_GRID_MAX_RES 512
+#define SPHERE_GRID_CHUNK 4096
+#define SPHERE_GRID_MAX_JOBS 16
+
+// NOTE(ajeej): cells are stored x first, then y, then z. The spheres of cell
+// c are prims[cells[c]] up to prims[cells[c+1]], a sphere is in every cell
+// its box overlaps. A grid with no cells is not in use.
+struct sphere_grid_t {
+    aabb_t bounds;
+    vec3 cell_size, inv_cell_size;
+    u32 res[3];
+    u32 cell_count, prim_count;
+    u32 *cells;
+    u32 *prims;
+};
+
+// NOTE(ajeej): one chunk of spheres of the counting sort that fills the
+// grid, counts holds how many spheres of the chunk every cell gets while
+// counting and where the next one of the chunk goes while scattering
+struct sphere_grid_job_t {
+    sphere_grid_t *grid;
+    sphere_t *spheres;
+    u32 *counts;
+    u32 begin, end;
+};
+
+// NOTE(ajeej): sum holds the rgb total of every sample taken so far,
+// pixels holds the rgba average that gets shown or saved
+struct wavefront_t;
+
+// NOTE(ajeej): wave is made by the first wavefront frame and kept until the
+// buffer is freed, so its path arrays are not allocated again every frame
+struct accum_buffer_t {
+    u32 width, height;
+    u32 sample_count;
+    f32 *sum;
+    f32 *pixels;
+    wavefront_t *wave;
+};
+
+// NOTE(ajeej): counter based random numbers, value n of a stream is a hash
+// of key+n so it does not depend on the values before it. The key comes
+// from the pixel, frame and sample, like get_rng_key in ray_tracer.glsl, so a
+// sample gets the same numbers whichever thread or tile traces it.
+struct rng_t {
+    u32 key;
+    u32 counter;
+};
+
+// NOTE(ajeej): kinds of render_settings_t::sampler. Random draws from the
+// rng, sobol is owen scrambled sobol and blue noise is the r4 sequence
+// offset by an r2 mask over the pixels.
+#define SAMPLER_RANDOM 0
+#define SAMPLER_SOBOL 1
+#define SAMPLER_BLUE_NOISE 2
+
+// NOTE(ajeej): dimensions the sampler hands out at once, the pixel jitter
+// takes the first group and every bounce BOUNCE_DIMS after it. The first
+// group of a bounce is for the bsdf and the second for the light sample.
+#define SAMPLER_DIMS 4
+#define BOUNCE_DIMS (2*SAMPLER_DIMS)
+
+// NOTE(ajeej): smallest radius of the sun disk in radians, a point sun
+// would have infinite radiance
+#define SUN_MIN_ANGLE 1E-4f
+
+// NOTE(ajeej): the points of one sample of a pixel, sample_id counts the
+// samples of the pixel over every frame. rng.counter is the next dimension.
+struct sampler_t {
+    u32 type;
+    u32 x, y;
+    u32 sample_id;
+    rng_t rng;
+};
+
+// NOTE(ajeej): a light sample waiting for its shadow ray, color times weight
+// is added if nothing is closer than light_t along dir, or if the ray
+// misses everything for the sun. weight is 0 if there is no sample.
+struct shadow_ray_t {
+    vec3 origin, dir;
+    vec3 color;
+    f32 weight, light_t;
+    bool sun;
+};
+
+struct wave_job_t {
+    wavefront_t *wave;
+    u32 begin, end;
+};
+
+// NOTE(ajeej): state of one path of the wavefront renderer between stages,
+// origin and dir are the ray that gets traced next and bsdf_pdf the pdf dir
+// was picked with, 0 if light sampling could not have found it
+struct wave_path_t {
+    vec3 origin, dir;
+    vec3 color, radiance;
+    f32 bsdf_pdf;
+    u32 pixel;
+    sampler_t sampler;
+    u32 bounce;
+};
+
+// NOTE(ajeej): the wave covers samples paths for every pixel from
+// first_pixel on. queue holds the paths that have a hit to shade or a ray to
+// trace, the rays are sorted by keys before they are traced. shade_queue
+// holds the same paths sorted by the material they hit, with misses last,
+// and alive marks the paths that go on after they are shaded. shadows holds
+// the light sample the last shade left for every path, shadow_queue the
+// paths that have one, sorted like the rays before they are traced. buckets
+// is the scratch of the material sort, it holds bucket_cap counts.
+struct wavefront_t {
+    scene_t *sc;
+    camera_t *cam;
+    u32 samples, first_pixel;
+    u64 frame_id;
+    
+    wave_path_t *paths;
+    hit_info_t *hits;
+    u32 *queue, *keys;
+    u32 *shade_queue;
+    bool *alive;
+    shadow_ray_t *shadows;
+    u32 *shadow_queue;
+    u32 *buckets, bucket_cap;
+    u32 path_count, queue_count, shadow_count;
+    
+    wave_job_t jobs[WAVEFRONT_SIZE/WAVEFRONT_CHUNK];
+    std::atomic<u32> counter;
+};
+
+struct render_tile_t {
+    camera_t *cam;
+    scene_t *sc;
+    accum_buffer_t *buf;
+    
+    u32 x0, y0, x1, y1;
+    u32 samples;
+    u64 frame_id;
+};
+
 #endif //RAY_TRACER_H
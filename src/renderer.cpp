@@ -41,18 +41,227 @@ init_material(material_t *mat, vec3 rgb, vec3 emission_color, f32 emission_stren
     mat->smoothness = smoothness;
 }
 
+// NOTE(ajeej): the programs are only made the first time a mesh bvh is built
+// on the gpu, the scratch buffers when reserve_gpu_lbvh first needs them
+static void
+init_gpu_lbvh(gpu_lbvh_t *lbvh)
+{
+    char *src = load_shader_source("lbvh.glsl");
+    lbvh->bounds_program = create_compute_shader_stage(src, "LBVH_BOUNDS", NULL);
+    lbvh->morton_program = create_compute_shader_stage(src, "LBVH_MORTON", NULL);
+    lbvh->count_program = create_compute_shader_stage(src, "LBVH_SORT_COUNT", NULL);
+    lbvh->scan_program = create_compute_shader_stage(src, "LBVH_SORT_SCAN", NULL);
+    lbvh->scatter_program = create_compute_shader_stage(src, "LBVH_SORT_SCATTER", NULL);
+    lbvh->hierarchy_program = create_compute_shader_stage(src, "LBVH_HIERARCHY", NULL);
+    lbvh->refit_program = create_compute_shader_stage(src, "LBVH_REFIT", NULL);
+    free(src);
+    
+    glGenBuffers(2, lbvh->key_buffers);
+    glGenBuffers(2, lbvh->id_buffers);
+    glGenBuffers(1, &lbvh->hist_buffer);
+    glGenBuffers(1, &lbvh->bounds_buffer);
+    glGenBuffers(1, &lbvh->slot_buffer);
+    glGenBuffers(1, &lbvh->parent_buffer);
+    glGenBuffers(1, &lbvh->flag_buffer);
+    lbvh->capacity = 0;
+    
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, lbvh->bounds_buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(u32)*6, NULL, GL_DYNAMIC_COPY);
+}
+
+static void
+free_gpu_lbvh(gpu_lbvh_t *lbvh)
+{
+    if(!lbvh->bounds_program)
+        return;
+    
+    glDeleteProgram(lbvh->bounds_program);
+    glDeleteProgram(lbvh->morton_program);
+    glDeleteProgram(lbvh->count_program);
+    glDeleteProgram(lbvh->scan_program);
+    glDeleteProgram(lbvh->scatter_program);
+    glDeleteProgram(lbvh->hierarchy_program);
+    glDeleteProgram(lbvh->refit_program);
+    
+    glDeleteBuffers(2, lbvh->key_buffers);
+    glDeleteBuffers(2, lbvh->id_buffers);
+    glDeleteBuffers(1, &lbvh->hist_buffer);
+    glDeleteBuffers(1, &lbvh->bounds_buffer);
+    glDeleteBuffers(1, &lbvh->slot_buffer);
+    glDeleteBuffers(1, &lbvh->parent_buffer);
+    glDeleteBuffers(1, &lbvh->flag_buffer);
+    memset(lbvh, 0, sizeof(*lbvh));
+}
+
+static void
+reserve_gpu_lbvh(gpu_lbvh_t *lbvh, u32 tri_count)
+{
+    if(tri_count <= lbvh->capacity)
+        return;
+    
+    u32 group_count = (tri_count + GPU_LBVH_GROUP_SIZE-1)/GPU_LBVH_GROUP_SIZE;
+    for(u32 i = 0; i < 2; i++) {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, lbvh->key_buffers[i]);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(u32)*tri_count, NULL, GL_DYNAMIC_COPY);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, lbvh->id_buffers[i]);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(u32)*tri_count, NULL, GL_DYNAMIC_COPY);
+    }
+    
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, lbvh->hist_buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(u32)*GPU_LBVH_GROUP_SIZE*group_count, NULL, GL_DYNAMIC_COPY);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, lbvh->slot_buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(u32)*tri_count, NULL, GL_DYNAMIC_COPY);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, lbvh->parent_buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(u32)*2*tri_count, NULL, GL_DYNAMIC_COPY);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, lbvh->flag_buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(u32)*tri_count, NULL, GL_DYNAMIC_COPY);
+    
+    lbvh->capacity = tri_count;
+}
+
+// NOTE(ajeej): builds the bvh of tri_count triangles from tri_first on out of
+// the triangles bound at 3 or the vertices and indices at 12 and 13, into the
+// node and prim buffers bound at 5 and 6. It takes 2*tri_count-1 nodes from
+// node_offset on and tri_count prims from prim_offset on. The morton codes of
+// the centroids are radix sorted 8 bits per pass, then every interior node is
+// emitted on its own and the boxes are fitted from the leaves up, so nothing
+// is read back to the cpu.
+static void
+build_gpu_mesh_bvh(gpu_lbvh_t *lbvh, bool tri_cache, u32 tri_first, u32 tri_count,
+                   u32 node_offset, u32 prim_offset)
+{
+    if(tri_count == 0)
+        return;
+    
+    if(!lbvh->bounds_program)
+        init_gpu_lbvh(lbvh);
+    reserve_gpu_lbvh(lbvh, tri_count);
+    
+    u32 group_count = (tri_count + GPU_LBVH_GROUP_SIZE-1)/GPU_LBVH_GROUP_SIZE;
+    u32 programs[] = {
+        lbvh->bounds_program, lbvh->morton_program,
+        lbvh->count_program, lbvh->scan_program, lbvh->scatter_program,
+        lbvh->hierarchy_program, lbvh->refit_program
+    };
+    for(u32 i = 0; i < ARRAY_COUNT(programs); i++)
+    {
+        u32 program = programs[i];
+        glUseProgram(program);
+        glUniform1ui(glGetUniformLocation(program, "tri_cache"), tri_cache);
+        glUniform1ui(glGetUniformLocation(program, "tri_first"), tri_first);
+        glUniform1ui(glGetUniformLocation(program, "tri_count"), tri_count);
+        glUniform1ui(glGetUniformLocation(program, "node_offset"), node_offset);
+        glUniform1ui(glGetUniformLocation(program, "prim_offset"), prim_offset);
+        glUniform1ui(glGetUniformLocation(program, "group_count"), group_count);
+    }
+    
+    // NOTE(ajeej): an empty box in the ordered uints of lbvh.glsl
+    u32 empty_bounds[6] = {0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0, 0, 0};
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, lbvh->bounds_buffer);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(empty_bounds), empty_bounds);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, lbvh->flag_buffer);
+    glClearBufferSubData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, 0, sizeof(u32)*tri_count,
+                         GL_RED_INTEGER, GL_UNSIGNED_INT, NULL);
+    
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 17, lbvh->key_buffers[0]);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 18, lbvh->id_buffers[0]);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 21, lbvh->hist_buffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 22, lbvh->bounds_buffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 23, lbvh->slot_buffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 24, lbvh->parent_buffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 25, lbvh->flag_buffer);
+    
+    glUseProgram(lbvh->bounds_program);
+    glDispatchCompute(group_count, 1, 1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    
+    glUseProgram(lbvh->morton_program);
+    glDispatchCompute(group_count, 1, 1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    
+    // NOTE(ajeej): the codes have 30 bits, every pass sorts from one side of
+    // the key and id buffers into the other
+    u32 side = 0;
+    for(u32 shift = 0; shift < 32; shift += 8)
+    {
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 17, lbvh->key_buffers[side]);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 18, lbvh->id_buffers[side]);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 19, lbvh->key_buffers[1-side]);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 20, lbvh->id_buffers[1-side]);
+        
+        glUseProgram(lbvh->count_program);
+        glUniform1ui(glGetUniformLocation(lbvh->count_program, "radix_shift"), shift);
+        glDispatchCompute(group_count, 1, 1);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+        
+        glUseProgram(lbvh->scan_program);
+        glDispatchCompute(1, 1, 1);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+        
+        glUseProgram(lbvh->scatter_program);
+        glUniform1ui(glGetUniformLocation(lbvh->scatter_program, "radix_shift"), shift);
+        glDispatchCompute(group_count, 1, 1);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+        
+        side = 1-side;
+    }
+    
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 17, lbvh->key_buffers[side]);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 18, lbvh->id_buffers[side]);
+    
+    glUseProgram(lbvh->hierarchy_program);
+    glDispatchCompute(group_count, 1, 1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    
+    glUseProgram(lbvh->refit_program);
+    glDispatchCompute(group_count, 1, 1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    
+    glUseProgram(0);
+}
+
 static void
 init_scene(scene_t *sc, render_settings_t settings)
 {
     sc->spheres = NULL;
-    sc->triangles = NULL;
+    sc->planes = NULL;
+    sc->shapes = NULL;
+    sc->verts = NULL;
+    sc->indices = NULL;
     sc->mats = NULL;
     sc->meshes = NULL;
+    sc->lights = NULL;
+    memset(&sc->sphere_soa, 0, sizeof(sc->sphere_soa));
+    memset(&sc->sphere_grid, 0, sizeof(sc->sphere_grid));
+    sc->mesh_bvhs = NULL;
+    sc->mesh_bvh8s = NULL;
+    sc->blas_count = 0;
+    memset(&sc->bvh_stats, 0, sizeof(sc->bvh_stats));
+    sc->pool = NULL;
+    sc->tlas_bounds = NULL;
+    sc->moved_meshes = NULL;
+    init_bvh_rebuild(&sc->tlas_rebuild);
+    memset(&sc->bvh, 0, sizeof(sc->bvh));
     sc->settings = settings;
+    prepare_sun_settings(&sc->settings);
     sc->sphere_buffer = 0;
     sc->mat_buffer = 0;
     sc->tri_buffer = 0;
+    sc->tri_attr_buffer = 0;
+    sc->vert_buffer = 0;
+    sc->index_buffer = 0;
+    sc->shape_buffer = 0;
+    sc->grid_cell_buffer = 0;
+    sc->grid_prim_buffer = 0;
     sc->mesh_buffer = 0;
+    sc->bvh_node_buffer = 0;
+    sc->bvh_prim_buffer = 0;
+    sc->gpu_blas_count = 0;
+    sc->gpu_blas_nodes = 0;
+    sc->gpu_blas_prims = 0;
+    sc->gpu_tlas_cap = 0;
+    memset(&sc->gpu_lbvh, 0, sizeof(sc->gpu_lbvh));
+    sc->bvh_dirty = true;
     sc->moving = true;
     sc->clean_frame = true;
     sc->ambient = sc->diffuse = sc->specular = true;
@@ -63,17 +272,65 @@ free_scene(scene_t *sc)
 {
     if(sc->spheres)
         stack_free(sc->spheres);
-    if(sc->triangles)
-        stack_free(sc->triangles);
+    if(sc->planes)
+        stack_free(sc->planes);
+    if(sc->shapes)
+        stack_free(sc->shapes);
+    if(sc->verts)
+        stack_free(sc->verts);
+    if(sc->indices)
+        stack_free(sc->indices);
     if(sc->mats)
         stack_free(sc->mats);
     if(sc->meshes)
         stack_free(sc->meshes);
+    if(sc->lights)
+        stack_free(sc->lights);
+    free_sphere_soa(&sc->sphere_soa);
+    free_sphere_grid(&sc->sphere_grid);
+    if(sc->mesh_bvhs) {
+        for(u32 i = 0; i < get_stack_count(sc->mesh_bvhs); i++)
+            free_bvh(sc->mesh_bvhs+i);
+        stack_free(sc->mesh_bvhs);
+    }
+    if(sc->mesh_bvh8s) {
+        for(u32 i = 0; i < get_stack_count(sc->mesh_bvh8s); i++)
+            free_bvh8(sc->mesh_bvh8s+i);
+        stack_free(sc->mesh_bvh8s);
+    }
+    free_bvh(&sc->bvh);
+    cancel_bvh_rebuild(&sc->tlas_rebuild);
+    if(sc->tlas_bounds)
+        free(sc->tlas_bounds);
+    if(sc->moved_meshes)
+        stack_free(sc->moved_meshes);
     
-    glDeleteBuffers(1, &sc->sphere_buffer);
-    glDeleteBuffers(1, &sc->mat_buffer);
-    glDeleteBuffers(1, &sc->tri_buffer);
-    glDeleteBuffers(1, &sc->mesh_buffer);
+    // NOTE(ajeej): the buffers only exist if the scene was set up for the gpu
+    if(sc->sphere_buffer)
+        glDeleteBuffers(1, &sc->sphere_buffer);
+    if(sc->mat_buffer)
+        glDeleteBuffers(1, &sc->mat_buffer);
+    if(sc->tri_buffer)
+        glDeleteBuffers(1, &sc->tri_buffer);
+    if(sc->tri_attr_buffer)
+        glDeleteBuffers(1, &sc->tri_attr_buffer);
+    if(sc->vert_buffer)
+        glDeleteBuffers(1, &sc->vert_buffer);
+    if(sc->index_buffer)
+        glDeleteBuffers(1, &sc->index_buffer);
+    if(sc->shape_buffer)
+        glDeleteBuffers(1, &sc->shape_buffer);
+    if(sc->grid_cell_buffer)
+        glDeleteBuffers(1, &sc->grid_cell_buffer);
+    if(sc->grid_prim_buffer)
+        glDeleteBuffers(1, &sc->grid_prim_buffer);
+    if(sc->mesh_buffer)
+        glDeleteBuffers(1, &sc->mesh_buffer);
+    if(sc->bvh_node_buffer)
+        glDeleteBuffers(1, &sc->bvh_node_buffer);
+    if(sc->bvh_prim_buffer)
+        glDeleteBuffers(1, &sc->bvh_prim_buffer);
+    free_gpu_lbvh(&sc->gpu_lbvh);
 }
 
 static void
@@ -81,6 +338,79 @@ add_sphere(scene_t *sc, vec3 pos, f32 r, u32 mat_id)
 {
     sphere_t *s = (sphere_t *)stack_push(&sc->spheres);
     init_sphere(s, pos, r, mat_id);
+    sc->bvh_dirty = true;
+}
+
+static shape_t *
+push_shape(STACK(shape_t) **shapes, u32 type, vec3 pos, vec3 u, vec3 v, u32 mat_id)
+{
+    shape_t *s = (shape_t *)stack_push(shapes);
+    glm_vec3_copy(pos, s->pos);
+    glm_vec3_copy(u, s->u);
+    glm_vec3_copy(v, s->v);
+    s->type = type;
+    s->mat_id = mat_id;
+    s->p0 = 0.0f;
+    return s;
+}
+
+// NOTE(ajeej): infinite plane through pos, seen from the side norm points to
+static void
+add_plane(scene_t *sc, vec3 pos, vec3 norm, u32 mat_id)
+{
+    shape_t *s = push_shape(&sc->planes, SHAPE_PLANE, pos, norm, vec3{0.0f, 0.0f, 0.0f}, mat_id);
+    glm_vec3_normalize(s->u);
+}
+
+// NOTE(ajeej): rectangle around center with the half edges u and v, seen
+// from the side cross(u, v) points to
+static void
+add_quad(scene_t *sc, vec3 center, vec3 u, vec3 v, u32 mat_id)
+{
+    push_shape(&sc->shapes, SHAPE_QUAD, center, u, v, mat_id);
+    sc->bvh_dirty = true;
+}
+
+// NOTE(ajeej): disk of radius r around center, seen from the side norm
+// points to. The two radii are picked so that cross(u, v) is along norm.
+static void
+add_disk(scene_t *sc, vec3 center, vec3 norm, f32 r, u32 mat_id)
+{
+    vec3 n, u, v;
+    glm_vec3_normalize_to(norm, n);
+    
+    vec3 axis = {1.0f, 0.0f, 0.0f};
+    if(fabsf(n[0]) > 0.9f)
+        glm_vec3_copy(vec3{0.0f, 1.0f, 0.0f}, axis);
+    
+    glm_vec3_cross(n, axis, u);
+    glm_vec3_normalize(u);
+    glm_vec3_cross(n, u, v);
+    glm_vec3_scale(u, r, u);
+    glm_vec3_scale(v, r, v);
+    
+    push_shape(&sc->shapes, SHAPE_DISK, center, u, v, mat_id);
+    sc->bvh_dirty = true;
+}
+
+// NOTE(ajeej): axis aligned box between min and max
+static void
+add_box(scene_t *sc, vec3 min, vec3 max, u32 mat_id)
+{
+    push_shape(&sc->shapes, SHAPE_BOX, min, max, vec3{0.0f, 0.0f, 0.0f}, mat_id);
+    sc->bvh_dirty = true;
+}
+
+// NOTE(ajeej): a moved mesh only needs the top level bvh to be refitted,
+// moving the same mesh again before that is not added twice
+static void
+mark_mesh_moved(scene_t *sc, u32 mesh_id)
+{
+    u32 *last = get_stack_last(sc->moved_meshes);
+    if(last && *last == mesh_id)
+        return;
+    
+    *(u32 *)stack_push(&sc->moved_meshes) = mesh_id;
 }
 
 static void
@@ -88,6 +418,7 @@ move_mesh(scene_t *sc, u32 mesh_id, vec3 delta)
 {
     mesh_t *mesh = sc->meshes+mesh_id;
     glm_vec3_add(mesh->pos, delta, mesh->pos);
+    mark_mesh_moved(sc, mesh_id);
 }
 
 static void
@@ -95,6 +426,7 @@ set_mesh_pos(scene_t *sc, u32 mesh_id, vec3 pos)
 {
     mesh_t *mesh = sc->meshes+mesh_id;
     glm_vec3_copy(pos, mesh->pos);
+    mark_mesh_moved(sc, mesh_id);
 }
 
 static void
@@ -104,6 +436,7 @@ rotate_mesh(scene_t *sc, u32 mesh_id, f32 angle, vec3 axis)
     versor rotation;
     glm_quatv(rotation, angle, axis);
     glm_quat_mul(mesh->rot, rotation, mesh->rot);
+    mark_mesh_moved(sc, mesh_id);
 }
 
 static void
@@ -111,6 +444,7 @@ set_mesh_rot(scene_t *sc, u32 mesh_id, f32 angle, vec3 axis)
 {
     mesh_t *mesh = sc->meshes+mesh_id;
     glm_quatv(mesh->rot, angle, axis);
+    mark_mesh_moved(sc, mesh_id);
 }
 
 static void
@@ -118,6 +452,7 @@ scale_mesh(scene_t *sc, u32 mesh_id, vec3 scale)
 {
     mesh_t *mesh = sc->meshes+mesh_id;
     glm_vec3_copy(scale, mesh->scale);
+    mark_mesh_moved(sc, mesh_id);
 }
 
 static void
@@ -127,56 +462,60 @@ scale_mesh(scene_t *sc, u32 mesh_id, f32 scale)
     mesh->scale[0] = scale;
     mesh->scale[1] = scale;
     mesh->scale[2] = scale;
+    mark_mesh_moved(sc, mesh_id);
 }
 
+// NOTE(ajeej): the vertices are added to the shared pool once and the
+// indices are moved to where they ended up in it
 static u32
 add_mesh(scene_t *sc, 
-         f32 *verts, u32 *indices, u32 idx_count, u32 mat_id)
+         f32 *verts, u32 vert_count, u32 *indices, u32 idx_count, u32 mat_id)
 {
-    triangle_t *tri;
     u32 mesh_id = get_stack_count(sc->meshes);
     mesh_t *mesh = (mesh_t *)stack_push(&sc->meshes);
-    u32 tri_count = idx_count/3;
+    u32 first_vert = get_stack_count(sc->verts)/3;
     
     glm_vec3_zero(mesh->pos);
     glm_quat_identity(mesh->rot);
     glm_vec3_one(mesh->scale);
     
-    mesh->tri_idx = get_stack_count(sc->triangles);
-    mesh->tri_count = tri_count;
+    mesh->tri_idx = get_stack_count(sc->indices)/3;
+    mesh->tri_count = idx_count/3;
     mesh->mat_id = mat_id;
+    mesh->bvh_root = 0;
+    mesh->blas_id = sc->blas_count++;
     
-    for(u32 i = 0; i < tri_count; i++)
-    {
-        tri = (triangle_t *)stack_push(&sc->triangles);
-        
-        memcpy(tri->v0, verts+(*indices++)*3, 3*sizeof(f32));
-        memcpy(tri->v1, verts+(*indices++)*3, 3*sizeof(f32));
-        memcpy(tri->v2, verts+(*indices++)*3, 3*sizeof(f32));
-    }
+    f32 *dst_verts = (f32 *)stack_push_array(&sc->verts, vert_count*3);
+    memcpy(dst_verts, verts, sizeof(f32)*vert_count*3);
+    
+    // NOTE(ajeej): the indices of the mesh start at its first vertex
+    u32 *dst_indices = (u32 *)stack_push_array(&sc->indices, mesh->tri_count*3);
+    memcpy(dst_indices, indices, sizeof(u32)*mesh->tri_count*3);
+    for(u32 i = 0; i < mesh->tri_count*3; i++)
+        dst_indices[i] += first_vert;
+    
+    sc->bvh_dirty = true;
     
     return mesh_id;
 }
 
+// NOTE(ajeej): places the triangles of an existing mesh again with its own
+// transform and material, nothing but the mesh_t is added
 static u32
-add_plane(scene_t *sc, u32 mat_id, f32 w, f32 h)
+add_instance(scene_t *sc, u32 src_id, vec3 pos, versor rot, vec3 scale, u32 mat_id)
 {
-    f32 verts[] = {
-        -1, -1, 0,
-        -1,  1, 0,
-        1,  -1, 0,
-        1,   1, 0
-    };
+    u32 mesh_id = get_stack_count(sc->meshes);
+    mesh_t *mesh = (mesh_t *)stack_push(&sc->meshes);
+    *mesh = sc->meshes[src_id];
     
-    u32 indices[] = {
-        0, 1, 2,
-        1, 3, 2,
-    };
+    glm_vec3_copy(pos, mesh->pos);
+    glm_quat_copy(rot, mesh->rot);
+    glm_vec3_copy(scale, mesh->scale);
+    mesh->mat_id = mat_id;
     
-    u32 id = add_mesh(sc, verts, indices, ARRAY_COUNT(indices), mat_id);
-    scale_mesh(sc, id, vec3{w, h, 0.0f});
+    sc->bvh_dirty = true;
     
-    return id;
+    return mesh_id;
 }
 
 static u32
@@ -189,100 +528,538 @@ add_material(scene_t *sc, vec3 rgb, vec3 emission_color, f32 emission_strength,
     return id;
 }
 
+// NOTE(ajeej): the compute shader gets all bvhs in one node buffer with
+// absolute indices, so first is moved by where the nodes and prims of
+// this bvh end up
 static void
-setup_scene(camera_t *cam, scene_t *sc, u32 compute_program)
+copy_gpu_bvh_nodes(bvh_t *bvh, bvh_node_t *out, u32 node_offset, u32 prim_offset)
 {
-    glGenBuffers(1, &sc->sphere_buffer);
-    glBindBuffer(GL_SHADER_STORAGE_BUFFER, sc->sphere_buffer);
-    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(sphere_t)*get_stack_count(sc->spheres), sc->spheres, GL_DYNAMIC_COPY);
-    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, sc->sphere_buffer);
+    for(u32 i = 0; i < bvh->node_count; i++) {
+        out[i] = bvh->nodes[i];
+        out[i].first += (out[i].count) ? prim_offset : node_offset;
+    }
+}
+
+// NOTE(ajeej): threaded layout for the stackless traversal. The nodes are
+// stored depth first with the left child right after its parent, so the
+// next node after a hit interior node or any leaf is always the next one in
+// the array. Interior nodes keep the node that comes after their subtree
+// (where a miss goes on) in first instead of their left child. The subtree
+// of the root ends at node_offset+node_count.
+static void
+copy_gpu_threaded_bvh_nodes(bvh_t *bvh, bvh_node_t *out, u32 node_offset, u32 prim_offset)
+{
+    if(bvh->node_count == 0)
+        return;
     
-    glGenBuffers(1, &sc->mat_buffer);
-    glBindBuffer(GL_SHADER_STORAGE_BUFFER, sc->mat_buffer);
-    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(material_t)*get_stack_count(sc->mats), sc->mats, GL_DYNAMIC_COPY);
-    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, sc->mat_buffer);
+    // NOTE(ajeej): first pass finds where every node ends up, the second one
+    // hands every node the place its miss link points to
+    u32 *order = (u32 *)malloc(sizeof(u32)*bvh->node_count);
+    u32 *stack = (u32 *)malloc(sizeof(u32)*2*bvh->node_count);
+    u32 stack_count = 0, pos = 0;
+    
+    stack[stack_count++] = 0;
+    while(stack_count)
+    {
+        u32 node_idx = stack[--stack_count];
+        bvh_node_t *node = bvh->nodes+node_idx;
+        order[node_idx] = pos++;
+        if(node->count == 0) {
+            stack[stack_count++] = node->first+1;
+            stack[stack_count++] = node->first;
+        }
+    }
+    
+    stack[stack_count++] = 0;
+    stack[stack_count++] = bvh->node_count;
+    while(stack_count)
+    {
+        u32 miss = stack[--stack_count];
+        u32 node_idx = stack[--stack_count];
+        bvh_node_t *node = bvh->nodes+node_idx;
+        bvh_node_t *dst = out+order[node_idx];
+        
+        *dst = *node;
+        if(node->count) {
+            dst->first += prim_offset;
+            continue;
+        }
+        
+        dst->first = miss + node_offset;
+        stack[stack_count++] = node->first+1;
+        stack[stack_count++] = miss;
+        stack[stack_count++] = node->first;
+        stack[stack_count++] = order[node->first+1];
+    }
+    
+    free(order);
+    free(stack);
+}
+
+// NOTE(ajeej): nodes go to binding 5 and prims to binding 6. The bottom
+// level bvhs come first and are only uploaded again once meshes with new
+// triangles were added, the top level after them gets room for its largest
+// possible size so moving a mesh only replaces that part. Instances point
+// at the bottom level bvh of the mesh they share it with. The nodes are in
+// the threaded layout if the shader was built for stackless traversal. With
+// gpu_bvh the bottom level bvhs are built in place by build_gpu_mesh_bvh
+// and only the top level is uploaded.
+static void
+upload_scene_bvh(scene_t *sc, gpu_wavefront_t *wave)
+{
+    bvh_t *tlas = &sc->bvh;
+    u32 sphere_count = get_tlas_sphere_count(sc);
+    u32 mesh_count = get_stack_count(sc->meshes);
+    u32 shape_first = sphere_count + mesh_count;
+    u32 plane_count = get_stack_count(sc->planes);
+    u32 tlas_cap = 2*tlas->prim_count;
+    
+    u32 blas_count = get_stack_count(sc->mesh_bvhs);
+    gpu_bvh_copy_func_t *copy_nodes =
+        (sc->settings.stackless) ? copy_gpu_threaded_bvh_nodes : copy_gpu_bvh_nodes;
+    
+    bool full = (!sc->bvh_node_buffer || sc->gpu_blas_count != blas_count ||
+                 sc->gpu_tlas_cap < tlas_cap);
+    
+    // NOTE(ajeej): where every bottom level bvh starts in the buffers and
+    // the first triangle of the meshes that use it. The ones the gpu builds
+    // take the 2n-1 nodes of a tree with one triangle per leaf.
+    u32 *blas_roots = (u32 *)malloc(sizeof(u32)*MAX(blas_count, 1));
+    u32 *blas_firsts = (u32 *)malloc(sizeof(u32)*MAX(blas_count, 1));
+    u32 *blas_tris = (u32 *)malloc(sizeof(u32)*MAX(blas_count, 1));
+    u32 blas_nodes = 0, blas_prims = 0;
+    for(u32 i = 0; i < blas_count; i++) {
+        bvh_t *blas = sc->mesh_bvhs+i;
+        blas_roots[i] = blas_nodes;
+        blas_firsts[i] = blas_prims;
+        if(sc->settings.gpu_bvh)
+            blas_nodes += (blas->prim_count) ? 2*blas->prim_count-1 : 0;
+        else
+            blas_nodes += blas->node_count;
+        blas_prims += blas->prim_count;
+    }
+    for(u32 i = 0; i < mesh_count; i++) {
+        mesh_t *mesh = sc->meshes+i;
+        mesh->bvh_root = blas_roots[mesh->blas_id];
+        blas_tris[mesh->blas_id] = mesh->tri_idx;
+    }
     
-    glGenBuffers(1, &sc->tri_buffer);
+    if(full)
+    {
+        sc->gpu_blas_nodes = blas_nodes;
+        sc->gpu_blas_prims = blas_prims;
+        sc->gpu_blas_count = blas_count;
+        sc->gpu_tlas_cap = tlas_cap;
+    }
+    
+    // NOTE(ajeej): the bottom level bvhs are only copied from the cpu when
+    // they were built there
+    bool cpu_blas = (full && !sc->settings.gpu_bvh);
+    u32 first_node = (cpu_blas) ? 0 : sc->gpu_blas_nodes;
+    u32 first_prim = (cpu_blas) ? 0 : sc->gpu_blas_prims;
+    u32 node_count = sc->gpu_blas_nodes + sc->gpu_tlas_cap - first_node;
+    u32 prim_count = sc->gpu_blas_prims + tlas->prim_count - first_prim;
+    
+    bvh_node_t *nodes = (bvh_node_t *)calloc(MAX(node_count, 1), sizeof(bvh_node_t));
+    u32 *prims = (u32 *)malloc(sizeof(u32)*MAX(prim_count, 1));
+    
+    if(cpu_blas)
+    {
+        for(u32 i = 0; i < blas_count; i++)
+        {
+            bvh_t *blas = sc->mesh_bvhs+i;
+            copy_nodes(blas, nodes+blas_roots[i], blas_roots[i], blas_firsts[i]);
+            for(u32 j = 0; j < blas->prim_count; j++)
+                prims[blas_firsts[i]+j] = blas_tris[i] + blas->prim_ids[j];
+        }
+    }
+    
+    copy_nodes(tlas, nodes+sc->gpu_blas_nodes-first_node,
+               sc->gpu_blas_nodes, sc->gpu_blas_prims);
+    for(u32 i = 0; i < tlas->prim_count; i++) {
+        u32 id = tlas->prim_ids[i], prim = id;
+        if(id >= shape_first)
+            prim = (plane_count + id-shape_first) | BVH_SHAPE_PRIM;
+        else if(id >= sphere_count)
+            prim = (id-sphere_count) | BVH_MESH_PRIM;
+        prims[sc->gpu_blas_prims-first_prim+i] = prim;
+    }
+    
+    if(full) {
+        if(!sc->bvh_node_buffer)
+            glGenBuffers(1, &sc->bvh_node_buffer);
+        if(!sc->bvh_prim_buffer)
+            glGenBuffers(1, &sc->bvh_prim_buffer);
+        
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, sc->bvh_node_buffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(bvh_node_t)*(sc->gpu_blas_nodes + sc->gpu_tlas_cap),
+                     (cpu_blas) ? nodes : NULL, GL_DYNAMIC_COPY);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, sc->bvh_prim_buffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(u32)*(sc->gpu_blas_prims + tlas->prim_count),
+                     (cpu_blas) ? prims : NULL, GL_DYNAMIC_COPY);
+    }
+    if(!cpu_blas) {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, sc->bvh_node_buffer);
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, sizeof(bvh_node_t)*first_node,
+                        sizeof(bvh_node_t)*tlas->node_count, nodes);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, sc->bvh_prim_buffer);
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, sizeof(u32)*first_prim,
+                        sizeof(u32)*tlas->prim_count, prims);
+    }
+    
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, sc->bvh_node_buffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, sc->bvh_prim_buffer);
+    
+    if(full && sc->settings.gpu_bvh)
+        for(u32 i = 0; i < blas_count; i++)
+            build_gpu_mesh_bvh(&sc->gpu_lbvh, sc->settings.tri_cache, blas_tris[i],
+                               sc->mesh_bvhs[i].prim_count, blas_roots[i], blas_firsts[i]);
+    
+    // NOTE(ajeej): extend traces the paths and shade the shadow rays
+    u32 programs[] = {wave->extend_program, wave->shade_program};
+    for(u32 i = 0; i < ARRAY_COUNT(programs); i++) {
+        glUseProgram(programs[i]);
+        glUniform1ui(glGetUniformLocation(programs[i], "bvh_root"), sc->gpu_blas_nodes);
+        glUniform1ui(glGetUniformLocation(programs[i], "bvh_node_count"), tlas->node_count);
+    }
+    
+    free(blas_roots);
+    free(blas_firsts);
+    free(blas_tris);
+    free(prims);
+    free(nodes);
+}
+
+// NOTE(ajeej): the shared vertices and indices go to bindings 12 and 13.
+// With tri_cache the first vertex, edges and normal of every triangle are
+// worked out once and uploaded as well, the hot part to binding 3 and the
+// normals to binding 11, so the shader does not have to gather vertices.
+// Without it the cache buffers are left at one element so they can still
+// be bound.
+static void
+upload_scene_triangles(scene_t *sc)
+{
+    u32 tri_count = get_stack_count(sc->indices)/3;
+    u32 cache_count = (sc->settings.tri_cache) ? tri_count : 0;
+    triangle_t *tris = (triangle_t *)calloc(MAX(cache_count, 1), sizeof(triangle_t));
+    triangle_attr_t *attrs = (triangle_attr_t *)calloc(MAX(cache_count, 1), sizeof(triangle_attr_t));
+    
+    bvh_tri_mesh_t mesh = {sc->verts, sc->indices};
+    for(u32 i = 0; i < cache_count; i++) {
+        get_bvh_mesh_tri(&mesh, i, tris[i].v0, tris[i].e1, tris[i].e2);
+        glm_vec3_cross(tris[i].e1, tris[i].e2, attrs[i].norm);
+    }
+    
+    if(!sc->tri_buffer)
+        glGenBuffers(1, &sc->tri_buffer);
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, sc->tri_buffer);
-    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(triangle_t)*get_stack_count(sc->triangles), sc->triangles, GL_DYNAMIC_COPY);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(triangle_t)*MAX(cache_count, 1), tris, GL_STATIC_DRAW);
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, sc->tri_buffer);
     
-    glGenBuffers(1, &sc->mesh_buffer);
-    glBindBuffer(GL_SHADER_STORAGE_BUFFER, sc->mesh_buffer);
+    if(!sc->tri_attr_buffer)
+        glGenBuffers(1, &sc->tri_attr_buffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, sc->tri_attr_buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(triangle_attr_t)*MAX(cache_count, 1), attrs, GL_STATIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 11, sc->tri_attr_buffer);
+    
+    if(!sc->vert_buffer)
+        glGenBuffers(1, &sc->vert_buffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, sc->vert_buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(f32)*MAX(get_stack_count(sc->verts), 1), sc->verts, GL_STATIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 12, sc->vert_buffer);
+    
+    if(!sc->index_buffer)
+        glGenBuffers(1, &sc->index_buffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, sc->index_buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(u32)*MAX(get_stack_count(sc->indices), 1), sc->indices, GL_STATIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 13, sc->index_buffer);
+    
+    free(tris);
+    free(attrs);
+}
+
+static void
+init_gpu_wavefront(gpu_wavefront_t *wave, const char *src, u32 width, u32 height,
+                   bool stackless)
+{
+    // NOTE(ajeej): only extend and the shadow rays of shade traverse the bvh
+    const char *traversal = (stackless) ? "BVH_STACKLESS" : NULL;
+    wave->generate_program = create_compute_shader_stage(src, "WAVE_GENERATE", NULL);
+    wave->extend_program = create_compute_shader_stage(src, "WAVE_EXTEND", traversal);
+    wave->shade_program = create_compute_shader_stage(src, "WAVE_SHADE", traversal);
+    wave->accumulate_program = create_compute_shader_stage(src, "WAVE_ACCUMULATE", NULL);
+    
+    wave->width = width;
+    wave->height = height;
+    wave->capacity = width*height;
+    
+    glGenBuffers(1, &wave->ray_buffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, wave->ray_buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(gpu_wave_ray_t)*2*wave->capacity, NULL, GL_DYNAMIC_COPY);
+    
+    glGenBuffers(1, &wave->hit_buffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, wave->hit_buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(gpu_hit_record_t)*wave->capacity, NULL, GL_DYNAMIC_COPY);
+    
+    gpu_wave_queue_t queues[2] = {};
+    glGenBuffers(1, &wave->queue_buffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, wave->queue_buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(queues), queues, GL_DYNAMIC_COPY);
     
-    glUseProgram(compute_program);
-    glUniform1ui(glGetUniformLocation(compute_program, "perspective"), cam->perspective);
-    glUniform1ui(glGetUniformLocation(compute_program, "sphere_count"), get_stack_count(sc->spheres));
-    glUniform1ui(glGetUniformLocation(compute_program, "mesh_count"), get_stack_count(sc->meshes));
-    glUniform1ui(glGetUniformLocation(compute_program, "max_bounce"), sc->settings.max_bounce);
+    glGenBuffers(1, &wave->radiance_buffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, wave->radiance_buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(vec4)*wave->capacity, NULL, GL_DYNAMIC_COPY);
+}
+
+static void
+free_gpu_wavefront(gpu_wavefront_t *wave)
+{
+    glDeleteProgram(wave->generate_program);
+    glDeleteProgram(wave->extend_program);
+    glDeleteProgram(wave->shade_program);
+    glDeleteProgram(wave->accumulate_program);
     
-    glUniform3f(glGetUniformLocation(compute_program, "horizon_color"), 
-                sc->settings.horizon_color[0], sc->settings.horizon_color[1], sc->settings.horizon_color[2]);
-    glUniform3f(glGetUniformLocation(compute_program, "zenith_color"),
-                sc->settings.zenith_color[0], sc->settings.zenith_color[1], sc->settings.zenith_color[2]);
-    glUniform3f(glGetUniformLocation(compute_program, "ground_color"), 
-                sc->settings.ground_color[0], sc->settings.ground_color[1], sc->settings.ground_color[2]);
+    glDeleteBuffers(1, &wave->ray_buffer);
+    glDeleteBuffers(1, &wave->hit_buffer);
+    glDeleteBuffers(1, &wave->queue_buffer);
+    glDeleteBuffers(1, &wave->radiance_buffer);
+}
+
+// NOTE(ajeej): every stage gets every uniform, the ones a stage does not use
+// have no location and are ignored
+static void
+set_gpu_scene_uniforms(camera_t *cam, scene_t *sc, gpu_wavefront_t *wave)
+{
+    sphere_grid_t *grid = &sc->sphere_grid;
+    u32 programs[] = {
+        wave->generate_program, wave->extend_program,
+        wave->shade_program, wave->accumulate_program
+    };
+    for(u32 i = 0; i < ARRAY_COUNT(programs); i++)
+    {
+        u32 program = programs[i];
+        glUseProgram(program);
+        glUniform1ui(glGetUniformLocation(program, "perspective"), cam->perspective);
+        glUniform1ui(glGetUniformLocation(program, "sphere_count"), get_stack_count(sc->spheres));
+        glUniform1ui(glGetUniformLocation(program, "plane_count"), get_stack_count(sc->planes));
+        glUniform1ui(glGetUniformLocation(program, "mesh_count"), get_stack_count(sc->meshes));
+        glUniform1ui(glGetUniformLocation(program, "light_count"), get_stack_count(sc->lights));
+        glUniform1ui(glGetUniformLocation(program, "max_bounce"), sc->settings.max_bounce);
+        glUniform2i(glGetUniformLocation(program, "screen_size"), wave->width, wave->height);
+        glUniform1ui(glGetUniformLocation(program, "ray_capacity"), wave->capacity);
+        glUniform1ui(glGetUniformLocation(program, "tri_cache"), sc->settings.tri_cache);
+        glUniform1ui(glGetUniformLocation(program, "sampler_type"), sc->settings.sampler);
+        glUniform1ui(glGetUniformLocation(program, "sample_count"), GPU_SAMPLES_PER_FRAME);
+        
+        glUniform1ui(glGetUniformLocation(program, "grid_cell_count"), grid->cell_count);
+        glUniform3ui(glGetUniformLocation(program, "grid_res"), grid->res[0], grid->res[1], grid->res[2]);
+        glUniform3f(glGetUniformLocation(program, "grid_min"),
+                    grid->bounds.min[0], grid->bounds.min[1], grid->bounds.min[2]);
+        glUniform3f(glGetUniformLocation(program, "grid_max"),
+                    grid->bounds.max[0], grid->bounds.max[1], grid->bounds.max[2]);
+        glUniform3f(glGetUniformLocation(program, "grid_cell_size"),
+                    grid->cell_size[0], grid->cell_size[1], grid->cell_size[2]);
+        
+        glUniform3f(glGetUniformLocation(program, "horizon_color"), 
+                    sc->settings.horizon_color[0], sc->settings.horizon_color[1], sc->settings.horizon_color[2]);
+        glUniform3f(glGetUniformLocation(program, "zenith_color"),
+                    sc->settings.zenith_color[0], sc->settings.zenith_color[1], sc->settings.zenith_color[2]);
+        glUniform3f(glGetUniformLocation(program, "ground_color"), 
+                    sc->settings.ground_color[0], sc->settings.ground_color[1], sc->settings.ground_color[2]);
+        glUniform3f(glGetUniformLocation(program, "sun_dir"),
+                    sc->settings.sun_dir[0], sc->settings.sun_dir[1], sc->settings.sun_dir[2]);
+        glUniform3f(glGetUniformLocation(program, "sun_radiance"),
+                    sc->settings.sun_radiance[0], sc->settings.sun_radiance[1], sc->settings.sun_radiance[2]);
+        glUniform1f(glGetUniformLocation(program, "sun_one_minus_cos"), sc->settings.sun_one_minus_cos);
+        glUniform1f(glGetUniformLocation(program, "sun_cone_pdf"), sc->settings.sun_cone_pdf);
+        glUniform1f(glGetUniformLocation(program, "sun_intensity"), sc->settings.sun_intensity);
+    }
     
     glUseProgram(0);
 }
 
+// NOTE(ajeej): uploads everything of the scene but the meshes and the
+// bvh. The buffers are only made the first time, after that they are
+// refilled, so this runs again whenever the bvh was rebuilt for objects that
+// were added.
 static void
-render_frame(camera_t *cam, scene_t *sc, u32 compute_program,
-             u32 texture, u64 frame_id)
+upload_scene_prims(scene_t *sc)
 {
-    glUseProgram(compute_program);
+    // NOTE(ajeej): the planes go first in the shape buffer and the shader
+    // tests the first plane_count shapes with every ray
+    u32 plane_count = get_stack_count(sc->planes);
+    u32 shape_count = get_stack_count(sc->shapes);
+    if(!sc->shape_buffer)
+        glGenBuffers(1, &sc->shape_buffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, sc->shape_buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(shape_t)*MAX(plane_count+shape_count, 1), NULL, GL_STATIC_DRAW);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(shape_t)*plane_count, sc->planes);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, sizeof(shape_t)*plane_count, sizeof(shape_t)*shape_count, sc->shapes);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 14, sc->shape_buffer);
+    
+    if(!sc->mat_buffer)
+        glGenBuffers(1, &sc->mat_buffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, sc->mat_buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(material_t)*get_stack_count(sc->mats), sc->mats, GL_DYNAMIC_COPY);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, sc->mat_buffer);
+    
+    upload_scene_triangles(sc);
+    
+    // NOTE(ajeej): the cell starts of the sphere grid go to binding 15 and
+    // the sphere ids of the cells to binding 16
+    sphere_grid_t *grid = &sc->sphere_grid;
+    if(!sc->grid_cell_buffer)
+        glGenBuffers(1, &sc->grid_cell_buffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, sc->grid_cell_buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(u32)*(grid->cell_count+1), grid->cells, GL_STATIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 15, sc->grid_cell_buffer);
     
-    glUniform1ui(glGetUniformLocation(compute_program, "perspective"), cam->perspective);
-    glUniform3f(glGetUniformLocation(compute_program, "camera_pos"), cam->pos[0], cam->pos[1], cam->pos[2]);
-    glUniform3f(glGetUniformLocation(compute_program, "forward"), cam->front[0], cam->front[1], cam->front[2]);
-    glUniform3f(glGetUniformLocation(compute_program, "right"), cam->side[0], cam->side[1], cam->side[2]);
-    glUniform3f(glGetUniformLocation(compute_program, "up"), cam->up[0], cam->up[1], cam->up[2]);
+    if(!sc->grid_prim_buffer)
+        glGenBuffers(1, &sc->grid_prim_buffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, sc->grid_prim_buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(u32)*MAX(grid->prim_count, 1), grid->prims, GL_STATIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 16, sc->grid_prim_buffer);
+    
+    // NOTE(ajeej): the emissive spheres rebuild_scene_bvh found are copied
+    // again after the spheres of the scene, light sampling reads them from
+    // there since the shader is out of storage blocks for a light buffer
+    u32 sphere_count = get_stack_count(sc->spheres);
+    u32 light_count = get_stack_count(sc->lights);
+    if(!sc->sphere_buffer)
+        glGenBuffers(1, &sc->sphere_buffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, sc->sphere_buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(sphere_t)*MAX(sphere_count+light_count, 1), NULL, GL_DYNAMIC_COPY);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(sphere_t)*sphere_count, sc->spheres);
+    for(u32 i = 0; i < light_count; i++)
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, sizeof(sphere_t)*(sphere_count+i), sizeof(sphere_t),
+                        sc->spheres+sc->lights[i]);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, sc->sphere_buffer);
+}
+
+static void
+setup_scene(camera_t *cam, scene_t *sc, gpu_wavefront_t *wave)
+{
+    glGenBuffers(1, &sc->mesh_buffer);
     
-    glUniform1ui(glGetUniformLocation(compute_program, "frame_count"), frame_id);
+    if(sc->bvh_dirty)
+        rebuild_scene_bvh(sc);
+    upload_scene_prims(sc);
+    upload_scene_bvh(sc, wave);
     
+    set_gpu_scene_uniforms(cam, sc, wave);
+}
+
+// NOTE(ajeej): a full rebuild means objects were added, so everything
+// setup_scene uploaded and the counts in the uniforms are sent again. A
+// refit or a swapped in background rebuild only changes the bvh.
+static void
+sync_scene_bvh(camera_t *cam, scene_t *sc, gpu_wavefront_t *wave)
+{
+    bool rebuilt = sc->bvh_dirty;
+    if(!update_scene_bvh(sc))
+        return;
+    
+    if(rebuilt)
+        upload_scene_prims(sc);
+    upload_scene_bvh(sc, wave);
+    if(rebuilt)
+        set_gpu_scene_uniforms(cam, sc, wave);
+}
+
+// NOTE(ajeej): camera uniforms of the generate stage and the mesh transforms
+static void
+update_gpu_frame(camera_t *cam, scene_t *sc, gpu_wavefront_t *wave)
+{
+    u32 program = wave->generate_program;
+    glUseProgram(program);
+    
+    glUniform1ui(glGetUniformLocation(program, "perspective"), cam->perspective);
+    glUniform3f(glGetUniformLocation(program, "camera_pos"), cam->pos[0], cam->pos[1], cam->pos[2]);
+    glUniform3f(glGetUniformLocation(program, "forward"), cam->front[0], cam->front[1], cam->front[2]);
+    glUniform3f(glGetUniformLocation(program, "right"), cam->side[0], cam->side[1], cam->side[2]);
+    glUniform3f(glGetUniformLocation(program, "up"), cam->up[0], cam->up[1], cam->up[2]);
+    
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, sc->mesh_buffer);
     glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(mesh_t)*get_stack_count(sc->meshes), sc->meshes, GL_DYNAMIC_COPY);
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, sc->mesh_buffer);
+}
+
+// NOTE(ajeej): renders GPU_SAMPLES_PER_FRAME samples of every pixel into
+// texture. Every sample is generated, then extended and shaded once per
+// bounce. Extend and shade are dispatched with the work group counts shade
+// wrote into the queue, so paths that ended early cost nothing.
+static void
+dispatch_gpu_wavefront(scene_t *sc, gpu_wavefront_t *wave, u32 texture, u64 frame_id)
+{
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, wave->ray_buffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 8, wave->hit_buffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 9, wave->queue_buffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 10, wave->radiance_buffer);
+    glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, wave->queue_buffer);
+    
+    i32 sample_loc = glGetUniformLocation(wave->generate_program, "sample_index");
+    i32 extend_queue_loc = glGetUniformLocation(wave->extend_program, "queue_in");
+    i32 shade_queue_loc = glGetUniformLocation(wave->shade_program, "queue_in");
+    
+    glUseProgram(wave->generate_program);
+    glUniform1ui(glGetUniformLocation(wave->generate_program, "frame_count"), frame_id);
+    
+    for(u32 i = 0; i < GPU_SAMPLES_PER_FRAME; i++)
+    {
+        glUseProgram(wave->generate_program);
+        glUniform1ui(sample_loc, i);
+        glDispatchCompute((wave->width+7)/8, (wave->height+7)/8, 1);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT);
+        
+        for(u32 bounce = 0; bounce < sc->settings.max_bounce; bounce++)
+        {
+            u32 queue_in = bounce & 1;
+            
+            glUseProgram(wave->extend_program);
+            glUniform1ui(extend_queue_loc, queue_in);
+            glDispatchComputeIndirect(sizeof(gpu_wave_queue_t)*queue_in);
+            glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT);
+            
+            glUseProgram(wave->shade_program);
+            glUniform1ui(shade_queue_loc, queue_in);
+            glDispatchComputeIndirect(sizeof(gpu_wave_queue_t)*queue_in);
+            glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT);
+        }
+    }
     
+    glUseProgram(wave->accumulate_program);
+    glUniform1ui(glGetUniformLocation(wave->accumulate_program, "sample_count"), GPU_SAMPLES_PER_FRAME);
     glBindImageTexture(0, texture, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
-    glDispatchCompute(cam->width/8, cam->height/8, 1);
+    glDispatchCompute((wave->width+7)/8, (wave->height+7)/8, 1);
     glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+}
+
+static void
+render_frame(camera_t *cam, scene_t *sc, gpu_wavefront_t *wave,
+             u32 texture, u64 frame_id)
+{
+    sync_scene_bvh(cam, sc, wave);
+    update_gpu_frame(cam, sc, wave);
+    
+    dispatch_gpu_wavefront(sc, wave, texture, frame_id);
     
     glUseProgram(0);
 }
 
 static void
-render_scene(camera_t *cam, scene_t *sc, u32 compute_program, u32 blend_program,
+render_scene(camera_t *cam, scene_t *sc, gpu_wavefront_t *wave, u32 blend_program,
              u32 texture, u32 new_texture, u64 frame_id)
 {
-    glUseProgram(compute_program);
-    
-    glUniform1ui(glGetUniformLocation(compute_program, "perspective"), cam->perspective);
-    glUniform3f(glGetUniformLocation(compute_program, "camera_pos"), cam->pos[0], cam->pos[1], cam->pos[2]);
-    glUniform3f(glGetUniformLocation(compute_program, "forward"), cam->front[0], cam->front[1], cam->front[2]);
-    glUniform3f(glGetUniformLocation(compute_program, "right"), cam->side[0], cam->side[1], cam->side[2]);
-    glUniform3f(glGetUniformLocation(compute_program, "up"), cam->up[0], cam->up[1], cam->up[2]);
+    sync_scene_bvh(cam, sc, wave);
+    update_gpu_frame(cam, sc, wave);
     
     if(sc->moving)
     {
-        glUniform1ui(glGetUniformLocation(compute_program, "frame_count"), frame_id);
-        
-        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(mesh_t)*get_stack_count(sc->meshes), sc->meshes, GL_DYNAMIC_COPY);
-        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, sc->mesh_buffer);
-        
-        glBindImageTexture(0, texture, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
-        glDispatchCompute(cam->width/8, cam->height/8, 1);
-        glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+        dispatch_gpu_wavefront(sc, wave, texture, frame_id);
     }
     else
     {
-        glUniform1ui(glGetUniformLocation(compute_program, "frame_count"), frame_id);
-        
-        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(mesh_t)*get_stack_count(sc->meshes), sc->meshes, GL_DYNAMIC_COPY);
-        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, sc->mesh_buffer);
-        
-        glBindImageTexture(0, new_texture, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
-        glDispatchCompute(cam->width/8, cam->height/8, 1);
-        glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+        dispatch_gpu_wavefront(sc, wave, new_texture, frame_id);
         
         glUseProgram(0);
         
@@ -297,82 +1074,46 @@ render_scene(camera_t *cam, scene_t *sc, u32 compute_program, u32 blend_program,
     glUseProgram(0);
 }
 
-/*static void
-blend_images(u8 *base, u8 *over, u32 size, f32 w)
-{
-    u32 av;
-    
-    for(u32 i = 0; i < size; i++) {
-        if(*base == *over) {
-            *base++; *over++;
-        }
-        else {
-            av = (u32)*base * (1-w) + (u32)*over++ * w;
-            *base++ = (u8)MAX(MIN(av, 255), 0);
-        }
-    }
-}
-
+// NOTE(ajeej): renders the scene frames times with the stack based and then
+// the stackless bvh traversal and prints the time per frame of both, after
+// one untimed frame each for the uploads and shader compilation. Both use
+// the same frame ids so they trace the same rays. The scene is left set up
+// for the stackless traversal. Run it with LIBGL_ALWAYS_SOFTWARE=1 to
+// measure mesa llvmpipe.
 static void
-render_scene(camera_t *cam, scene_t *scene, u8 **out_img, u64 frame_id)
+benchmark_gpu_traversal(camera_t *cam, scene_t *sc, const char *src,
+                        u32 texture, u32 frames)
 {
-    vec3 o, p, temp, step_x, step_y, p_first, dir;
-    f32 dx, dy;
-    u32 x, y, i, j;
-    u8 *img = (u8 *)malloc(cam->width*cam->height*3), *iter;
-    memset(img, 0, cam->width*cam->height*3);
-    
-    sphere_t *objs = scene->spheres;
-    
-    // NOTE(ajeej): calculate position of first pixel
-    glm_vec3_scale(cam->front, cam->near_plane, o);
-    glm_vec3_add(o, cam->pos, o);
-    
-    dx = (1.0f - cam->width)*0.5f*cam->p_width;
-    dy = -(1.0f - cam->height)*0.5f*cam->p_height;
-    glm_vec3_scale(cam->side, dx, temp);
-    glm_vec3_scale(cam->up, dy, p);
-    glm_vec3_addadd(o, temp, p);
-    
-    // NOTE(ajeej): Generate step vectors
-    glm_vec3_scale(cam->side, cam->p_width, step_x);
-    glm_vec3_scale(cam->up, -cam->p_height, step_y);
-    
-    // NOTE(ajeej): Iterate through screen
-    iter= img;
-    for(y = 0; y < cam->height; y++)
+    for(u32 variant = 0; variant < 2; variant++)
     {
-        glm_vec3_copy(p, p_first);
+        gpu_wavefront_t wave;
+        init_gpu_wavefront(&wave, src, cam->width, cam->height, variant == 1);
+        sc->settings.stackless = (variant == 1);
         
-        for(x = 0; x < cam->width; x++)
-        {
-            glm_vec3_sub(p, cam->pos, dir);
-            glm_vec3_normalize(dir);
-            
-            u32 state = (cam->width*y+x) * frame_id * 793123;
-            
-            
-            vec3 color = {0.0f, 0.0f, 0.0f};
-            vec3 total_color = {0.0f, 0.0f, 0.0f};
-            u32 rays_per_pixel = 100;
-            
-            for(int i = 0; i < rays_per_pixel; i++) {
-                shoot_ray(scene, p, dir, 30, color, &state);
-                glm_vec3_add(total_color, color, total_color);
-            }
-            
-            glm_vec3_scale(total_color, 1.0f/rays_per_pixel, color);
-            glm_vec3_clamp(color, 0.0f, 1.0f);
-            
-            for(j = 0; j < 3; j++)
-                *(iter++) = color[j]*255;
-            
-            glm_vec3_add(p, step_x, p);
+        // NOTE(ajeej): the second run only needs the bvh in its layout and
+        // the uniforms of its own programs
+        if(variant == 0)
+            setup_scene(cam, sc, &wave);
+        else {
+            sc->gpu_tlas_cap = 0;
+            upload_scene_bvh(sc, &wave);
+            set_gpu_scene_uniforms(cam, sc, &wave);
         }
         
-        glm_vec3_copy(p_first, p);
-        glm_vec3_add(p, step_y, p);
+        render_frame(cam, sc, &wave, texture, 1);
+        glFinish();
+        
+        timer_t timer;
+        init_timer(&timer);
+        start_timer(&timer);
+        for(u32 i = 0; i < frames; i++)
+            render_frame(cam, sc, &wave, texture, i+2);
+        glFinish();
+        end_timer(&timer);
+        
+        printf("bvh traversal %s: %u frames, %.2f ms per frame\n",
+               (variant == 1) ? "stackless" : "stack", frames,
+               timer.nanos_elapsed/1E6/MAX(frames, 1));
+        free_gpu_wavefront(&wave);
     }
-    
-    *out_img = img;
-}*/
\ No newline at end of file
+}
@@ -16,21 +16,53 @@ struct sphere_t {
     f32 padding[3];
 };
 
+// NOTE(ajeej): kinds of analytic shapes, what pos, u and v of a shape_t
+// hold depends on it:
+// plane: a point on the plane and its unit normal in u
+// quad:  the center and the two half edges, which are at right angles
+// disk:  the center and two radii at right angles
+// box:   the min corner and the max corner in u
+#define SHAPE_PLANE 0
+#define SHAPE_QUAD 1
+#define SHAPE_DISK 2
+#define SHAPE_BOX 3
+
+// NOTE(ajeej): planes, quads and disks are only hit from the front, the side
+// cross(u, v) (the normal for planes) points to, like the front faces of
+// triangles. Boxes are only hit from outside.
+struct shape_t {
+    vec3 pos;
+    u32 type;
+    vec3 u;
+    u32 mat_id;
+    vec3 v;
+    f32 p0;
+};
+
+// NOTE(ajeej): the part of a triangle that gets tested for every ray, the
+// first vertex and the two edges leaving it in object space. 48 bytes so
+// four fit in three cache lines. Meshes are stored indexed, these are only
+// made for the compute shader when render_settings_t::tri_cache is set.
 struct triangle_t {
     vec3 v0;
     f32 p0;
-    vec3 v1;
+    vec3 e1;
     f32 p1;
-    vec3 v2;
+    vec3 e2;
     f32 p2;
-    vec3 n0;
-    f32 p3;
-    vec3 n1;
-    f32 p4;
-    vec3 n2;
-    f32 p5;
 };
 
+// NOTE(ajeej): the part of a triangle that is only read for the closest hit,
+// kept apart from triangle_t so traversal does not pull it into the cache.
+// norm is the unnormalized cross product of the edges.
+struct triangle_attr_t {
+    vec3 norm;
+    f32 p0;
+};
+
+// NOTE(ajeej): instances made with add_instance share the triangles and
+// the bottom level bvh (blas_id indexes scene_t::mesh_bvhs) of the mesh
+// they were made from and only have their own transform and material
 struct mesh_t {
     vec3 pos;
     f32 p0;
@@ -39,7 +71,73 @@ struct mesh_t {
     u32 tri_idx;
     u32 tri_count;
     u32 mat_id;
-    f32 p[2];
+    
+    // NOTE(ajeej): index of the root of the bottom level bvh in the node
+    // buffer of the compute shader, only set by upload_scene_bvh
+    u32 bvh_root;
+    u32 blas_id;
+};
+
+// NOTE(ajeej): top level prims for the compute shader are sphere indices,
+// mesh indices with BVH_MESH_PRIM set or indices into the shape buffer
+// with BVH_SHAPE_PRIM set
+#define BVH_MESH_PRIM 0x80000000
+#define BVH_SHAPE_PRIM 0x40000000
+
+// NOTE(ajeej): copies a bvh into the gpu node buffer, either as it is or in
+// the threaded layout of the stackless traversal
+typedef void gpu_bvh_copy_func_t(bvh_t *bvh, bvh_node_t *out, u32 node_offset, u32 prim_offset);
+
+// NOTE(ajeej): work group size of lbvh.glsl, which is also the number of
+// digits of every pass of its radix sort
+#define GPU_LBVH_GROUP_SIZE 256
+
+// NOTE(ajeej): programs and scratch buffers of the compute shader lbvh
+// builder. The key and id buffers are the two sides of the radix sort, the
+// scratch buffers hold at least capacity triangles.
+struct gpu_lbvh_t {
+    u32 bounds_program, morton_program;
+    u32 count_program, scan_program, scatter_program;
+    u32 hierarchy_program, refit_program;
+    u32 key_buffers[2], id_buffers[2];
+    u32 hist_buffer, bounds_buffer, slot_buffer, parent_buffer, flag_buffer;
+    u32 capacity;
+};
+
+// NOTE(ajeej): samples every pixel gets per frame on the gpu, each one is a
+// separate pass through the wavefront pipeline
+#define GPU_SAMPLES_PER_FRAME 100
+
+// NOTE(ajeej): WaveRay, HitRecord and WaveQueue in ray_tracer.glsl
+struct gpu_wave_ray_t {
+    vec3 origin;
+    u32 pixel;
+    vec3 dir;
+    u32 sample_id;
+    vec3 color;
+    u32 rng_counter;
+    f32 bsdf_pdf;
+    u32 p0, p1, p2;
+};
+
+struct gpu_hit_record_t {
+    vec3 point;
+    f32 dist;
+    vec3 norm;
+    u32 mat_id;
+};
+
+struct gpu_wave_queue_t {
+    u32 groups_x, groups_y, groups_z;
+    u32 count;
+};
+
+// NOTE(ajeej): programs and buffers of the wavefront pipeline, ray_buffer
+// holds the two ray queues of capacity rays back to back
+struct gpu_wavefront_t {
+    u32 generate_program, extend_program, shade_program, accumulate_program;
+    u32 ray_buffer, hit_buffer, queue_buffer, radiance_buffer;
+    u32 width, height, capacity;
 };
 
 struct camera_t {
@@ -56,19 +154,76 @@ struct camera_t {
 
 struct render_settings_t {
     u32 max_bounce;
+    u32 samples_per_frame;
+    u32 bvh_preset;
+    bool ray_packets;
+    bool wavefront;
+    bool tri_cache;
+    bool stackless;
+    bool gpu_bvh;
+    u32 sampler;
     vec3 horizon_color;
     vec3 zenith_color;
     vec3 ground_color;
+    
+    // NOTE(ajeej): the sun is a disk sun_angle radians in radius around
+    // sun_dir past the sky, it is off while sun_intensity is 0. sun_intensity
+    // is the light it gives a surface that faces it, so the size of the disk
+    // only changes how soft the shadows are.
+    vec3 sun_dir;
+    f32 sun_angle;
+    vec3 sun_color;
+    f32 sun_intensity;
+    
+    // NOTE(ajeej): worked out from the sun settings by init_scene
+    vec3 sun_radiance;
+    f32 sun_one_minus_cos;
+    f32 sun_cone_pdf;
 };
 
 struct scene_t {
     STACK(sphere_t) *spheres;
-    STACK(triangle_t) *triangles;
+    
+    // NOTE(ajeej): planes are infinite so they are tested by every ray
+    // instead of going into the top level bvh with the other shapes
+    STACK(shape_t) *planes;
+    STACK(shape_t) *shapes;
+    
+    // NOTE(ajeej): three floats per vertex and three vertex indices per
+    // triangle, shared by every mesh
+    STACK(f32) *verts;
+    STACK(u32) *indices;
+    
     STACK(material_t) *mats;
     STACK(mesh_t) *meshes;
     
+    // NOTE(ajeej): indices of the spheres with an emissive material, which
+    // are sampled directly at every bounce. Rebuilt with the bvh.
+    STACK(u32) *lights;
+    
+    sphere_soa_t sphere_soa;
+    sphere_grid_t sphere_grid;
+    STACK(bvh_t) *mesh_bvhs;
+    STACK(bvh8_t) *mesh_bvh8s;
+    u32 blas_count;
+    bvh_t bvh;
+    bvh_build_stats_t bvh_stats;
+    thread_pool_t *pool;
+    
+    // NOTE(ajeej): bounds of the top level prims and the meshes that moved
+    // since the top level bvh was last refitted
+    aabb_t *tlas_bounds;
+    STACK(u32) *moved_meshes;
+    bvh_rebuild_t tlas_rebuild;
+    
     render_settings_t settings;
-    u32 sphere_buffer, mat_buffer, tri_buffer, mesh_buffer;
+    u32 sphere_buffer, mat_buffer, tri_buffer, tri_attr_buffer, mesh_buffer;
+    u32 vert_buffer, index_buffer, shape_buffer;
+    u32 grid_cell_buffer, grid_prim_buffer;
+    u32 bvh_node_buffer, bvh_prim_buffer;
+    u32 gpu_blas_count, gpu_blas_nodes, gpu_blas_prims, gpu_tlas_cap;
+    gpu_lbvh_t gpu_lbvh;
+    bool bvh_dirty;
     bool moving, clean_frame;
     bool ambient, diffuse, specular;
 };
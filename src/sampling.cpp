@@ -0,0 +1,175 @@
+
+// NOTE(ajeej): the directions of sampling.cpp and their pdfs, every
+// kernel maps two uniforms in [0, 1) to a unit vector. sample_cosine_hemisphere
+// in ray_tracer.glsl makes the same directions on the gpu.
+
+// NOTE(ajeej): orthonormal basis around the unit vector n (duff et al. 2017)
+static void
+get_onb(vec3 n, vec3 t, vec3 b)
+{
+    f32 sign = copysignf(1.0f, n[2]);
+    f32 a = -1.0f/(sign + n[2]);
+    f32 c = n[0]*n[1]*a;
+    t[0] = 1.0f + sign*n[0]*n[0]*a;
+    t[1] = sign*c;
+    t[2] = -sign*n[0];
+    b[0] = c;
+    b[1] = sign + n[1]*n[1]*a;
+    b[2] = -n[1];
+}
+
+// NOTE(ajeej): sine and cosine of turns*2pi for turns in [0, 1). The
+// angle is folded into [-pi/4, pi/4] where short taylor series are good
+// to about a float ulp. The lanes of sample_cosine_hemisphere8 take the
+// same steps, so both give the same bits unless the compiler fuses the
+// multiply adds of one of them.
+static void
+sin_cos_turns(f32 turns, f32 *s, f32 *c)
+{
+    f32 q = floorf(4.0f*turns + 0.5f);
+    f32 x = (turns - 0.25f*q)*(2*3.1415926f);
+    f32 x2 = x*x;
+    f32 ps = x*(1.0f + x2*(-1.0f/6.0f + x2*(1.0f/120.0f + x2*(-1.0f/5040.0f))));
+    f32 pc = 1.0f + x2*(-0.5f + x2*(1.0f/24.0f + x2*(-1.0f/720.0f + x2*(1.0f/40320.0f))));
+    
+    u32 quadrant = (u32)q;
+    *s = (quadrant & 1) ? pc : ps;
+    *c = (quadrant & 1) ? ps : pc;
+    if(quadrant & 2)
+        *s = -*s;
+    if((quadrant + 1) & 2)
+        *c = -*c;
+}
+
+// NOTE(ajeej): malley's method, a uniform point on the disk lifted onto the
+// hemisphere around norm, so the pdf is cos/pi
+static void
+sample_cosine_hemisphere(vec3 norm, f32 u0, f32 u1, vec3 dir)
+{
+    vec3 t, b;
+    get_onb(norm, t, b);
+    
+    f32 s, c;
+    sin_cos_turns(u1, &s, &c);
+    f32 r = sqrtf(u0);
+    f32 z = sqrtf(MAX(0.0f, 1.0f - u0));
+    glm_vec3_scale(norm, z, dir);
+    glm_vec3_muladds(t, r*c, dir);
+    glm_vec3_muladds(b, r*s, dir);
+}
+
+static f32
+get_cosine_hemisphere_pdf(f32 cos_theta)
+{
+    return MAX(cos_theta, 0.0f)*(1.0f/3.1415926f);
+}
+
+// NOTE(ajeej): 8 directions of sample_cosine_hemisphere at once, the normals,
+// the uniforms and the directions are 8 wide arrays of every component
+static void
+sample_cosine_hemisphere8(f32 *nx, f32 *ny, f32 *nz, f32 *u0, f32 *u1,
+                          f32 *dx, f32 *dy, f32 *dz)
+{
+#if defined(__AVX2__)
+    __m256 n_x = _mm256_loadu_ps(nx), n_y = _mm256_loadu_ps(ny), n_z = _mm256_loadu_ps(nz);
+    __m256 one = _mm256_set1_ps(1.0f);
+    __m256 sign_bit = _mm256_set1_ps(-0.0f);
+    
+    __m256 sign = _mm256_or_ps(one, _mm256_and_ps(n_z, sign_bit));
+    __m256 a = _mm256_div_ps(_mm256_set1_ps(-1.0f), _mm256_add_ps(sign, n_z));
+    __m256 c = _mm256_mul_ps(_mm256_mul_ps(n_x, n_y), a);
+    __m256 sign_x = _mm256_mul_ps(sign, n_x);
+    __m256 t_x = _mm256_add_ps(one, _mm256_mul_ps(_mm256_mul_ps(sign_x, n_x), a));
+    __m256 t_y = _mm256_mul_ps(sign, c);
+    __m256 t_z = _mm256_xor_ps(sign_x, sign_bit);
+    __m256 b_y = _mm256_add_ps(sign, _mm256_mul_ps(_mm256_mul_ps(n_y, n_y), a));
+    __m256 b_z = _mm256_xor_ps(n_y, sign_bit);
+    
+    // NOTE(ajeej): sin_cos_turns on every lane
+    __m256 turns = _mm256_loadu_ps(u1);
+    __m256 q = _mm256_floor_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(4.0f), turns),
+                                             _mm256_set1_ps(0.5f)));
+    __m256 x = _mm256_mul_ps(_mm256_sub_ps(turns, _mm256_mul_ps(_mm256_set1_ps(0.25f), q)),
+                             _mm256_set1_ps(2*3.1415926f));
+    __m256 x2 = _mm256_mul_ps(x, x);
+    __m256 ps = _mm256_add_ps(_mm256_set1_ps(1.0f/120.0f), _mm256_mul_ps(x2, _mm256_set1_ps(-1.0f/5040.0f)));
+    ps = _mm256_add_ps(_mm256_set1_ps(-1.0f/6.0f), _mm256_mul_ps(x2, ps));
+    ps = _mm256_mul_ps(x, _mm256_add_ps(one, _mm256_mul_ps(x2, ps)));
+    __m256 pc = _mm256_add_ps(_mm256_set1_ps(-1.0f/720.0f), _mm256_mul_ps(x2, _mm256_set1_ps(1.0f/40320.0f)));
+    pc = _mm256_add_ps(_mm256_set1_ps(1.0f/24.0f), _mm256_mul_ps(x2, pc));
+    pc = _mm256_add_ps(_mm256_set1_ps(-0.5f), _mm256_mul_ps(x2, pc));
+    pc = _mm256_add_ps(one, _mm256_mul_ps(x2, pc));
+    
+    __m256i quadrant = _mm256_cvttps_epi32(q);
+    __m256 swap = _mm256_castsi256_ps(_mm256_slli_epi32(quadrant, 31));
+    __m256 s = _mm256_blendv_ps(ps, pc, swap);
+    __m256 cs = _mm256_blendv_ps(pc, ps, swap);
+    __m256 sin_sign = _mm256_castsi256_ps(_mm256_slli_epi32(quadrant, 30));
+    __m256 cos_sign = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_add_epi32(quadrant, _mm256_set1_epi32(1)), 30));
+    s = _mm256_xor_ps(s, _mm256_and_ps(sin_sign, sign_bit));
+    cs = _mm256_xor_ps(cs, _mm256_and_ps(cos_sign, sign_bit));
+    
+    __m256 u = _mm256_loadu_ps(u0);
+    __m256 r = _mm256_sqrt_ps(u);
+    __m256 z = _mm256_sqrt_ps(_mm256_max_ps(_mm256_setzero_ps(), _mm256_sub_ps(one, u)));
+    __m256 rc = _mm256_mul_ps(r, cs), rs = _mm256_mul_ps(r, s);
+    
+    _mm256_storeu_ps(dx, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(n_x, z), _mm256_mul_ps(t_x, rc)),
+                                       _mm256_mul_ps(c, rs)));
+    _mm256_storeu_ps(dy, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(n_y, z), _mm256_mul_ps(t_y, rc)),
+                                       _mm256_mul_ps(b_y, rs)));
+    _mm256_storeu_ps(dz, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(n_z, z), _mm256_mul_ps(t_z, rc)),
+                                       _mm256_mul_ps(b_z, rs)));
+#else
+    for(u32 i = 0; i < 8; i++)
+    {
+        vec3 n = {nx[i], ny[i], nz[i]}, dir;
+        sample_cosine_hemisphere(n, u0[i], u1[i], dir);
+        dx[i] = dir[0];
+        dy[i] = dir[1];
+        dz[i] = dir[2];
+    }
+#endif
+}
+
+static void
+sample_uniform_sphere(f32 u0, f32 u1, vec3 dir)
+{
+    f32 s, c;
+    sin_cos_turns(u1, &s, &c);
+    f32 z = 1.0f - 2.0f*u0;
+    f32 r = sqrtf(MAX(0.0f, 1.0f - z*z));
+    dir[0] = r*c;
+    dir[1] = r*s;
+    dir[2] = z;
+}
+
+static f32
+get_uniform_sphere_pdf()
+{
+    return 1.0f/(4*3.1415926f);
+}
+
+// NOTE(ajeej): uniform over the directions within acos(1 - one_minus_cos)
+// of axis, like the directions that see a sphere from outside of it. The
+// cone is given by 1 - cos so narrow ones like the sun keep their precision.
+static void
+sample_cone(vec3 axis, f32 one_minus_cos, f32 u0, f32 u1, vec3 dir)
+{
+    vec3 t, b;
+    get_onb(axis, t, b);
+    
+    f32 s, c;
+    sin_cos_turns(u1, &s, &c);
+    f32 z = 1.0f - u0*one_minus_cos;
+    f32 r = sqrtf(MAX(0.0f, 1.0f - z*z));
+    glm_vec3_scale(axis, z, dir);
+    glm_vec3_muladds(t, r*c, dir);
+    glm_vec3_muladds(b, r*s, dir);
+}
+
+static f32
+get_cone_pdf(f32 one_minus_cos)
+{
+    return 1.0f/(2*3.1415926f*one_minus_cos);
+}
@@ -117,4 +117,23 @@ create_compute_shader(const char *cs)
     glDeleteShader((u32)compute_shader);
     
     return shader_program;
+}
+
+// NOTE(ajeej): builds one program out of a source with several entry points,
+// the stage and the option (if there is one) get defined right after the
+// #version line
+static u32
+create_compute_shader_stage(const char *cs, const char *stage, const char *option)
+{
+    const char *body = strchr(cs, '\n');
+    body = (body) ? body+1 : cs;
+    
+    std::string src(cs, body - cs);
+    src += "#define " + std::string(stage) + "\n";
+    if(option)
+        src += "#define " + std::string(option) + "\n";
+    src += "#line 2\n";
+    src += body;
+    
+    return create_compute_shader(src.c_str());
 }
\ No newline at end of file
@@ -0,0 +1,180 @@
+
+// NOTE(ajeej): index of the queue owned by the calling thread, any
+// thread that is not one of the workers uses the shared last queue
+static thread_local u32 worker_idx = (u32)-1;
+
+static u32
+get_queue_idx(thread_pool_t *pool)
+{
+    return (worker_idx < pool->worker_count) ? worker_idx : pool->worker_count;
+}
+
+// NOTE(ajeej): queued only changes under the lock of the queue the job is
+// in, so it never counts a job that no queue holds
+static bool
+pop_job(thread_pool_t *pool, job_queue_t *queue, job_t *job)
+{
+    std::lock_guard<std::mutex> guard(queue->lock);
+    
+    u32 count = get_stack_count(queue->jobs);
+    if(count == queue->head)
+        return false;
+    
+    *job = queue->jobs[count-1];
+    stack_pop(queue->jobs);
+    if(count-1 == queue->head) {
+        stack_clear(queue->jobs);
+        queue->head = 0;
+    }
+    pool->queued--;
+    
+    return true;
+}
+
+// NOTE(ajeej): without wait a queue that is locked by someone else counts
+// as empty
+static bool
+steal_job(thread_pool_t *pool, job_queue_t *queue, job_t *job, bool wait)
+{
+    std::unique_lock<std::mutex> guard(queue->lock, std::defer_lock);
+    if(wait)
+        guard.lock();
+    else if(!guard.try_lock())
+        return false;
+    
+    u32 count = get_stack_count(queue->jobs);
+    if(count == queue->head)
+        return false;
+    
+    *job = queue->jobs[queue->head++];
+    if(count == queue->head) {
+        stack_clear(queue->jobs);
+        queue->head = 0;
+    }
+    pool->queued--;
+    
+    return true;
+}
+
+// NOTE(ajeej): the other queues are only tried at first, so a thief does not
+// wait on a queue that is busy while another one has work. If that finds
+// nothing but jobs are still queued, they are locked for real, otherwise a
+// worker would go around its loop until the busy queue is free.
+static bool
+run_next_job(thread_pool_t *pool)
+{
+    u32 queue_count = pool->worker_count+1;
+    u32 idx = get_queue_idx(pool);
+    job_t job;
+    
+    bool found = pop_job(pool, pool->queues+idx, &job);
+    for(u32 i = 1; !found && i < queue_count; i++)
+        found = steal_job(pool, pool->queues+(idx+i)%queue_count, &job, false);
+    for(u32 i = 1; !found && pool->queued > 0 && i < queue_count; i++)
+        found = steal_job(pool, pool->queues+(idx+i)%queue_count, &job, true);
+    
+    if(!found)
+        return false;
+    
+    job.func(job.data);
+    if(job.counter)
+        (*job.counter)--;
+    
+    return true;
+}
+
+static void
+worker_proc(thread_pool_t *pool, u32 idx)
+{
+    worker_idx = idx;
+    
+    while(pool->running)
+    {
+        if(run_next_job(pool))
+            continue;
+        
+        std::unique_lock<std::mutex> guard(pool->wake_lock);
+        pool->wake.wait(guard, [pool] { return pool->queued > 0 || !pool->running; });
+    }
+}
+
+static void
+init_thread_pool(thread_pool_t *pool, u32 thread_count)
+{
+    // NOTE(ajeej): the thread waiting on the jobs helps run them, so by
+    // default there is one worker less than there are cores
+    if(thread_count == 0) {
+        u32 cores = std::thread::hardware_concurrency();
+        thread_count = (cores > 1) ? cores-1 : 0;
+    }
+    
+    pool->worker_count = thread_count;
+    pool->queues = new job_queue_t[thread_count+1];
+    for(u32 i = 0; i < thread_count+1; i++) {
+        pool->queues[i].jobs = NULL;
+        pool->queues[i].head = 0;
+    }
+    
+    pool->queued = 0;
+    pool->running = true;
+    
+    pool->threads = new std::thread[thread_count];
+    for(u32 i = 0; i < thread_count; i++)
+        pool->threads[i] = std::thread(worker_proc, pool, i);
+}
+
+static void
+free_thread_pool(thread_pool_t *pool)
+{
+    {
+        std::lock_guard<std::mutex> guard(pool->wake_lock);
+        pool->running = false;
+    }
+    pool->wake.notify_all();
+    
+    for(u32 i = 0; i < pool->worker_count; i++)
+        pool->threads[i].join();
+    
+    for(u32 i = 0; i < pool->worker_count+1; i++)
+        if(pool->queues[i].jobs)
+            stack_free(pool->queues[i].jobs);
+    
+    delete[] pool->threads;
+    delete[] pool->queues;
+}
+
+static void
+push_job(thread_pool_t *pool, job_func_t *func, void *data,
+         std::atomic<u32> *counter)
+{
+    job_queue_t *queue = pool->queues+get_queue_idx(pool);
+    
+    if(counter)
+        (*counter)++;
+    
+    {
+        std::lock_guard<std::mutex> guard(queue->lock);
+        job_t *job = (job_t *)stack_push(&queue->jobs);
+        job->func = func;
+        job->data = data;
+        job->counter = counter;
+        pool->queued++;
+    }
+    
+    {
+        std::lock_guard<std::mutex> guard(pool->wake_lock);
+    }
+    pool->wake.notify_one();
+}
+
+// NOTE(ajeej): runs queued jobs on the calling thread until every
+// job that was pushed with this counter is done
+static void
+wait_for_jobs(thread_pool_t *pool, std::atomic<u32> *counter)
+{
+    while(*counter > 0)
+    {
+        if(!run_next_job(pool))
+            std::this_thread::yield();
+    }
+}
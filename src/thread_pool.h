@@ -0,0 +1,34 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+typedef void job_func_t(void *data);
+
+struct job_t {
+    job_func_t *func;
+    void *data;
+    std::atomic<u32> *counter;
+};
+
+// NOTE(ajeej): every worker owns one of these. The owner pushes and
+// pops at the back, other workers steal from the front.
+struct job_queue_t {
+    std::mutex lock;
+    STACK(job_t) *jobs;
+    u32 head;
+};
+
+struct thread_pool_t {
+    std::thread *threads;
+    u32 worker_count;
+    
+    // NOTE(ajeej): worker_count+1 queues, the last one is used by
+    // any thread that is not a worker (usually the main thread)
+    job_queue_t *queues;
+    
+    std::atomic<u32> queued;
+    std::atomic<bool> running;
+    std::mutex wake_lock;
+    std::condition_variable wake;
+};
+
+#endif //THREAD_POOL_H